@@ -0,0 +1,241 @@
+/* arena.h -- Bump-allocator holding the text of a buffer.
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 Steve Kemp https://steve.kemp.fi/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * The text of a file we load is carved out of a small number of large
+ * blocks, rather than allocated line by line, so that the whole lot can
+ * be released in one go when the buffer is killed.
+ */
+#define ARENA_BLOCK (1024 * 1024)
+
+
+
+/*
+ * The initial size of the table of interned strings.
+ */
+#define ARENA_SLOTS 1024
+
+
+
+/*
+ * A single block of memory.
+ */
+typedef struct ArenaBlock
+{
+    /*
+     * The block allocated before this one.
+     */
+    struct ArenaBlock *next;
+
+    /*
+     * Bytes used, and bytes available, in `data`.
+     */
+    size_t used;
+    size_t size;
+
+    char data[];
+
+} ArenaBlock;
+
+
+
+/*
+ * An arena is the list of the blocks we've allocated.
+ */
+typedef struct Arena
+{
+    /*
+     * The most recently allocated block.
+     */
+    ArenaBlock *head;
+
+    /*
+     * Total size of all our blocks.
+     */
+    size_t bytes;
+
+    /*
+     * If set, identical strings copied into the arena share one copy.
+     *
+     * Those we've seen are held in an open-addressed hash-table of
+     * `slots` entries, `count` of which are in use.
+     */
+    int intern;
+    char **table;
+    size_t slots;
+    size_t count;
+
+} Arena;
+
+
+
+/*
+ * Allocate `len` bytes from the arena.
+ *
+ * The memory may not be freed, or reallocated, on its own.
+ */
+char *arena_alloc(Arena *A, size_t len)
+{
+    ArenaBlock *b = A->head;
+
+    if (b == NULL || b->size - b->used < len)
+    {
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->next = A->head;
+        b->used = 0;
+        b->size = size;
+
+        A->head = b;
+        A->bytes += size;
+    }
+
+    char *p = b->data + b->used;
+    b->used += len;
+    return p;
+}
+
+
+/*
+ * Hash the `len` bytes at `s`, via FNV-1a.
+ */
+size_t arena_hash(const char *s, size_t len)
+{
+    size_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+
+/*
+ * Find the slot of the table which holds the string `s`, of `len` bytes,
+ * or the empty slot where it belongs.
+ */
+char **arena_slot(Arena *A, const char *s, size_t len)
+{
+    size_t i = arena_hash(s, len) & (A->slots - 1);
+
+    while (A->table[i] != NULL)
+    {
+        char *p = A->table[i];
+
+        if (memcmp(p, s, len) == 0 && p[len] == '\0')
+            break;
+
+        i = (i + 1) & (A->slots - 1);
+    }
+
+    return &A->table[i];
+}
+
+
+/*
+ * Copy the `len` bytes at `s` into the arena, adding a trailing NUL.
+ *
+ * If we're interning, and we've already copied the same string, the
+ * earlier copy is returned instead, so the result must not be changed.
+ */
+char *arena_strndup(Arena *A, const char *s, size_t len)
+{
+    char **slot = NULL;
+
+    if (A->intern)
+    {
+        /*
+         * Grow the table once it is half full.
+         */
+        if (A->count * 2 >= A->slots)
+        {
+            char **old = A->table;
+            size_t slots = A->slots;
+
+            A->slots = slots ? slots * 2 : ARENA_SLOTS;
+            A->table = calloc(A->slots, sizeof(char *));
+
+            for (size_t i = 0; i < slots; i++)
+                if (old[i] != NULL)
+                    *arena_slot(A, old[i], strlen(old[i])) = old[i];
+
+            free(old);
+        }
+
+        slot = arena_slot(A, s, len);
+
+        if (*slot != NULL)
+            return *slot;
+    }
+
+    char *p = arena_alloc(A, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+
+    if (slot != NULL)
+    {
+        *slot = p;
+        A->count += 1;
+    }
+
+    return p;
+}
+
+
+/*
+ * Free all the memory held by the arena.
+ */
+void arena_free(Arena *A)
+{
+    while (A->head)
+    {
+        ArenaBlock *b = A->head;
+        A->head = b->next;
+        free(b);
+    }
+
+    free(A->table);
+    A->table = NULL;
+    A->slots = 0;
+    A->count = 0;
+    A->bytes = 0;
+}
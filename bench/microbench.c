@@ -0,0 +1,278 @@
+/* microbench.c - Micro-benchmarks for the hot-paths of the editor.
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 Salvatore Sanfilippo <antirez at gmail dot com>
+ *
+ * Copyright (C) 2016 Steve Kemp https://steve.kemp.fi/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * We're built from the real implementation, minus its main(), so that
+ * we have access to all the internals.
+ */
+#include "../kilua.c"
+
+
+/*
+ * The number of rows used for the row-level benchmarks.
+ */
+#define BENCH_ROWS 100000
+
+/*
+ * A typical line of source-code.
+ */
+#define BENCH_LINE "    for (int i = 0; i < E.file[E.current_file]->numrows; i++) /* comment */"
+
+
+/* Is this the first result we've output? */
+static int first_result = 1;
+
+/* Output a single result, as a member of our JSON array. */
+static void report(const char *name, long ops, double us)
+{
+    printf("%s    {\"name\": \"%s\", \"ops\": %ld, \"total_ms\": %.3f, \"ns_per_op\": %.1f}",
+           first_result ? "" : ",\n", name, ops, us / 1000.0,
+           ops ? (us * 1000.0) / ops : 0);
+    first_result = 0;
+}
+
+/* Create a new, empty, buffer with the given name and make it current. */
+static void new_buffer(const char *name)
+{
+    editorCreateBuffer(name);
+}
+
+/* Fill the current buffer with `count` copies of our sample line. */
+static void fill_buffer(int count)
+{
+    for (int i = 0; i < count; i++)
+        editorInsertRow(E.file[E.current_file], E.file[E.current_file]->numrows, BENCH_LINE, strlen(BENCH_LINE));
+}
+
+
+/* Insert and delete rows, at the end and the start of a large buffer. */
+static void bench_rows(void)
+{
+    new_buffer("*rows*");
+
+    double t = monotonic_us();
+    fill_buffer(BENCH_ROWS);
+    report("insert_row_append", BENCH_ROWS, monotonic_us() - t);
+
+    t = monotonic_us();
+
+    for (int i = 0; i < 1000; i++)
+        editorInsertRow(E.file[E.current_file], 0, BENCH_LINE, strlen(BENCH_LINE));
+
+    report("insert_row_head", 1000, monotonic_us() - t);
+
+    t = monotonic_us();
+
+    for (int i = 0; i < 1000; i++)
+        editorDelRow(E.file[E.current_file], 0);
+
+    report("del_row_head", 1000, monotonic_us() - t);
+
+    t = monotonic_us();
+
+    while (E.file[E.current_file]->numrows)
+        editorDelRow(E.file[E.current_file], E.file[E.current_file]->numrows - 1);
+
+    report("del_row_tail", BENCH_ROWS, monotonic_us() - t);
+
+    kill_buffer_lua(lua);
+}
+
+
+/* Re-highlight real files, with the syntax defined by kilua.lua. */
+static void bench_syntax(void)
+{
+    struct
+    {
+        char *syntax;
+        char *corpus;
+    } langs[] =
+    {
+        { "c", "kilua.c" },
+        { "lua", "kilua.lua" },
+        { "md", "README.md" },
+        { "txt", "README.md" },
+        { "Makefile", "Makefile" },
+        { "pl", "kilua.c" },
+        { "sh", "bench/run.sh" },
+    };
+
+    for (unsigned int l = 0; l < sizeof(langs) / sizeof(langs[0]); l++)
+    {
+        char name[64];
+
+        new_buffer("*syntax*");
+        editorOpen(langs[l].corpus);
+
+        lua_getglobal(lua, "set_syntax");
+        lua_pushstring(lua, langs[l].syntax);
+
+        if (lua_pcall(lua, 1, 0, 0) != 0)
+        {
+            fprintf(stderr, "set_syntax(%s) failed: %s\n", langs[l].syntax, lua_tostring(lua, -1));
+            exit(1);
+        }
+
+        struct fileState *f = E.file[E.current_file];
+        double t = monotonic_us();
+
+        for (int i = 0; i < f->numrows; i++)
+            editorUpdateSyntax(f, &f->row[i]);
+
+        snprintf(name, sizeof(name), "update_syntax_%s", langs[l].syntax);
+        report(name, f->numrows, monotonic_us() - t);
+
+        kill_buffer_lua(lua);
+    }
+}
+
+
+/* Serialize a large buffer, as save() does. */
+static void bench_rows_to_string(void)
+{
+    new_buffer("*string*");
+    fill_buffer(BENCH_ROWS);
+
+    double t = monotonic_us();
+
+    for (int i = 0; i < 10; i++)
+    {
+        int len;
+        free(editorRowsToString(E.file[E.current_file], &len));
+    }
+
+    report("rows_to_string", 10, monotonic_us() - t);
+    kill_buffer_lua(lua);
+}
+
+
+/* Search through a file, for a literal string and a regular expression. */
+static void bench_search(void)
+{
+    struct
+    {
+        char *name;
+        char *term;
+    } terms[] =
+    {
+        { "search_literal_miss", "notInTheFile" },
+        { "search_regex_miss", "not[0-9]+InThe(File|Buffer)" },
+        { "search_literal_hit", "editorRow" },
+        { "search_regex_hit", "editor[A-Z][a-z]+\\(" },
+    };
+
+    new_buffer("*search*");
+    editorOpen("kilua.c");
+
+    for (unsigned int i = 0; i < sizeof(terms) / sizeof(terms[0]); i++)
+    {
+        warp(0, 0);
+
+        double t = monotonic_us();
+
+        for (int j = 0; j < 100; j++)
+        {
+            lua_pushstring(lua, terms[i].term);
+            search_lua(lua);
+            lua_pop(lua, 2);
+        }
+
+        report(terms[i].name, 100, monotonic_us() - t);
+    }
+
+    kill_buffer_lua(lua);
+}
+
+
+/* Draw the screen, as we scroll through a highlighted file. */
+static void bench_refresh(void)
+{
+    new_buffer("*refresh*");
+    editorOpen("kilua.c");
+
+    E.outfd = open("/dev/null", O_WRONLY);
+
+    long bytes = 0;
+    int frames = 0;
+    double t = monotonic_us();
+
+    for (int y = 0; y < E.file[E.current_file]->numrows; y += E.screenrows / 2)
+    {
+        warp(0, y);
+        bytes += editorRefreshScreen();
+        frames += 1;
+    }
+
+    report("refresh_screen", frames, monotonic_us() - t);
+
+    printf(",\n    {\"name\": \"refresh_screen_bytes\", \"ops\": %d, \"bytes_per_op\": %ld}",
+           frames, frames ? bytes / frames : 0);
+
+    close(E.outfd);
+    E.outfd = STDOUT_FILENO;
+    kill_buffer_lua(lua);
+}
+
+
+/* Entry point. */
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    initEditor();
+
+    /*
+     * A fixed screen-size, so that results are comparable.
+     */
+    editorResizeScreen(50, 132);
+
+    if (!load_lua("kilua.lua"))
+    {
+        fprintf(stderr, "Failed to load kilua.lua - run from the top of the source tree\n");
+        return 1;
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"results\": [\n", _VERSION);
+
+    bench_rows();
+    bench_syntax();
+    bench_rows_to_string();
+    bench_search();
+    bench_refresh();
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
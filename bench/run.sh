@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Replay our standard workloads through kilua, reporting the
+# key-to-frame latency of each.
+#
+# Usage: bench/run.sh [path/to/kilua]
+#
+# The size of the open/save workload defaults to 100Mb, and may be
+# changed by setting $BENCH_MB.
+#
+
+
+KILUA=${1:-./kilua}
+BENCH_MB=${BENCH_MB:-100}
+
+#
+# The screen size we pretend to have.
+#
+LINES=${LINES:-50}
+COLUMNS=${COLUMNS:-132}
+export LINES COLUMNS
+
+#
+# Scratch directory for our workloads.
+#
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+
+#
+# Some C source to edit - two copies of our own implementation.
+#
+cat kilua.c kilua.c > "$TMP/source.c"
+
+
+#
+# typing: Several thousand characters of prose, entered a key at a time.
+#
+awk 'BEGIN { for (i = 0; i < 100; i++) printf "The quick brown fox jumps over the lazy dog, line %d.\r", i }' \
+    > "$TMP/typing.keys"
+
+#
+# paste: A chunk of C source arriving at once, into a highlighted buffer.
+#
+head -n 300 kilua.c | tr '\n' '\r' > "$TMP/paste.keys"
+
+#
+# scroll: Page down through a large file, and back up again.
+#
+awk 'BEGIN { for (i = 0; i < 500; i++) printf "\033[6~"; for (i = 0; i < 500; i++) printf "\033[5~" }' \
+    > "$TMP/scroll.keys"
+
+#
+# find: Interactive search, stepping through the matches.
+#
+# NOTE: find() reads the rest of the keys itself, so this is timed as
+#       a single frame.
+#
+awk 'BEGIN { printf "\006editorRow"; for (i = 0; i < 200; i++) printf "\033[B"; printf "\r" }' \
+    > "$TMP/find.keys"
+
+#
+# cut: Repeatedly mark a region of ten lines, and cut it.
+#
+awk 'BEGIN { for (i = 0; i < 20; i++) { printf "%c", 0; for (j = 0; j < 10; j++) printf "\033[B"; printf "\027" } }' \
+    > "$TMP/cut.keys"
+
+#
+# save: Write out a large file.
+#
+printf '\023' > "$TMP/save.keys"
+awk -v mb="$BENCH_MB" 'BEGIN { n = mb * 1024 * 1024 / 64; for (i = 0; i < n; i++) printf "%08d: the quick brown fox jumps over the lazy dog, again.\n", i }' \
+    > "$TMP/large.log"
+
+
+#
+# Run each workload against a fresh copy of its input.
+#
+run() {
+    keys=$1
+    file=$2
+
+    cp "$TMP/$file" "$TMP/input.${file##*.}" 2>/dev/null || : > "$TMP/input.${file##*.}"
+    "$KILUA" --replay "$TMP/$keys" --bench "$TMP/input.${file##*.}" || exit 1
+}
+
+: > "$TMP/empty.txt"
+
+run typing.keys empty.txt
+run paste.keys  empty.c
+run scroll.keys source.c
+run find.keys   source.c
+run cut.keys    source.c
+run save.keys   large.log
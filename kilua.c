@@ -38,12 +38,14 @@
 
 #define _BSD_SOURCE
 #define _GNU_SOURCE 1
+#define _FILE_OFFSET_BITS 64
 
 #include <termios.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 #if !defined(__MACH__)
 #include <malloc.h>
@@ -58,6 +60,17 @@
 #include <time.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "kilua.h"
 
@@ -81,29 +94,31 @@ void disableRawMode(int fd)
 /* Called at exit to avoid remaining in raw mode, and clear the screen */
 void editorAtExit(void)
 {
-#ifdef _UNDO
-    /* kill our undo stack, to prevent valgrind leaks */
-    us_clear(E.file[E.current_file]->undo);
-    free(E.file[E.current_file]->undo);
-#endif
+    /* free all our buffers, to prevent valgrind leaks */
+    for (int i = 0; i < E.max_files; i++)
+        editorFreeBuffer(E.file[i]);
 
-    /* free all our rows */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-    {
-        editorFreeRow(&E.file[E.current_file]->row[i]);
-    }
+    editorFreeWindow(E.root);
+    E.root = E.window = NULL;
 
-    free(E.file[E.current_file]->row);
+    if (E.inotify != -1)
+        close(E.inotify);
+    E.inotify = -1;
+
+    free(E.file);
+    free(E.by_id);
+    free(E.by_name);
+    E.file = E.by_id = E.by_name = NULL;
+    E.max_files = E.file_size = E.hash_size = 0;
+
+    for (int i = 0; i < E.log.count; i++)
+        free(E.log.lines[(E.log.start + i) % KILO_LOG_LINES]);
+
+    E.log.count = 0;
 
     /* close lua */
     lua_close(lua);
 
-    if (E.file[E.current_file]->filename)
-    {
-        free(E.file[E.current_file]->filename);
-        E.file[E.current_file]->filename = NULL;
-    }
-
     /* reset our input-mode and clear the screen. */
     disableRawMode(STDIN_FILENO);
     printf("\033[2J\033[1;1H");
@@ -150,13 +165,55 @@ fatal:
 }
 
 
-/* Read a key from raw-mode terminal, try to expand escape sequences. */
+/* Read a key, recording it if we're defining a keyboard macro.
+ *
+ * If we're replaying a macro the key comes from that instead. */
 int editorReadKey(int fd)
+{
+    if (E.macro.playing)
+    {
+        if (E.macro.pos < E.macro.len)
+            return E.macro.keys[E.macro.pos++];
+
+        return ESC;
+    }
+
+    /* There is nobody to type anything when we're running headless. */
+    if (E.headless)
+        return ESC;
+
+    int key = editorReadRawKey(fd);
+
+    if (E.macro.recording)
+    {
+        if (E.macro.len == E.macro.size)
+        {
+            E.macro.size = E.macro.size ? E.macro.size * 2 : 64;
+            E.macro.keys = realloc(E.macro.keys, sizeof(int) * E.macro.size);
+        }
+
+        E.macro.keys[E.macro.len++] = key;
+    }
+
+    return key;
+}
+
+/* Read a key from raw-mode terminal, try to expand escape sequences. */
+int editorReadRawKey(int fd)
 {
     int nread;
     char c, seq[3];
 
-    while ((nread = read(fd, &c, 1)) == 0);
+    while ((nread = read(fd, &c, 1)) == 0)
+    {
+        /* Outside raw-mode there's no timeout, so this is EOF. */
+        if (!E.rawmode)
+            return ESC;
+
+        /* Redraw a prompt, or menu, which is waiting upon a resize. */
+        if (editorCheckResize())
+            editorRefreshScreen();
+    }
 
     if (nread == -1) exit(1);
 
@@ -245,14 +302,48 @@ int editorReadKey(int fd)
 }
 
 
-/* Record the size of our window */
+/* Record the size of our window.
+ *
+ * If we're not attached to a terminal, for example when running in
+ * batch-mode, we fall back to $LINES/$COLUMNS and then to 80x24. */
 void getWindowSize()
 {
     struct winsize w;
-    ioctl(0, TIOCGWINSZ, &w);
 
-    E.screenrows = w.ws_row;
-    E.screencols = w.ws_col;
+    if (ioctl(0, TIOCGWINSZ, &w) == 0 && w.ws_row > 0 && w.ws_col > 0)
+    {
+        E.screenrows = w.ws_row;
+        E.screencols = w.ws_col;
+        return;
+    }
+
+    char *lines = getenv("LINES");
+    char *cols  = getenv("COLUMNS");
+
+    E.screenrows = (lines && atoi(lines) > 0) ? atoi(lines) : 24;
+    E.screencols = (cols && atoi(cols) > 0) ? atoi(cols) : 80;
+}
+
+/* SIGWINCH handler: note that the terminal changed size. */
+void editorWindowChanged(int sig)
+{
+    (void)sig;
+    E.resized = 1;
+}
+
+/* If the terminal changed size lay our windows out again, returning
+ * true if we did.
+ *
+ * Wrapped buffers rebuild their index when next drawn at the new width. */
+int editorCheckResize(void)
+{
+    if (!E.resized)
+        return 0;
+
+    E.resized = 0;
+    getWindowSize();
+    editorResizeScreen(E.screenrows, E.screencols);
+    return 1;
 }
 
 
@@ -261,24 +352,47 @@ void getWindowSize()
 /* ======================= Utility Functions ====================== */
 
 
-/* Call a lua function which accepts a single string argument
- * and returns no result. */
-void call_lua(char *function, char *arg)
+/* Call a lua function which accepts a single string argument.
+ *
+ * Returns the truthiness of the value the function returned, if any. */
+int call_lua(char *function, char *arg)
 {
+    int ret = 0;
+
     lua_getglobal(lua, function);
 
     if (lua_isnil(lua, -1))
     {
+        lua_pop(lua, 1);
         editorSetStatusMessage(1, "Failed to find function %s", function);
-        return;
+        return 0;
     }
 
     lua_pushstring(lua, arg);
 
-    if (lua_pcall(lua, 1, 0, 0) != 0)
+    stats_start(&E.stats, STAT_LUA);
+
+    if (lua_pcall(lua, 1, 1, 0) != 0)
     {
         editorSetStatusMessage(1, "%s failed %s", function, lua_tostring(lua, -1));
     }
+    else
+    {
+        ret = lua_toboolean(lua, -1);
+    }
+
+    lua_pop(lua, 1);
+
+    stats_stop(&E.stats, STAT_LUA);
+    return ret;
+}
+
+/* Return a monotonic timestamp, in microseconds. */
+double monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000.0) + (ts.tv_nsec / 1000.0);
 }
 
 /* Reverse a C-string, in-place */
@@ -305,15 +419,24 @@ char at()
 
     if (row)
     {
-        if (E.file[E.current_file]->cx < row->rsize)
-            tmp[0] = row->render[E.file[E.current_file]->cx];
+        editorRowWarm(E.file[E.current_file], row);
+
+        if (E.file[E.current_file]->cx < row->size)
+            tmp[0] = row->chars[E.file[E.current_file]->cx];
     }
 
     return (tmp[0]);
 }
 
+/* Move the cursor to the given column and row of the buffer.
+ *
+ * The cursor is placed directly, scrolling as goto_line() does, so that
+ * undoing a long run of changes doesn't step down from the top of the
+ * buffer for each of them. */
 void warp(int x, int y)
 {
+    struct fileState *f = E.file[E.current_file];
+
     if (y < 0)
         y = 0;
 
@@ -321,34 +444,71 @@ void warp(int x, int y)
         x = 0;
 
     /*
-     * Move to top-left
+     * Binary files have their own idea of rows and columns.
      */
-    E.file[E.current_file]->cx = E.file[E.current_file]->coloff = E.file[E.current_file]->cy = E.file[E.current_file]->rowoff = 0;
+    if (f->hex)
+    {
+        f->cx = f->coloff = f->cy = f->rowoff = 0;
+
+        while (y-- > 0)
+            editorHexMove(f, ARROW_DOWN);
+
+        while (x-- > 0)
+            editorHexMove(f, ARROW_RIGHT);
 
-    /*
-     * Is that where we wanted to go?
-     */
-    if (x == 0 && y == 0)
         return;
+    }
+
+    if (y >= f->numrows)
+        y = f->numrows > 0 ? f->numrows - 1 : 0;
 
     /*
-     * Move down first - that should always work.
+     * Keep within the row, and off the middle of a multi-byte character.
      */
-    while (y > 0)
+    erow *row = y < f->numrows ? &f->row[y] : NULL;
+
+    if (row)
     {
-        editorMoveCursor(ARROW_DOWN);
-        y -= 1;
+        editorRowWarm(f, row);
+
+        if (x > row->size)
+            x = row->size;
+        else if (x < row->size)
+            x = editorRowCharStart(f, row, x);
     }
+    else
+        x = 0;
 
     /*
-     * Now move right.
+     * Show the row in the middle of the screen, if it isn't on it.
      */
-    while (x > 0)
+    if (y < f->rowoff || y >= f->rowoff + E.screenrows)
     {
-        editorMoveCursor(ARROW_RIGHT);
-        x -= 1;
+        f->rowoff = y > E.screenrows / 2 ? y - E.screenrows / 2 : 0;
+        f->wrapoff = 0;
+    }
+
+    f->cy = y - f->rowoff;
+
+    if (editorWrapping(f))
+    {
+        f->cx = x;
+        f->coloff = 0;
+        editorWrapCheck(f, E.screencols);
+        editorWrapScroll(f, E.screenrows, E.screencols);
+    }
+    else if (x > E.screencols - 1)
+    {
+        f->coloff = x - E.screencols + 1;
+        f->cx = E.screencols - 1;
+    }
+    else
+    {
+        f->coloff = 0;
+        f->cx = x;
     }
 
+    editorPagerCheck(f);
 }
 
 /* Get the text which is currently selected - i.e. between mark & cursor */
@@ -458,20 +618,23 @@ char *get_selection()
 
 /* Is the current buffer dirty? */
 int dirty()
+{
+    return editorBufferDirty(E.file[E.current_file]);
+}
+
+/* Is the given buffer modified & unsaved? */
+int editorBufferDirty(struct fileState *f)
 {
     /*
      * If the filename starts with a "*" it is never dirty
      */
-    if (E.file[E.current_file]->filename &&
-            E.file[E.current_file]->filename[0] == '*')
-    {
+    if (f->filename && f->filename[0] == '*')
         return 0;
-    }
 
     /*
      * Otherwise use the dirty-count.
      */
-    if (E.file[E.current_file]->dirty != 0)
+    if (f->dirty != 0)
         return 1;
     else
         return 0;
@@ -481,44 +644,47 @@ int dirty()
 /* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int editorOpen(char *filename)
+{
+    return editorOpenAs(filename, -1);
+}
+
+/* Load the given file, as `editorOpen`, but shown as hex if `hex` is 1, as
+ * text if it is 0, or as whichever suits its contents if it is -1. */
+int editorOpenAs(char *filename, int hex)
 {
     /*
      * Opened a file already?  Free the memory.
      */
-    if (E.file[E.current_file]->numrows)
-    {
-        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-        {
-            erow *row = &E.file[E.current_file]->row[i];
-            free(row->chars);
-            row->chars = NULL;
-            free(row->render);
-            row->render = NULL;
-            free(row->hl);
-            row->hl = NULL;
-        }
+    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+        editorFreeRow(&E.file[E.current_file]->row[i]);
 
-        free(E.file[E.current_file]->row);
-        E.file[E.current_file]->row = NULL;
-    }
+    free(E.file[E.current_file]->row);
+    E.file[E.current_file]->row = NULL;
+    E.file[E.current_file]->version++;
+    arena_free(&E.file[E.current_file]->arena);
+    editorColdFree(E.file[E.current_file]);
+    editorWrapFree(E.file[E.current_file]);
 
     FILE *fp;
+    editorFollowStop(E.file[E.current_file]);
+    editorPagerFree(E.file[E.current_file]->pager);
+    E.file[E.current_file]->pager = NULL;
+    editorHexFree(E.file[E.current_file]->hex);
+    E.file[E.current_file]->hex = NULL;
+    E.file[E.current_file]->gzip = 0;
+    E.file[E.current_file]->crlf = 0;
+    editorScanReset(&E.file[E.current_file]->scan);
     E.file[E.current_file]->dirty = 0;
     E.file[E.current_file]->cx = 0;
     E.file[E.current_file]->cy = 0;
     E.file[E.current_file]->rowoff = 0;
     E.file[E.current_file]->coloff = 0;
+    E.file[E.current_file]->wrapoff = 0;
     E.file[E.current_file]->markx = -1;
     E.file[E.current_file]->marky = -1;
     E.file[E.current_file]->numrows = 0;
 
-    if (filename)
-        free(E.file[E.current_file]->filename);
-
-    if (filename)
-        E.file[E.current_file]->filename = strdup(filename);
-    else
-        E.file[E.current_file]->filename = NULL;
+    editorSetBufferName(E.file[E.current_file], filename);
 
 #ifdef _UNDO
     /* kill our undo stack */
@@ -537,29 +703,113 @@ int editorOpen(char *filename)
                 exit(1);
             }
 
+            editorDiskRecord(E.file[E.current_file]);
+
             /* invoke our lua callback function, even if opening failed.*/
             call_lua("on_loaded", E.file[E.current_file]->filename);
 
             return 1;
         }
 
+#ifdef _GZIP
+
+        /*
+         * Compressed files are decompressed as they're read.
+         */
+        if (hex != 1 && editorGzipped(fp))
+        {
+            fclose(fp);
+            int err = editorGzipLoad(E.file[E.current_file], filename);
+            editorScanEnd(&E.file[E.current_file]->scan);
+            E.file[E.current_file]->crlf = E.file[E.current_file]->scan.dos == 1;
+
+            /* If we read only part of it the buffer isn't the file. */
+            E.file[E.current_file]->dirty = err;
+            editorDiskRecord(E.file[E.current_file]);
+            call_lua("on_loaded", E.file[E.current_file]->filename);
+            return err;
+        }
+
+#endif
+
+        /*
+         * Binary files are shown as hex, unless we were told otherwise.
+         */
+        if (hex == -1)
+        {
+            char *buf = malloc(KILO_HEX_SNIFF);
+            size_t n = fread(buf, 1, KILO_HEX_SNIFF, fp);
+
+            editorScanText(&E.file[E.current_file]->scan, buf, n);
+            hex = editorScanBinary(&E.file[E.current_file]->scan);
+            free(buf);
+            rewind(fp);
+        }
+
+        if (hex == 1 && editorHexOpen(E.file[E.current_file], filename) == 0)
+        {
+            fclose(fp);
+            editorDiskRecord(E.file[E.current_file]);
+            call_lua("on_loaded", E.file[E.current_file]->filename);
+            return 0;
+        }
+
+        editorScanReset(&E.file[E.current_file]->scan);
+
+        /*
+         * Large files are paged through, rather than loaded.
+         */
+        struct stat st;
+
+        if (fstat(fileno(fp), &st) == 0 && st.st_size >= E.large_file)
+        {
+            fclose(fp);
+            editorPagerOpen(E.file[E.current_file], filename);
+            editorDiskRecord(E.file[E.current_file]);
+            call_lua("on_loaded", E.file[E.current_file]->filename);
+            return 0;
+        }
+
         char *line = NULL;
         size_t linecap = 0;
         ssize_t linelen;
 
         while ((linelen = getline(&line, &linecap, fp)) != -1)
         {
-            if (linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            editorScanText(&E.file[E.current_file]->scan, line, linelen);
+
+            /*
+             * If the first line ended in CRLF we expect they all do, and
+             * the CR is removed along with the LF.
+             */
+            if (linelen && line[linelen - 1] == '\n')
+            {
+                line[--linelen] = '\0';
+
+                if (linelen && line[linelen - 1] == '\r' && E.file[E.current_file]->scan.dos == 1)
+                    line[--linelen] = '\0';
+            }
+            else if (linelen && line[linelen - 1] == '\r')
                 line[--linelen] = '\0';
 
-            editorInsertRow(E.file[E.current_file]->numrows, line, linelen);
+            char *chars = arena_strndup(&E.file[E.current_file]->arena, line, linelen);
+            editorInsertRowChars(E.file[E.current_file], E.file[E.current_file]->numrows, chars, linelen, 1);
+
+            /* Compress as we go, so huge files needn't fit in memory. */
+            if ((E.file[E.current_file]->numrows & 0xFFFF) == 0)
+                editorColdCheck(E.file[E.current_file]);
         }
 
         free(line);
         fclose(fp);
+
+        editorScanEnd(&E.file[E.current_file]->scan);
+        E.file[E.current_file]->crlf = E.file[E.current_file]->scan.dos == 1;
     }
 
     E.file[E.current_file]->dirty = 0;
+    editorDiskRecord(E.file[E.current_file]);
+    editorColdCheck(E.file[E.current_file]);
 
     /* invoke our lua callback function */
     call_lua("on_loaded", E.file[E.current_file]->filename);
@@ -567,2329 +817,7404 @@ int editorOpen(char *filename)
 }
 
 
+/* ============================== Scanning text ============================== */
 
+/*
+ * Files are scanned as they're loaded, so that we know whether they're
+ * valid UTF-8, whether they contain NUL bytes, and how their lines end.
+ */
 
-
-/* ======================= Lua Functions ======================= */
-
-
-/* Accessors */
-
-/* get the character that the current position */
-int at_lua(lua_State *L)
+/* Forget all we've scanned. */
+void editorScanReset(struct editorScan *s)
 {
-    char tmp[2] = {'\n', '\0'};
-    tmp[0] = at();
-    lua_pushstring(L, tmp);
-    return 1;
+    memset(s, 0, sizeof(*s));
+    s->dos = -1;
 }
 
-/* is the buffer dirty? */
-int dirty_lua(lua_State *L)
+/* Scan a single byte. */
+void editorScanByte(struct editorScan *s, unsigned char c)
 {
-    if (dirty())
-        lua_pushboolean(L, 1);
-    else
-        lua_pushboolean(L, 0);
+    /*
+     * Are we within a multi-byte character?
+     */
+    if (s->need)
+    {
+        if (c >= s->lo && c <= s->hi)
+        {
+            s->need -= 1;
+            s->lo = 0x80;
+            s->hi = 0xBF;
+            return;
+        }
 
-    return 1;
-}
-/* return the contents of the line from the point-onwards */
-int get_line_lua(lua_State *L)
-{
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+        /* The sequence is cut short, and this byte starts another. */
+        s->invalid += 1;
+        s->need = 0;
+    }
 
-    if (row)
+    s->lo = 0x80;
+    s->hi = 0xBF;
+
+    if (c < 0x80)
     {
-        lua_pushstring(L, row->chars + E.file[E.current_file]->cx);
-        return 1;
-    }
+        if (c == '\n')
+        {
+            s->lf += 1;
+            s->crlf += s->cr;
 
-    return 0;
-}
+            if (s->dos == -1)
+                s->dos = s->cr;
+        }
+        else if (c == '\0')
+            s->nul += 1;
 
+        s->cr = c == '\r';
+        return;
+    }
 
-/* Movement */
-/* move cursor one character down */
-int down_lua(lua_State *L)
-{
-    (void)L;
-    editorMoveCursor(ARROW_DOWN);
-    return 0;
+    s->cr = 0;
+
+    /*
+     * The lead bytes, and the ranges which exclude overlong forms,
+     * surrogates, and codepoints beyond U+10FFFF from their second byte.
+     */
+    if (c >= 0xC2 && c <= 0xDF)
+        s->need = 1;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        s->need = 2;
+        s->lo = c == 0xE0 ? 0xA0 : 0x80;
+        s->hi = c == 0xED ? 0x9F : 0xBF;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        s->need = 3;
+        s->lo = c == 0xF0 ? 0x90 : 0x80;
+        s->hi = c == 0xF4 ? 0x8F : 0xBF;
+    }
+    else
+        s->invalid += 1;
 }
 
-/* move to end of line */
-int eol_lua(lua_State *L)
+/* Scan `len` bytes of text, which follow those we've already seen. */
+void editorScanText(struct editorScan *s, const char *text, size_t len)
 {
-    (void)L;
+    size_t i = 0;
 
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i nul = _mm_setzero_si128();
+#endif
 
-    if (row)
+    while (i < len)
     {
+#ifdef __SSE2__
+
         /*
-         * Row width.
+         * Most text is ASCII, without CRs or NULs, so sixteen bytes at
+         * a time we need only count the LFs.  Anything else, including
+         * the end of the first line, is scanned a byte at a time.
          */
-        int size = row->rsize;
-        int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-
-        while (x < size)
+        if (s->need == 0 && s->cr == 0 && s->dos != -1 && i + 16 <= len)
         {
-            editorMoveCursor(ARROW_RIGHT);
-            x += 1;
+            __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+            __m128i odd = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, nul));
+
+            if ((_mm_movemask_epi8(v) | _mm_movemask_epi8(odd)) == 0)
+            {
+                s->lf += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)));
+                i += 16;
+                continue;
+            }
         }
-    }
 
-    return 0;
+#endif
+
+        /* Scan until the next multiple of sixteen, where we try again. */
+        size_t next = (i | 15) + 1;
+
+        while (i < len && i < next)
+            editorScanByte(s, text[i++]);
+    }
 }
 
-/* move the cursor one character left */
-int left_lua(lua_State *L)
+/* The text has all been scanned, so a character left unfinished is
+ * invalid. */
+void editorScanEnd(struct editorScan *s)
 {
-    (void)L;
-    editorMoveCursor(ARROW_LEFT);
-    return 0;
+    if (s->need)
+        s->invalid += 1;
+
+    s->need = 0;
 }
 
-/* page down */
-int page_down_lua(lua_State *L)
+/* Does the text we've scanned look like a binary file? */
+int editorScanBinary(struct editorScan *s)
 {
-    (void)L;
+    return s->nul > 0;
+}
 
-    int times = E.screenrows - 1;
 
-    while (times--)
-        down_lua(L);
 
-    return 0;
-}
+/* ============================== Large files ============================== */
 
-/* page up */
-int page_up_lua(lua_State *L)
+/*
+ * Files larger than E.large_file aren't loaded, instead the rows of their
+ * buffer hold a window of KILO_PAGE_LINES lines around the cursor, which
+ * is moved as the cursor approaches its edge.
+ *
+ * When the window is moved any edits made to it are recorded as spans,
+ * which replace lines of the file, and the file is rewritten from the
+ * spans and the original when it is saved.
+ */
+
+/* Hash the contents of a row. */
+uint64_t editorHashRow(erow *row)
 {
-    (void)L;
-    int times = E.screenrows - 1;
+    uint64_t h = 14695981039346656037ULL;
 
-    while (times--)
-        up_lua(L);
+    for (int i = 0; i < row->size; i++)
+    {
+        h ^= (unsigned char)row->chars[i];
+        h *= 1099511628211ULL;
+    }
 
-    return 0;
+    return h;
 }
 
-/* move the cursor one character right */
-int right_lua(lua_State *L)
+/* Read forward through the file, indexing lines as we go, until we've
+ * found the start of the given line, or reached the end of the file.
+ *
+ * Returns 1 if the line exists, 0 otherwise. */
+int editorPagerScan(struct editorPager *p, int64_t line)
 {
-    (void)L;
-    editorMoveCursor(ARROW_RIGHT);
-    return 0;
-}
+    static char buf[1024 * 1024];
 
-/* Move to start of line */
-int sol_lua(lua_State *L)
-{
-    (void)L;
+    while (p->scan_line < line && p->scan_off < p->size)
+    {
+        fseeko(p->fp, p->scan_off, SEEK_SET);
+        size_t n = fread(buf, 1, sizeof(buf), p->fp);
 
-    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+        if (n == 0)
+            break;
 
-    while (x)
-    {
-        editorMoveCursor(ARROW_LEFT);
-        x -= 1;
-    }
+        char *c = buf, *end = buf + n;
 
-    return 0;
-}
+        while (p->scan_line < line && (c = memchr(c, '\n', end - c)) != NULL)
+        {
+            c += 1;
+            p->scan_line += 1;
 
-/* move cursor one character up */
-int up_lua(lua_State *L)
-{
-    (void)L;
-    editorMoveCursor(ARROW_UP);
-    return 0;
-}
+            if (p->scan_line % KILO_INDEX_STEP == 0)
+            {
+                if (p->indexed == p->room)
+                {
+                    p->room *= 2;
+                    p->index = realloc(p->index, sizeof(int64_t) * p->room);
+                }
 
-/* Selection */
+                p->index[p->indexed++] = p->scan_off + (c - buf);
+            }
+        }
 
-/* Delete the text between the point and the mark */
-int cut_selection_lua(lua_State *L)
-{
-    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-    int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+        p->scan_off += c ? (c - buf) : (int64_t)n;
+    }
 
-    /* There is no mark. */
-    if ((E.file[E.current_file]->markx == -1) && (E.file[E.current_file]->marky == -1))
-        return 0;
+    /*
+     * If we reached the end then we know how many lines there are, the
+     * last of which might not have a trailing newline.
+     */
+    if (p->scan_off >= p->size && p->lines < 0)
+    {
+        p->scan_off = p->size;
+        p->lines = p->scan_line;
 
-    /* The cursor is at the mark. */
-    if ((E.file[E.current_file]->markx == x) && (E.file[E.current_file]->marky == y))
-        return 0;
+        fseeko(p->fp, p->size - 1, SEEK_SET);
 
-    int left = 0;
+        if (p->size > 0 && fgetc(p->fp) != '\n')
+            p->lines += 1;
+    }
 
-    if ((y > E.file[E.current_file]->marky) || (x > E.file[E.current_file]->markx && y == E.file[E.current_file]->marky))
-        left = 1;
+    return p->lines < 0 || line < p->lines;
+}
 
-    /* Get the selection text */
-    char *sel = get_selection();
+/* Return the offset at which the given line starts, or the size of the
+ * file if it is beyond the last line. */
+int64_t editorPagerOffset(struct editorPager *p, int64_t line)
+{
+    static char buf[64 * 1024];
 
-    /* Delete the number of characters that the selection includes. */
-    int max = (int)strlen(sel);
+    if (!editorPagerScan(p, line))
+        return p->size;
 
-    if (left == 0)
+    /*
+     * Count forward from the nearest line we've indexed.
+     */
+    int64_t off = p->index[line / KILO_INDEX_STEP];
+    int64_t skip = line % KILO_INDEX_STEP;
+
+    while (skip > 0)
     {
-        for (int i = 0; i < max ; i++)
+        fseeko(p->fp, off, SEEK_SET);
+        size_t n = fread(buf, 1, sizeof(buf), p->fp);
+
+        if (n == 0)
+            return p->size;
+
+        char *c = buf, *end = buf + n;
+
+        while (skip > 0 && (c = memchr(c, '\n', end - c)) != NULL)
         {
-            editorMoveCursor(ARROW_RIGHT);
-            delete_lua(L);
+            c += 1;
+            skip -= 1;
         }
-    }
-    else
-    {
-        /* we want to delete the character under the cursor too - so
-           we move one place right before we remove the characters. */
-        editorMoveCursor(ARROW_RIGHT);
 
-        for (int i = 0; i < max ; i++)
-            delete_lua(L);
+        off += c ? (c - buf) : (int64_t)n;
     }
 
-    /* Cleanup & remove the mark. */
-    free(sel);
-    E.file[E.current_file]->markx = -1;
-    E.file[E.current_file]->marky = -1;
-    return 0;
+    return off;
 }
 
-/* Get the text between the point and the mark */
-int selection_lua(lua_State *L)
+/* Record any edits made to the rows we loaded as a span.
+ *
+ * Rows which are unchanged at the start and end of the buffer are left
+ * alone, so a light edit results in a small span. */
+void editorPagerFlush(struct fileState *f)
 {
-    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-    int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    struct editorPager *p = f->pager;
+
+    if (p->dirty == f->dirty)
+        return;
 
     /*
-     * No selection - either because the mark is not set, and
-     * the cursor is in the mark.
+     * Find the rows which have changed since we loaded them.
      */
-    if ((E.file[E.current_file]->markx == -1) && (E.file[E.current_file]->marky == -1))
+    int lo = 0, hi = p->loaded, now = f->numrows;
+
+    while (lo < hi && lo < now && editorHashRow(&f->row[lo]) == p->hash[lo])
+        lo++;
+
+    while (hi > lo && now > lo && editorHashRow(&f->row[now - 1]) == p->hash[hi - 1])
     {
-        lua_pushnil(L);
-        return 1;
+        hi--;
+        now--;
     }
 
-    if ((E.file[E.current_file]->markx == x) && (E.file[E.current_file]->marky == y))
+    /*
+     * Rows which came from spans are merged into the new span, so that
+     * it starts and ends upon lines of the file.
+     */
+    while (lo > 0 && p->origin[lo - 1] < 0)
+        lo--;
+
+    while (hi < p->loaded && p->origin[hi] < 0)
     {
-        lua_pushnil(L);
-        return 1;
+        hi++;
+        now++;
     }
 
-    char *t = get_selection();
-    lua_pushstring(L, t);
-    free(t);
-    return 1;
+    int64_t first = lo > 0 ? p->origin[lo - 1] + 1 : p->start;
+    int64_t last = hi < p->loaded ? p->origin[hi] : p->end;
 
-}
+    /*
+     * Remove the spans we're replacing.  Every span whose rows lie in
+     * [lo, hi) starts within [first, last), or, adding lines without
+     * replacing any, at `last` itself.
+     */
+    int i = 0, j = 0;
 
+    for (i = 0; i < p->nspans; i++)
+    {
+        struct editorSpan *s = &p->spans[i];
 
-/* Removals */
+        if (s->line >= first && (s->line < last || (s->line == last && s->count == 0)))
+        {
+            for (int k = 0; k < s->nlines; k++)
+                free(s->lines[k]);
 
-/* Delete the char at the current position. */
-int delete_lua(lua_State *L)
-{
-    (void)L;
+            free(s->lines);
+        }
+        else
+        {
+            p->spans[j++] = *s;
+        }
+    }
 
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    p->nspans = j;
 
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+    /*
+     * Add the new one, in order.
+     */
+    if (last > first || now > lo)
+    {
+        struct editorSpan s;
+        s.line = first;
+        s.count = last - first;
+        s.nlines = now - lo;
+        s.lines = malloc(sizeof(char *) * (s.nlines + 1));
 
-    if (!row || (filecol == 0 && filerow == 0))
-        return 0;
+        for (int k = 0; k < s.nlines; k++)
+            s.lines[k] = strdup(f->row[lo + k].chars);
 
+        p->spans = realloc(p->spans, sizeof(struct editorSpan) * (p->nspans + 1));
 
-    if (filecol == 0)
-    {
-#ifdef _UNDO
-        int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-        int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-        add_undo(E.file[E.current_file]->undo, INSERT, '\n', x, y);
-#endif
+        for (i = p->nspans; i > 0 && p->spans[i - 1].line > first; i--)
+            p->spans[i] = p->spans[i - 1];
 
-        /* Handle the case of column 0, we need to move the current line
-         * on the right of the previous one. */
-        filecol = E.file[E.current_file]->row[filerow - 1].size;
-        editorRowAppendString(&E.file[E.current_file]->row[filerow - 1], row->chars, row->size);
-        editorDelRow(filerow);
-        row = NULL;
+        p->spans[i] = s;
+        p->nspans += 1;
+    }
 
-        if (E.file[E.current_file]->cy == 0)
-            E.file[E.current_file]->rowoff--;
-        else
-            E.file[E.current_file]->cy--;
+    p->dirty = f->dirty;
+}
 
-        E.file[E.current_file]->cx = filecol;
+/* Load the lines around the given line of the buffer into its rows, and
+ * move the cursor to it.
+ *
+ * Lines of the buffer differ from those of the file by the lines which
+ * our edits have added or removed. */
+void editorPagerShow(struct fileState *f, int64_t line)
+{
+    struct editorPager *p = f->pager;
 
-        if (E.file[E.current_file]->cx >= E.screencols)
-        {
-            int shift = (E.screencols - E.file[E.current_file]->cx) + 1;
-            E.file[E.current_file]->cx -= shift;
-            E.file[E.current_file]->coloff += shift;
-        }
-    }
-    else
-    {
-        editorRowDelChar(row, filecol - 1);
+    /*
+     * Where the cursor and mark were, as lines of the buffer.
+     */
+    int64_t base = p->start + p->shift;
+    int64_t mark = f->marky >= 0 ? base + f->marky : -1;
 
-        if (E.file[E.current_file]->cx == 0 && E.file[E.current_file]->coloff)
-            E.file[E.current_file]->coloff--;
-        else
-            E.file[E.current_file]->cx--;
-    }
+    editorPagerFlush(f);
 
     /*
-     * BUGFIX: Ensure we don't walk off the screen, and draw gibberish.
-     *
-     * This seems to happen when `shift` becomes negative above.
+     * Find the line of the file which corresponds to `line`.
      */
-    if (E.file[E.current_file]->coloff < 0)
-        E.file[E.current_file]->coloff = 0;
+    int64_t shift = 0, target = line;
 
-    if (E.file[E.current_file]->rowoff < 0)
-        E.file[E.current_file]->rowoff = 0;
+    for (int i = 0; i < p->nspans; i++)
+    {
+        struct editorSpan *s = &p->spans[i];
 
-    if (row) editorUpdateRow(row);
+        if (line < s->line + shift)
+            break;
 
-    E.file[E.current_file]->dirty++;
-    return 0;
-}
+        if (line < s->line + shift + s->nlines)
+        {
+            target = s->line;
+            shift = line - target;
+            break;
+        }
 
-/* Remove the current line. */
-int kill_line_lua(lua_State *L)
-{
-    (void)L;
+        shift += s->nlines - s->count;
+        target = line - shift;
+    }
 
-    /* move to end of line. */
-    eol_lua(L);
+    if (p->lines < 0)
+        editorPagerScan(p, target);
 
-    /* number of deletes we need. */
-    int len = 0;
+    if (p->lines >= 0 && target >= p->lines)
+        target = p->lines > 0 ? p->lines - 1 : 0;
 
-    /* count the characters */
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+    /*
+     * The window we'll load, widened so that it doesn't split a span.
+     */
+    int64_t start = target - KILO_PAGE_LINES / 2;
+    int64_t end = target + KILO_PAGE_LINES / 2;
 
-    if (row)
-        len = row->rsize;
+    if (start < 0)
+        start = 0;
 
-    while (len > 0)
+    shift = 0;
+
+    for (int i = 0; i < p->nspans; i++)
     {
-        delete_lua(L);
-        len -= 1;
+        struct editorSpan *s = &p->spans[i];
+
+        if (s->line < start && s->line + s->count > start)
+            start = s->line;
+
+        if (s->line < end && s->line + s->count > end)
+            end = s->line + s->count;
     }
 
+    for (int i = 0; i < p->nspans && p->spans[i].line < start; i++)
+        shift += p->spans[i].nlines - p->spans[i].count;
+
     /*
-     * Remove the line itself.
+     * Replace our rows.
      */
-    right_lua(L);
-    delete_lua(L);
-
-    return 0;
-}
+    int dirty = f->dirty;
 
-/* read a single key */
-int key_lua(lua_State *L)
-{
-    char buf[2] = { '\0', '\0' };
-    buf[0] = editorReadKey(STDIN_FILENO);
-    lua_pushstring(L, buf);
-    return 1;
-}
+    for (int i = 0; i < f->numrows; i++)
+        editorFreeRow(&f->row[i]);
 
-/* insert a string. */
-int insert_lua(lua_State *L)
-{
-    const char *str = lua_tostring(L, -1);
+    free(f->row);
+    f->row = NULL;
+    f->numrows = 0;
+    arena_free(&f->arena);
+    editorWrapFree(f);
 
-    if (str != NULL)
-    {
-        size_t len = strlen(str);
+    free(p->origin);
+    free(p->hash);
+    p->origin = NULL;
+    p->hash = NULL;
 
-        for (unsigned int i = 0; i < len; i++)
-        {
-            editorInsertChar(str[i]);
-#ifdef _UNDO
-            /*
-             * Add the undo-record.
-             */
-            int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-            int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-            add_undo(E.file[E.current_file]->undo, DELETE, ' ', x, y);
-#endif
-        }
-    }
+    int room = 0, n = 0;
+    int64_t cur = start;
+    int span = 0;
 
-    return 0;
-}
+    while (span < p->nspans && p->spans[span].line < start)
+        span++;
 
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
 
-/* Markers */
+    fseeko(p->fp, editorPagerOffset(p, start), SEEK_SET);
 
-/* Get/Set X,Y position of the mark. */
-int mark_lua(lua_State *L)
-{
-    if (lua_isnumber(L, -2) &&
-            lua_isnumber(L, -1))
+    while (1)
     {
-        int y = lua_tonumber(L, -1);
-        int x = lua_tonumber(L, -2);
-
-        if ((x >= 0 || x == -1) &&
-                (y >= 0 || y == -1))
+        if (n + 1 >= room)
         {
-            E.file[E.current_file]->markx = x ;
-            E.file[E.current_file]->marky = y ;
+            room = room ? room * 2 : 1024;
+            p->origin = realloc(p->origin, sizeof(int64_t) * room);
         }
 
-    }
+        /*
+         * The rows of a span replace the lines of the file it covers.
+         */
+        if (span < p->nspans && p->spans[span].line == cur)
+        {
+            struct editorSpan *s = &p->spans[span++];
 
-    lua_pushnumber(L, E.file[E.current_file]->markx);
-    lua_pushnumber(L, E.file[E.current_file]->marky);
-    return 2;
-}
-
-/* Get/Set X,Y position of the cursor. */
-int point_lua(lua_State *L)
-{
-    if (lua_isnumber(L, -2) &&
-            lua_isnumber(L, -1))
-    {
-        int y = lua_tonumber(L, -1) - 1;
-        int x = lua_tonumber(L, -2) - 1;
-
-        warp(x, y);
-    }
-
-    lua_pushnumber(L, E.file[E.current_file]->cx + E.file[E.current_file]->coloff);
-    lua_pushnumber(L, E.file[E.current_file]->cy + E.file[E.current_file]->rowoff);
-    return 2;
-}
+            for (int k = 0; k < s->nlines; k++)
+            {
+                if (n + 1 >= room)
+                {
+                    room *= 2;
+                    p->origin = realloc(p->origin, sizeof(int64_t) * room);
+                }
 
+                editorInsertRow(f, n, s->lines[k], strlen(s->lines[k]));
+                p->origin[n++] = -1;
+            }
 
-/* Core */
+            cur += s->count;
 
-/* prompt for a string, and evaluate that as lua. */
-int eval_lua(lua_State *L)
-{
-    (void)L;
+            if (s->count)
+                fseeko(p->fp, editorPagerOffset(p, cur), SEEK_SET);
 
-    char *txt = get_input("Eval: ");
+            continue;
+        }
 
-    if (txt)
-    {
-        int res =  luaL_loadstring(lua, txt);
+        if (cur >= end)
+            break;
 
-        if (res == 0)
+        if ((len = getline(&buf, &cap, p->fp)) == -1)
         {
-            res = lua_pcall(lua, 0, LUA_MULTRET, 0);
+            p->lines = cur;
+            break;
         }
-        else
-        {
-            const char *er = lua_tostring(lua, -1);
 
-            if (er)
-                editorSetStatusMessage(1, er);
-        }
+        if (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+            buf[--len] = '\0';
 
-        free(txt);
+        char *chars = arena_strndup(&f->arena, buf, len);
+        editorInsertRowChars(f, n, chars, len, 1);
+        p->origin[n++] = cur++;
     }
 
-    return 0;
-}
+    free(buf);
 
-/* exit the editor */
-int exit_lua(lua_State *L)
-{
-    (void)L;
-    exit(0);
-    return 0;
-}
+    p->start = start;
+    p->end = cur;
+    p->shift = shift;
+    p->loaded = n;
+    p->hash = malloc(sizeof(uint64_t) * (n + 1));
 
-/* Switch to find-mode */
-int find_lua(lua_State *L)
-{
-    (void)L;
-    char query[KILO_QUERY_LEN + 1] = {0};
-    int qlen = 0;
-    int last_match = -1; /* Last line where a match was found. -1 for none. */
-    int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
-    char *saved_hl = NULL;
+    for (int i = 0; i < n; i++)
+        p->hash[i] = editorHashRow(&f->row[i]);
 
-#define FIND_RESTORE_HL do { \
-    if (saved_hl) { \
-        memcpy(E.file[E.current_file]->row[saved_hl_line].hl,saved_hl, E.file[E.current_file]->row[saved_hl_line].rsize); \
-        saved_hl = NULL; \
-    } \
-} while (0)
+    f->dirty = p->dirty = dirty;
 
-    /* Save the cursor position in order to restore it later. */
-    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
-    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+    /*
+     * Put the cursor back on the line it was on, keeping its position on
+     * the screen if we can.
+     */
+    base = start + shift;
 
-    while (1)
-    {
-        editorSetStatusMessage(1,
-                               "Search: %s (Use ESC/Arrows/Enter)", query);
-        editorRefreshScreen();
+    int64_t row = line - base;
 
-        int c = editorReadKey(STDIN_FILENO);
+    if (row >= f->numrows)
+        row = f->numrows - 1;
 
-        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE)
-        {
-            if (qlen != 0) query[--qlen] = '\0';
+    if (row < 0)
+        row = 0;
 
-            last_match = -1;
-        }
-        else if (c == ESC || c == ENTER)
-        {
-            if (c == ESC)
-            {
-                E.file[E.current_file]->cx = saved_cx;
-                E.file[E.current_file]->cy = saved_cy;
-                E.file[E.current_file]->coloff = saved_coloff;
-                E.file[E.current_file]->rowoff = saved_rowoff;
-            }
+    if (f->cy > row)
+        f->cy = row;
 
-            FIND_RESTORE_HL;
-            editorSetStatusMessage(0, "");
-            return 0;
-        }
-        else if (c == ARROW_RIGHT || c == ARROW_DOWN)
-        {
-            find_next = 1;
-        }
-        else if (c == ARROW_LEFT || c == ARROW_UP)
-        {
-            find_next = -1;
-        }
-        else if (isprint(c))
-        {
-            if (qlen < KILO_QUERY_LEN)
-            {
-                query[qlen++] = c;
-                query[qlen] = '\0';
-                last_match = -1;
-            }
-        }
+    f->rowoff = row - f->cy;
 
-        /* Search occurrence. */
-        if (last_match == -1) find_next = 1;
+    if (mark >= base && mark < base + f->numrows)
+    {
+        f->marky = mark - base;
+    }
+    else
+    {
+        f->markx = -1;
+        f->marky = -1;
+    }
 
-        if (find_next)
-        {
-            char *match = NULL;
-            int match_offset = 0;
-            int i, current = last_match;
+#ifdef _UNDO
+    /* Our undo-records refer to the rows we just replaced. */
+    us_clear(f->undo);
+#endif
+}
 
-            for (i = 0; i < E.file[E.current_file]->numrows; i++)
-            {
-                current += find_next;
+/* If the cursor is close to the edge of the lines we've loaded, then
+ * load those around it. */
+void editorPagerCheck(struct fileState *f)
+{
+    struct editorPager *p = f->pager;
 
-                if (current == -1)
-                    current = E.file[E.current_file]->numrows - 1;
-                else if (current == E.file[E.current_file]->numrows)
-                    current = 0;
+    if (p == NULL)
+        return;
 
-                match = strstr(E.file[E.current_file]->row[current].render, query);
+    int row = f->rowoff + f->cy;
+    int at_end = p->lines >= 0 && p->end >= p->lines;
 
-                if (match)
-                {
-                    match_offset = match - E.file[E.current_file]->row[current].render;
-                    break;
-                }
-            }
+    if ((row < KILO_PAGE_MARGIN && p->start > 0) ||
+            (row >= f->numrows - KILO_PAGE_MARGIN && !at_end))
+        editorPagerShow(f, p->start + p->shift + row);
+}
 
-            find_next = 0;
+/* Open the given file as a large file, returning 0 on success. */
+int editorPagerOpen(struct fileState *f, char *filename)
+{
+    FILE *fp = fopen(filename, "r");
 
-            /* Highlight */
-            FIND_RESTORE_HL;
+    if (fp == NULL)
+        return 1;
 
-            if (match)
-            {
-                erow *row = &E.file[E.current_file]->row[current];
-                last_match = current;
+    struct editorPager *p = calloc(1, sizeof(struct editorPager));
+    p->fp = fp;
 
-                if (row->hl)
-                {
-                    saved_hl_line = current;
-                    saved_hl = malloc(row->rsize);
-                    memcpy(saved_hl, row->hl, row->rsize);
-                    memset(row->hl + match_offset, HL_MATCH, qlen);
-                }
+    fseeko(fp, 0, SEEK_END);
+    p->size = ftello(fp);
 
-                /*
-                 * NOTE: This breaks our undo, by warping to a new
-                 * position that isn't tracked by our stack.
-                 */
-                E.file[E.current_file]->cy = 0;
-                E.file[E.current_file]->cx = match_offset;
-                E.file[E.current_file]->rowoff = current;
-                E.file[E.current_file]->coloff = 0;
+    p->room = 1024;
+    p->index = malloc(sizeof(int64_t) * p->room);
+    p->index[0] = 0;
+    p->indexed = 1;
+    p->lines = -1;
+    p->dirty = f->dirty;
 
-                /* Scroll horizontally as needed. */
-                if (E.file[E.current_file]->cx > E.screencols)
-                {
-                    int diff = E.file[E.current_file]->cx - E.screencols;
-                    E.file[E.current_file]->cx -= diff;
-                    E.file[E.current_file]->coloff += diff;
-                }
-            }
-        }
-    }
-}
+    editorPagerFree(f->pager);
+    f->pager = p;
 
+    editorPagerShow(f, 0);
+    return 0;
+}
 
-/* Prompt for a filename and open it. */
-int open_lua(lua_State *L)
+/* Free a large file. */
+void editorPagerFree(struct editorPager *p)
 {
-    (void)L;
-    /*
-     * If we got a string then open it as a filename.
-     */
-    char *path = (char *)lua_tostring(L, -1);
+    if (p == NULL)
+        return;
 
-    if (path != NULL)
+    for (int i = 0; i < p->nspans; i++)
     {
-        editorOpen(path);
-        return 0;
-    }
-
-    /*
-     * Prompt for a path.
-     */
-    path = get_input("Open: ");
+        for (int k = 0; k < p->spans[i].nlines; k++)
+            free(p->spans[i].lines[k]);
 
-    if (path)
-    {
-        editorOpen(path);
-        free(path);
+        free(p->spans[i].lines);
     }
 
-    return 0;
+    free(p->spans);
+    free(p->index);
+    free(p->origin);
+    free(p->hash);
+    fclose(p->fp);
+    free(p);
 }
 
-/* prompt for input */
-int prompt_lua(lua_State *L)
+/* Copy the bytes of the file between the given offsets to `out`. */
+int editorPagerCopy(struct editorPager *p, FILE *out, int64_t from, int64_t to)
 {
-    char *prompt = (char *)lua_tostring(L, -1);
-    char *buf = get_input(prompt);
+    static char buf[1024 * 1024];
 
-    if (buf)
+    fseeko(p->fp, from, SEEK_SET);
+
+    while (from < to)
     {
-        lua_pushstring(lua, buf);
-        free(buf);
-        return 1;
+        size_t want = (to - from) < (int64_t)sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        size_t n = fread(buf, 1, want, p->fp);
+
+        if (n == 0 || fwrite(buf, 1, n, out) != n)
+            return 1;
+
+        from += n;
     }
 
     return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, 1 on error. */
-int save_lua(lua_State *L)
+/* Save a large file, by merging our edits with the file we opened.
+ *
+ * The result is written to a temporary file, which then replaces the
+ * one named by the buffer. */
+int editorPagerSave(struct fileState *f)
 {
+    struct editorPager *p = f->pager;
+    int64_t line = p->start + p->shift + f->rowoff + f->cy;
+    int64_t written = 0;
+    int err = 0;
 
-    /*
-     * If we were given a filename then use that.
-     */
-    char *path = (char *)lua_tostring(L, -1);
+    editorPagerFlush(f);
 
-    if (path != NULL)
+    char *tmp = malloc(strlen(f->filename) + 8);
+    sprintf(tmp, "%s.XXXXXX", f->filename);
+
+    int fd = mkstemp(tmp);
+    FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+    struct stat st;
+
+    /* Keep the permissions of the file we're replacing. */
+    if (out && fstat(fileno(p->fp), &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+
+    if (out == NULL)
     {
-        free(E.file[E.current_file]->filename);
-        E.file[E.current_file]->filename = strdup(path);
+        editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
+        free(tmp);
+        return 1;
     }
 
-    /*
-     * If we don't have a filename we can't save
-     */
-    if (E.file[E.current_file]->filename == NULL)
+    int64_t from = 0;
+
+    for (int i = 0; i < p->nspans && !err; i++)
     {
-        editorSetStatusMessage(1, "No filename is set!");
-        return 0;
+        struct editorSpan *s = &p->spans[i];
+        int64_t to = editorPagerOffset(p, s->line);
+
+        err |= editorPagerCopy(p, out, from, to);
+        written += to - from;
+
+        for (int k = 0; k < s->nlines; k++)
+        {
+            err |= fputs(s->lines[k], out) == EOF || fputc('\n', out) == EOF;
+            written += strlen(s->lines[k]) + 1;
+        }
+
+        from = editorPagerOffset(p, s->line + s->count);
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(E.file[E.current_file]->filename, O_RDWR | O_CREAT, 0644);
+    err |= editorPagerCopy(p, out, from, p->size);
+    written += p->size - from;
 
-    if (fd == -1) goto writeerr;
+    err |= fclose(out) != 0;
 
-    /* Use truncate + a single write(2) call in order to make saving
-     * a bit safer, under the limits of what we can do in a small editor. */
-    if (ftruncate(fd, len) == -1) goto writeerr;
+    if (err || rename(tmp, f->filename) != 0)
+    {
+        editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return 1;
+    }
 
-    if (write(fd, buf, len) != len) goto writeerr;
+    free(tmp);
 
-    close(fd);
-    free(buf);
-    E.file[E.current_file]->dirty = 0;
+    /*
+     * The file we saved is now the one we're paging through.
+     */
+    f->dirty = 0;
+    editorPagerOpen(f, f->filename);
+    editorPagerShow(f, line);
+    editorDiskRecord(f);
 
-    editorSetStatusMessage(1, "%d bytes written to %s", len, E.file[E.current_file]->filename);
+    editorSetStatusMessage(1, "%lld bytes written to %s", (long long)written, f->filename);
 
     /* invoke our lua callback function */
-    call_lua("on_saved", E.file[E.current_file]->filename);
+    call_lua("on_saved", f->filename);
+    return 0;
+}
 
-#ifdef _UNDO
-    /* since we've saved - kill our undo stack */
-    us_clear(E.file[E.current_file]->undo);
-#endif
 
-    return 0;
 
-writeerr:
-    free(buf);
+/* ============================= Binary files ============================= */
 
-    if (fd != -1) close(fd);
+/*
+ * Files which look binary are shown as hex, in the manner of `hexdump -C`,
+ * rather than as lines of text.  The file is mapped and each redraw reads
+ * only the bytes which are on the screen, so even a huge file opens at
+ * once and costs nothing but the address-space.
+ *
+ * Bytes are overwritten in place, by typing hex digits, and the changes
+ * are held in a sorted overlay until they are written over the file.
+ */
 
-    editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
-    return 1;
-}
+/* Map the given file, to be shown as hex, returning 0 on success. */
+int editorHexOpen(struct fileState *f, char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
 
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
 
-/* Search for the given string */
-int search_lua(lua_State *L)
-{
     /*
-     * Get the search pattern.
+     * The lines of the view are counted by an int, so larger files are
+     * left to the pager.
      */
-    char *term = (char *)lua_tostring(L, -1);
-
-    if (term == NULL)
+    if (st.st_size / KILO_HEX_WIDTH >= INT_MAX)
     {
-        editorSetStatusMessage(1, "No search term given!");
-        return 0;
+        close(fd);
+        return 1;
     }
 
-#ifdef _REGEXP
-    regex_t regex;
+    unsigned char *map = NULL;
 
-    if (regcomp(&regex, term, REG_EXTENDED) != 0)
+    if (st.st_size > 0)
     {
-        editorSetStatusMessage(1, "Failed to compile regular expression!");
-        return 0;
-    };
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
-#endif
-
-
-    /* Save the cursor position in order to restore it later. */
-    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return 1;
+        }
+    }
 
-    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+    struct editorHex *h = calloc(1, sizeof(struct editorHex));
+    h->fd = fd;
+    h->map = map;
+    h->mapped = h->size = st.st_size;
+    h->path = strdup(filename);
 
-    /*
-     * Move forward one character - to ensure that we
-     * are able to find the next match, not keep on the first
-     * one.
-     */
-    right_lua(L);
+    editorHexFree(f->hex);
+    f->hex = h;
+    f->version++;
+    return 0;
+}
 
-    /*
-     * Current line;
-     */
-    int current = E.file[E.current_file]->cy + E.file[E.current_file]->rowoff;
+/* Unmap a binary file, discarding any changes. */
+void editorHexFree(struct editorHex *h)
+{
+    if (h == NULL)
+        return;
 
-    /*
-     * Now for each line ..
-     */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-    {
-        /*
-         * For each character in the current row .. do we match?
-         */
-        for (int x = E.file[E.current_file]->cx + E.file[E.current_file]->coloff; x < E.file[E.current_file]->row[current].rsize; x++)
-        {
-            int match     = 0;
-            int match_len = 0;
+    if (h->map)
+        munmap(h->map, h->mapped);
 
-#ifdef _REGEXP
-            regmatch_t result[1];
+    close(h->fd);
+    free(h->patch);
+    free(h->path);
+    free(h);
+}
 
-            if (regexec(&regex, E.file[E.current_file]->row[current].render + x, 1, result, 0) == 0)
-            {
-                match = 1;
-                match_len = (result[0]).rm_eo - (result[0]).rm_so;
+/* Stop using any of the map beyond the end of the file, if something
+ * else has cut it short, as touching those pages would raise SIGBUS.
+ *
+ * Returns 1 if the file was truncated, 0 otherwise. */
+int editorHexCheck(struct fileState *f)
+{
+    struct editorHex *h = f->hex;
+    struct stat st;
 
-                /*
-                 * Start of the match.
-                 */
-                x += (result[0]).rm_so;
-            }
+    if (fstat(h->fd, &st) != 0 || st.st_size >= h->size)
+        return 0;
 
-#else
+    h->size = st.st_size;
 
-            if (strncmp(E.file[E.current_file]->row[current].render + x, term, strlen(term)) == 0)
-            {
-                match = 1;
-                match_len = strlen(term);
-            }
+    /* Changes to bytes which have gone are lost with them. */
+    h->npatch = editorHexFind(h, h->size);
+    f->version++;
 
-#endif
+    editorSetStatusMessage(1, "%s was truncated to %lld bytes", h->path, (long long)h->size);
+    return 1;
+}
 
-            if (match)
-            {
-                /*
-                 * The column in which we matched.
-                 */
-                E.file[E.current_file]->cx = x;
-                E.file[E.current_file]->coloff = 0;
+/* The number of hex digits we show of each offset. */
+int editorHexDigits(struct editorHex *h)
+{
+    int digits = 8;
 
-                /* The matching row will be at the top of the screen. */
-                E.file[E.current_file]->cy = 0;
-                E.file[E.current_file]->rowoff = current;
+    while (digits < 16 && ((uint64_t)h->size >> (digits * 4)) != 0)
+        digits++;
 
-                /* Scroll horizontally as needed. */
-                if (E.file[E.current_file]->cx > E.screencols)
-                {
-                    int diff = abs(E.file[E.current_file]->cx - E.screencols);
-                    E.file[E.current_file]->cx -= diff;
-                    E.file[E.current_file]->coloff += diff;
-                }
+    return digits;
+}
 
-                /* Return the length of the match */
-                lua_pushnumber(L, match_len);
-                return 1;
-            }
-        }
+/* The offset of the byte under the cursor. */
+int64_t editorHexOffset(struct fileState *f)
+{
+    return (int64_t)(f->rowoff + f->cy) * KILO_HEX_WIDTH + f->coloff + f->cx;
+}
 
-        /*
-         * Current line.
-         */
-        current += 1;
+/* Find the first patch at, or after, the given offset. */
+int editorHexFind(struct editorHex *h, int64_t offset)
+{
+    int lo = 0, hi = h->npatch;
 
-        /*
-         * Wrap around the end/start of the file.
-         */
-        if (current == E.file[E.current_file]->numrows)
-            current = 0;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
 
-        /*
-         * We've moved forward a row, so we can now start at the
-         * beginning of the row.
-         */
-        E.file[E.current_file]->cx = 0;
-        E.file[E.current_file]->coloff = 0;
+        if (h->patch[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    /*
-     * If we didn't find a match we need to restore the
-     * position to where where we were before.
-     */
-    editorSetStatusMessage(1, "No match found");
-    E.file[E.current_file]->cx = saved_cx;
-    E.file[E.current_file]->cy = saved_cy;
-    E.file[E.current_file]->coloff = saved_coloff;
-    E.file[E.current_file]->rowoff = saved_rowoff;
-    lua_pushnumber(L, 0);
-    return 1;
+    return lo;
 }
 
-/* set the status-bar text */
-int status_lua(lua_State *L)
+/* The byte at the given offset, as we've changed it. */
+int editorHexByte(struct editorHex *h, int64_t offset)
 {
-    const char *str = lua_tostring(L, -1);
-    editorSetStatusMessage(1, str);
-    editorRefreshScreen();
-    return 0;
+    int i = editorHexFind(h, offset);
+
+    if (i < h->npatch && h->patch[i].offset == offset)
+        return h->patch[i].byte;
+
+    return h->map[offset];
 }
 
-/* Undo the most recent change. */
-int undo_lua(lua_State *L)
+/* Change the byte at the given offset. */
+void editorHexPut(struct fileState *f, int64_t offset, int byte)
 {
-    (void)L;
-#ifdef _UNDO
-    UndoAction *action = us_pop(E.file[E.current_file]->undo);
+    struct editorHex *h = f->hex;
+    int i = editorHexFind(h, offset);
+    int found = i < h->npatch && h->patch[i].offset == offset;
 
-    if (action == NULL)
+    if (byte == h->map[offset])
     {
-        editorSetStatusMessage(1, "Undo stack is empty!");
-        return 0;
+        /* Restoring a byte leaves nothing to write. */
+        if (found)
+        {
+            memmove(h->patch + i, h->patch + i + 1, sizeof(struct editorPatch) * (h->npatch - i - 1));
+            h->npatch--;
+        }
     }
-
-    if (action->type == DELETE)
+    else if (found)
     {
-        warp(action->x, action->y);
-        delete_lua(L);
+        h->patch[i].byte = byte;
     }
-    else if (action->type == INSERT)
+    else
     {
-        warp(action->x, action->y);
+        if (h->npatch == h->room)
+        {
+            h->room = h->room ? h->room * 2 : 64;
+            h->patch = realloc(h->patch, sizeof(struct editorPatch) * h->room);
+        }
 
-        char str[2] = { '\0', '\0' };
-        str[0] = action->data;
-        lua_pushstring(L, str);
-        insert_lua(L);
+        memmove(h->patch + i + 1, h->patch + i, sizeof(struct editorPatch) * (h->npatch - i));
+        h->patch[i].offset = offset;
+        h->patch[i].byte = byte;
+        h->npatch++;
     }
 
-    /*
-     * Performing the action to undo the user's previous
-     * thing will add a new action to the undo-stack.
-     *
-     * So we need to explicitly remove that faux addition here.
-     */
-    us_pop(E.file[E.current_file]->undo);
-#else
-    editorSetStatusMessage(1, "undo-support is not compiled in");
-#endif
-    return 0;
+    f->dirty++;
+    f->version++;
 }
 
+/* Move the cursor of a binary file, a byte or a line at a time.
+ *
+ * Any other key just keeps the cursor within the file. */
+void editorHexMove(struct fileState *f, int key)
+{
+    struct editorHex *h = f->hex;
+    int64_t lines = (h->size + KILO_HEX_WIDTH - 1) / KILO_HEX_WIDTH;
+    int64_t line = f->rowoff + f->cy;
+    int col = f->coloff + f->cx;
 
+    switch (key)
+    {
+    case ARROW_LEFT:
+        if (col > 0)
+            col--;
+        else if (line > 0)
+        {
+            line--;
+            col = KILO_HEX_WIDTH - 1;
+        }
 
-/* Syntax highlighting */
+        break;
 
-/* Set comment handling. */
-int set_syntax_comments_lua(lua_State *L)
-{
-    char *single = (char *)lua_tostring(L, -3);
-    char *multi_open = (char *)lua_tostring(L, -2);
-    char *multi_end = (char *)lua_tostring(L, -1);
+    case ARROW_RIGHT:
+        if (col < KILO_HEX_WIDTH - 1)
+            col++;
+        else if (line + 1 < lines)
+        {
+            line++;
+            col = 0;
+        }
 
-    if ((single == NULL) ||
-            (multi_open == NULL) ||
-            (multi_end == NULL))
-        return 0;
+        break;
 
-    /*
-     * If we don't have syntax that's a bug.
-     */
-    if (E.file[E.current_file]->syntax == NULL)
-        return 0;
+    case ARROW_UP:
+        if (line > 0)
+            line--;
 
-    strcpy(E.file[E.current_file]->syntax->singleline_comment_start, single);
-    strcpy(E.file[E.current_file]->syntax->multiline_comment_start, multi_open);
-    strcpy(E.file[E.current_file]->syntax->multiline_comment_end, multi_end);
+        break;
 
-    /*
-     * Force re-render.
-     */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-        editorUpdateRow(E.file[E.current_file]->row + i);
+    case ARROW_DOWN:
+        if (line + 1 < lines)
+            line++;
 
-    return 0;
+        break;
+    }
+
+    if (line >= lines)
+        line = lines > 0 ? lines - 1 : 0;
+
+    /* The last line may be short. */
+    if (line * KILO_HEX_WIDTH + col >= h->size)
+        col = h->size > line * KILO_HEX_WIDTH ? h->size - 1 - line * KILO_HEX_WIDTH : 0;
+
+    if (line < f->rowoff)
+        f->rowoff = line;
+    else if (line >= f->rowoff + E.screenrows)
+        f->rowoff = line - E.screenrows + 1;
+
+    f->cy = line - f->rowoff;
+    f->cx = col;
+    f->coloff = 0;
+    h->nibble = 0;
 }
 
-/* set the syntax keywords. */
-int set_syntax_keywords_lua(lua_State *L)
+/* Overwrite half of the byte under the cursor with the given hex digit. */
+void editorHexType(struct fileState *f, int c)
 {
-    if (! lua_istable(L, 1))
-        return 0;
+    struct editorHex *h = f->hex;
+    int64_t offset = editorHexOffset(f);
 
-    if (E.file[E.current_file]->syntax == NULL)
+    if (c < 0 || c > 255 || !isxdigit(c))
     {
-        struct editorSyntax *s = (struct editorSyntax*)malloc(sizeof(struct editorSyntax));
-        s->keywords                    = NULL;
-        s->singleline_comment_start[0] = '\0';
-        s->multiline_comment_start[0]  = '\0';
-        s->multiline_comment_end[0]    = '\0';
-        s->flags                       =  HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS;
-        E.file[E.current_file]->syntax = s;
+        editorSetStatusMessage(1, "Only hex digits may be typed in a binary file");
+        return;
     }
 
-    size_t len = lua_rawlen(L, 1);
-    E.file[E.current_file]->syntax->keywords = malloc((1 + len) * sizeof(char*));
+    if (editorHexCheck(f))
+        editorHexMove(f, 0);
 
-    int i = 0;
-    lua_pushnil(L);
+    if (offset >= h->size)
+        return;
 
-    while (lua_next(L, -2) != 0)
-    {
-        const char *str = lua_tostring(L, -1);
-        E.file[E.current_file]->syntax->keywords[i] = strdup(str);
-        lua_pop(L, 1);
-        i += 1;
-    }
+    int digit = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    int byte = editorHexByte(h, offset);
 
-    E.file[E.current_file]->syntax->keywords[i] = NULL;
+    if (h->nibble == 0)
+        byte = (digit << 4) | (byte & 0x0F);
+    else
+        byte = (byte & 0xF0) | digit;
 
-    /*
-     * Force re-render.
-     */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-        editorUpdateRow(E.file[E.current_file]->row + i);
+    editorHexPut(f, offset, byte);
 
-    return 0;
+    if (h->nibble == 0)
+        h->nibble = 1;
+    else
+        editorHexMove(f, ARROW_RIGHT);
 }
 
-/* Enable highlighting of numbers. */
-int syntax_highlight_numbers_lua(lua_State *L)
+/* Draw the lines of the binary file `f`, as seen through the view `v`,
+ * into the text-area of the window `w`.  Bytes we've changed are drawn
+ * as a search-match is. */
+void editorHexDrawRows(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v)
 {
-    int cond = lua_tonumber(L, -1);
+    static const char digit[] = "0123456789abcdef";
+    struct editorHex *h = f->hex;
+    int digits = editorHexDigits(h);
+    int current_color = -1;
+    char buf[32];
 
-    if (E.file[E.current_file]->syntax)
+    /*
+     * The text of a line, and the colour of each of its characters.
+     */
+    char text[128];
+    unsigned char hl[128];
+
+    editorHexCheck(f);
+
+    for (int y = 0; y < w->height - 1; y++)
     {
-        if (cond == 1)
-            E.file[E.current_file]->syntax->flags |= HL_HIGHLIGHT_NUMBERS;
-        else
-            E.file[E.current_file]->syntax->flags &= ~HL_HIGHLIGHT_NUMBERS;
+        int64_t offset = (int64_t)(v->rowoff + y) * KILO_HEX_WIDTH;
+        int used = 0;
+
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", w->top + y + 1, w->left + 1);
+        abAppend(ab, buf, strlen(buf));
+
+        if (offset >= h->size)
+        {
+            abAppend(ab, "~", 1);
+            editorClearLine(ab, w, 1);
+            continue;
+        }
 
         /*
-         * Force re-render.
+         * The offset, the bytes in hex, in two groups, and then as ASCII.
          */
-        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-            editorUpdateRow(E.file[E.current_file]->row + i);
-    }
+        int len = snprintf(text, sizeof(text), "%0*llx  ", digits, (long long)offset);
+        int ascii = len + KILO_HEX_WIDTH * 3 + 2;
+        int end = ascii + 1;
+        int p = editorHexFind(h, offset);
 
-    return 0;
-}
+        memset(text + len, ' ', ascii - len);
+        memset(hl, HL_NORMAL, sizeof(hl));
+        text[ascii] = '|';
 
-/* Enable highlighting of strings. */
-int syntax_highlight_strings_lua(lua_State *L)
-{
-    int cond = lua_tonumber(L, -1);
+        for (int i = 0; i < KILO_HEX_WIDTH && offset + i < h->size; i++)
+        {
+            int byte = h->map[offset + i];
+            int x = len + i * 3 + (i >= KILO_HEX_WIDTH / 2);
 
-    if (E.file[E.current_file]->syntax)
-    {
-        if (cond == 1)
-            E.file[E.current_file]->syntax->flags |= HL_HIGHLIGHT_STRINGS;
-        else
-            E.file[E.current_file]->syntax->flags &= ~HL_HIGHLIGHT_STRINGS;
+            if (p < h->npatch && h->patch[p].offset == offset + i)
+            {
+                byte = h->patch[p++].byte;
+                hl[x] = hl[x + 1] = hl[end] = HL_MATCH;
+            }
+
+            text[x] = digit[byte >> 4];
+            text[x + 1] = digit[byte & 0x0F];
+            text[end++] = byte >= 32 && byte < 127 ? byte : '.';
+        }
+
+        text[end++] = '|';
+
+        if (end > w->width)
+            end = w->width;
 
         /*
-         * Force re-render.
+         * Draw the line in runs of the same colour.
          */
-        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-            editorUpdateRow(E.file[E.current_file]->row + i);
-    }
+        while (used < end)
+        {
+            int n = 1;
 
-    return 0;
+            while (used + n < end && hl[used + n] == hl[used])
+                n++;
+
+            editorDrawRun(ab, hl[used], text + used, n, &current_color);
+            used += n;
+        }
+
+        abAppend(ab, "\x1b[39m", 5);
+        current_color = -1;
+        editorClearLine(ab, w, used);
+    }
 }
 
-/* Get/Set tabsize. */
-int tabsize_lua(lua_State *L)
+/* Write all of the given bytes, returning 0 on success. */
+int editorHexWrite(int fd, const unsigned char *data, int64_t len)
 {
-    if (lua_isnumber(L, -1))
+    while (len > 0)
     {
-        int width = lua_tonumber(L, -1);
-        E.file[E.current_file]->tab_size = width;
+        ssize_t n = write(fd, data, len > (1 << 30) ? (1 << 30) : len);
 
-        /*
-         * Force a re-render
-         */
-        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-            editorUpdateRow(E.file[E.current_file]->row + i);
+        if (n <= 0)
+            return 1;
 
+        data += n;
+        len -= n;
     }
 
-    lua_pushnumber(L, E.file[E.current_file]->tab_size);
-    return 1;
+    return 0;
 }
 
-
-/* Buffers */
-
-/* Choose a buffer, interatively */
-int choose_buffer_lua(lua_State *L)
+/* Save a binary file, by writing the bytes we've changed over it.
+ *
+ * If the buffer has been given the name of another file the whole file
+ * is written to a temporary file beside it, which is renamed over it,
+ * and mapped in place of the one we had.  Whether it is the same file is
+ * decided by the file itself, not its name, as truncating the file we
+ * have mapped would lose the bytes we're copying. */
+int editorHexSave(struct fileState *f)
 {
-    (void)L;
-
-    int offset = 0;
-
-    while (1)
+    struct editorHex *h = f->hex;
+    struct stat mapped, st;
+    int64_t written = 0;
+    int err = 0;
+    int same = fstat(h->fd, &mapped) == 0 && stat(f->filename, &st) == 0 &&
+               mapped.st_dev == st.st_dev && mapped.st_ino == st.st_ino;
+    char *tmp = NULL;
+    int fd;
+
+    editorHexCheck(f);
+
+    if (same)
     {
-        struct abuf ab = ABUF_INIT;
-        abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
-        abAppend(&ab, "\x1b[H", 3); /* Go home. */
+        fd = open(f->filename, O_WRONLY | O_CLOEXEC);
+        err = fd == -1;
 
-        /*
-         * Draw the list of buffers.
-         */
-        for (int i = 0; i < E.max_files ; i ++)
+        for (int i = 0; i < h->npatch && !err;)
         {
-            int selected = (i == offset);
+            /*
+             * Neighbouring bytes are written together.
+             */
+            unsigned char run[4096];
+            int64_t at = h->patch[i].offset;
+            int n = 0;
 
-            char *filename = E.file[i]->filename;
-            int dirty = 0;
+            while (i < h->npatch && n < (int)sizeof(run) && h->patch[i].offset == at + n)
+                run[n++] = h->patch[i++].byte;
 
-            if (E.file[i]->dirty != 0)
-                dirty = 1;
+            err |= pwrite(fd, run, n, at) != n;
+            written += n;
+        }
+    }
+    else
+    {
+        tmp = malloc(strlen(f->filename) + 8);
+        sprintf(tmp, "%s.XXXXXX", f->filename);
 
-            if (filename && filename[0] == '*')
-                dirty = 0;
+        fd = mkstemp(tmp);
+        err = fd == -1;
 
-            if (selected)
-            {
-                abAppend(&ab, "\x1b[47m", 5);
-            }
-            else
-            {
-                abAppend(&ab, "\x1b[49m", 5);
-            }
+        /* Keep the permissions of the file we're replacing. */
+        if (fd != -1)
+            fchmod(fd, stat(f->filename, &st) == 0 ? st.st_mode & 07777 : 0644);
 
-            char line[255];
-            snprintf(line, sizeof(line) - 1, "%d - %s%s", i + 1,
-                     filename == NULL ? "UNSET" : filename,
-                     dirty ? " (modified)" : "");
+        int64_t from = 0;
 
-            while ((int)strlen(line) < E.screencols)
-            {
-                strcat(line, " ");
-            }
+        for (int i = 0; i <= h->npatch && !err; i++)
+        {
+            int64_t to = i < h->npatch ? h->patch[i].offset : h->size;
 
-            strcat(line, "\r\n");
-            abAppend(&ab, line, strlen(line));
-        }
+            err |= editorHexWrite(fd, h->map + from, to - from);
 
-        /*
-         * Reset the inverse selection.
-         */
-        abAppend(&ab, "\x1b[49m", 5);
+            if (i < h->npatch)
+                err |= editorHexWrite(fd, &h->patch[i].byte, 1);
 
-        /*
-         * Pad to the bottom of the screen in empty lines.
-         */
-        for (int i = E.max_files ; i < E.screenrows; i++)
-        {
-            abAppend(&ab, "\x1b[2K~\r\n", 7);
+            from = to + 1;
         }
 
-        abAppend(&ab, "\x1b[D0", 3); /* clear screen */
-        write(STDOUT_FILENO, ab.b, ab.len);
-        abFree(&ab);
+        written = h->size;
+    }
 
-        /*
-         * Get a keypress
-         */
-        int c = editorReadKey(STDIN_FILENO);
+    if (fd != -1)
+        err |= close(fd) != 0;
 
-        if (c == ENTER)
-        {
-            /* Select the buffer.*/
-            E.current_file = offset;
-            return 0;
-        }
+    if (tmp && !err)
+        err |= rename(tmp, f->filename) != 0;
 
-        if (c == ESC)
-        {
-            /* Cancel */
-            return 0;
-        }
+    if (err)
+    {
+        editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
 
-        if (c == ARROW_UP)
-        {
-            if (offset > 0)
-                offset = 0;
-        }
+        if (tmp && fd != -1)
+            unlink(tmp);
 
-        if (c == ARROW_DOWN)
-        {
-            if (offset < (E.max_files - 1))
-            {
-                offset += 1;
-            }
-        }
+        free(tmp);
+        return 1;
     }
-}
 
+    free(tmp);
 
-/* count the buffers */
-int count_buffers_lua(lua_State *L)
-{
-    lua_pushnumber(L, E.max_files);
-    return 1;
-}
-
-/* Create a new buffer */
-int create_buffer_lua(lua_State *L)
-{
     /*
-     * Is there a name for the new buffer?
+     * The map shows what we wrote over the file, or we map the copy.
      */
-    const char *name = lua_tostring(L, -1);
+    if (same)
+        h->npatch = 0;
+    else
+        editorHexOpen(f, f->filename);
 
-    /*
-     * Reallocate our buffer-list to be one larger.
-     */
-    E.file = realloc(E.file, (sizeof(struct fileState *) * E.max_files + 1));
+    f->dirty = 0;
+    f->version++;
+    editorDiskRecord(f);
 
-    /*
-     * Bump the max-files.
-     */
-    E.max_files += 1;
-    E.current_file = E.max_files - 1;
+    editorSetStatusMessage(1, "%lld bytes written to %s", (long long)written, f->filename);
 
+    /* invoke our lua callback function */
+    call_lua("on_saved", f->filename);
+    return 0;
+}
 
-    /*
-     * Create a new buffer to populate our list.
-     */
-    int i = E.current_file;
-    E.file[i] = malloc(sizeof(struct fileState));
-    E.file[i]->markx = -1;
-    E.file[i]->marky = -1;
-    E.file[i]->tab_size = 8;
-    E.file[i]->cx = 0;
-    E.file[i]->cy = 0;
-    E.file[i]->rowoff = 0;
-    E.file[i]->coloff = 0;
-    E.file[i]->numrows = 0;
-    E.file[i]->row = NULL;
-    E.file[i]->dirty = 0;
-    E.file[i]->filename = NULL;
-    E.file[i]->syntax = NULL;
 
-#ifdef _UNDO
-    E.file[i]->undo = us_create();
-#endif
 
-    if (name != NULL)
-        E.file[i]->filename = strdup(name);
+/* ============================ Compressed files ============================ */
 
-    return 0;
-}
+/*
+ * Files compressed with gzip are decompressed as they're read, a block at
+ * a time, and compressed again as they're written - so neither the whole
+ * compressed nor the whole uncompressed file is ever held in one piece.
+ */
 
-/* Return the current buffer */
-int current_buffer_lua(lua_State *L)
+#ifdef _GZIP
+
+/* Does the given file start with gzip's magic bytes? */
+int editorGzipped(FILE *fp)
 {
-    lua_pushnumber(L, E.current_file);
-    return 1;
+    int a = fgetc(fp);
+    int b = fgetc(fp);
+
+    rewind(fp);
+    return a == 0x1f && b == 0x8b;
 }
 
-/* Kill the current buffer. */
-int kill_buffer_lua(lua_State *L)
+/* Decompress the named file into the rows of the given buffer. */
+int editorGzipLoad(struct fileState *f, char *filename)
 {
-    (void)L;
+    static char buf[64 * 1024];
+    gzFile gz = gzopen(filename, "rb");
+    int partial = 0;
+    int n;
 
-    if (E.max_files > 1)
+    if (gz == NULL)
     {
+        editorSetStatusMessage(1, "Error reading %s: %s", filename, strerror(errno));
+        return 1;
+    }
 
-        /*
-         * Free the current buffer.
-         */
-        struct fileState *cur = E.file[E.current_file];
-        free(cur->syntax);
-        cur->syntax = NULL;
-        free(cur->filename);
-        cur->filename = NULL;
-        free(cur->row);
-        cur->row = NULL;
-        free(cur);
-        E.file[E.current_file] = NULL;
+    gzbuffer(gz, sizeof(buf));
 
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0)
+        editorAppendText(f, buf, n, &partial);
 
-        /*
-         * Create a new set of buffers.
-         */
-        struct fileState **tmp = malloc((sizeof(struct fileState *) * E.max_files - 1));
+    /*
+     * A truncated file isn't an error to gzread(), which returns what
+     * it could, but it is recorded as one.
+     */
+    int err;
+    const char *msg = gzerror(gz, &err);
 
-        /**
-         * Copy all non-free buffers over to the new structure.
-         */
-        int copied = 0;
+    if (n < 0 || err != Z_OK)
+        editorSetStatusMessage(1, "Error reading %s, only part of it was loaded", msg);
 
-        for (int i = 0; i < E.max_files; i++)
-        {
-            if (E.file[i] != NULL)
-            {
-                tmp[copied] = E.file[i];
-                copied ++;
-            }
-        }
+    gzclose(gz);
+    f->gzip = 1;
+    return n < 0 || err != Z_OK;
+}
 
-        /* Swap them in */
-        free(E.file);
-        E.file = tmp;
+/* Decompress the whole of the named file into memory.
+ *
+ * Returns NULL, having told the user why, if it can't all be read. */
+char *editorGzipRead(char *filename, size_t *len)
+{
+    gzFile gz = gzopen(filename, "rb");
+    size_t room = 64 * 1024;
+    char *text;
+    int n;
 
-        E.max_files -= 1;
+    *len = 0;
 
-        /*
-         * Change to the previous buffer.
-         */
-        if (E.current_file > 0)
-        {
-            E.current_file -= 1;
-        }
-        else
+    if (gz == NULL)
+    {
+        editorSetStatusMessage(1, "Error reading %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    text = malloc(room);
+
+    while ((n = gzread(gz, text + *len, room - *len)) > 0)
+    {
+        *len += n;
+
+        if (*len == room)
         {
-            E.current_file = E.max_files - 1;
+            room *= 2;
+            text = realloc(text, room);
         }
-
-        /*
-         * Force re-render
-         */
-        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-            editorUpdateRow(E.file[E.current_file]->row + i);
     }
-    else
+
+    int err;
+    const char *msg = gzerror(gz, &err);
+
+    if (n < 0 || err != Z_OK)
     {
-        exit_lua(L);
+        editorSetStatusMessage(1, "Error reading %s", msg);
+        free(text);
+        text = NULL;
     }
 
-
-    return 0;
+    gzclose(gz);
+    return text;
 }
 
-/* Move to the next buffer.*/
-int next_buffer_lua(lua_State *L)
+/* Compress the rows of the given buffer into its file. */
+int editorGzipSave(struct fileState *f)
 {
-    (void)L;
+    char *tmp = malloc(strlen(f->filename) + 8);
+    sprintf(tmp, "%s.XXXXXX", f->filename);
 
-    if (E.current_file < (E.max_files - 1))
+    int fd = mkstemp(tmp);
+    struct stat st;
+    char mode[8];
+    gzFile gz = NULL;
+    int64_t written = 0;
+    int err = 0;
+
+    snprintf(mode, sizeof(mode), "wb%d", E.gzip_level);
+
+    if (fd != -1)
     {
-        E.current_file += 1;
+        /* Keep the permissions of the file we're replacing. */
+        if (stat(f->filename, &st) == 0)
+            fchmod(fd, st.st_mode & 07777);
+
+        gz = gzdopen(fd, mode);
     }
-    else
+
+    if (gz == NULL)
     {
-        E.current_file = 0;
+        editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
+
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+
+        free(tmp);
+        return 1;
     }
 
-    /*
-     * Force re-render
-     */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-        editorUpdateRow(E.file[E.current_file]->row + i);
+    for (int i = 0; i < f->numrows && !err; i++)
+    {
+        erow *row = &f->row[i];
 
-    return 0;
-}
+        editorRowWarm(f, row);
+        err |= row->size > 0 && gzwrite(gz, row->chars, row->size) != row->size;
+        err |= f->crlf && gzputc(gz, '\r') == -1;
+        err |= gzputc(gz, '\n') == -1;
+        written += row->size + 1 + f->crlf;
+    }
 
-/* Move to the previous buffer.*/
-int prev_buffer_lua(lua_State *L)
-{
-    (void)L;
+    err |= gzclose(gz) != Z_OK;
 
-    if (E.current_file > 0)
+    if (err || rename(tmp, f->filename) != 0)
     {
-        E.current_file -= 1;
+        editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return 1;
     }
-    else
-    {
-        E.current_file = E.max_files - 1;
-    }
-
-    /*
-     * Force re-render
-     */
-    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
-        editorUpdateRow(E.file[E.current_file]->row + i);
-
-    return 0;
-}
 
-/* select a buffer, by index or name */
-int select_buffer_lua(lua_State *L)
-{
-    if (lua_isnumber(L, -1))
-    {
-        /*
-         * Select buffer by index.
-         */
-        int offset = lua_tonumber(L, -1);
+    free(tmp);
 
-        if (offset >= 0  && offset <= (E.max_files - 1))
-        {
-            E.current_file = offset;
-            lua_pushnumber(L, 1);
-            return 1;
-        }
+    f->dirty = 0;
+    f->gzip = 1;
+    editorDiskRecord(f);
 
-        lua_pushnumber(L, 0);
-        return 1;
-    }
+    editorSetStatusMessage(1, "%lld bytes written to %s, compressed to %lld",
+                           (long long)written, f->filename, (long long)f->disk.size);
 
-    if (lua_isstring(L, -1))
-    {
-        /*
-         * Select buffer by name.
-         */
-        const char *name = lua_tostring(L, -1);
+    /* invoke our lua callback function */
+    call_lua("on_saved", f->filename);
 
-        for (int i = 0; i < E.max_files; i++)
-        {
-            struct fileState *tmp = E.file[i];
+#ifdef _UNDO
+    /* since we've saved - kill our undo stack */
+    us_clear(f->undo);
+#endif
 
-            if (tmp->filename && (strcmp(tmp->filename, name) == 0))
-            {
-                E.current_file = i;
-                lua_pushnumber(L, 1);
-                return 1;
-            }
-        }
+    return 0;
+}
 
-        lua_pushnumber(L, 0);
-        return 1;
-    }
+#endif
 
-    lua_pushnumber(L, 0);
-    return 1;
-}
 
 
+/* ============================= Files on disk ============================= */
 
-/* ====================== Syntax highlight color scheme  ==================== */
+/*
+ * We remember the size, modification-time and inode of the file each
+ * buffer was loaded from, or saved to, and watch it with inotify.  If it
+ * changes beneath us the user is told, and reload() will bring the buffer
+ * up to date by diffing the file against the rows, so that only the lines
+ * which changed are replaced.
+ */
 
-int is_separator(int c)
+/* Return the modification time of a file, in nanoseconds. */
+int64_t editorStatTime(struct stat *st)
 {
-    return c == '\0' || isspace(c) || strchr(":{},.()+-/*=~%[];<>|&", c) != NULL;
+#if defined(__APPLE__)
+    return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
 }
 
-/* Return true if the specified row last char is part of a multi line comment
- * that starts at this row or at one before, and does not end at the end
- * of the row but spawns to the next row. */
-int editorRowHasOpenComment(erow *row)
+/* Watch the file of the given buffer, if we can. */
+void editorDiskWatch(struct fileState *f)
 {
-    /*
-     * If the line is empty - then we have to check on the line before
-     * that.
-     */
-    if (row->rsize == 0)
-    {
-        if (row->idx > 0)
-            return (editorRowHasOpenComment(&E.file[E.current_file]->row[row->idx - 1]));
-        else
-            return 0;
-    }
+#ifdef __linux__
+    if (E.inotify == -1)
+        E.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    /*
-     * OK we have some text.  Is the line ending in a MLCOMMENT
-     * character-string?
-     */
-    if (row->hl && row->rsize && row->hl[row->rsize - 1] != HL_MLCOMMENT)
-        return 0;
+    if (E.inotify == -1)
+        return;
 
-    /*
-     * OK the line ends in a comment.  Are the closing characters
-     * our closing tokens though?
-     */
-    int len = (int)strlen(E.file[E.current_file]->syntax->multiline_comment_end);
-    char *end = E.file[E.current_file]->syntax->multiline_comment_end;
+    int wd = inotify_add_watch(E.inotify, f->filename,
+                               IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
 
-    if (len && strncmp(row->render + row->rsize - len, end, len) == 0)
-        return 0;
-    else
-        return 1;
+    /* The file was replaced, so the old watch is of no use. */
+    if (f->disk.wd != -1 && f->disk.wd != wd)
+        inotify_rm_watch(E.inotify, f->disk.wd);
 
+    f->disk.wd = wd;
+#else
+    (void)f;
+#endif
+}
 
+/* Stop watching the file of the given buffer. */
+void editorDiskUnwatch(struct fileState *f)
+{
+#ifdef __linux__
+    if (f->disk.wd != -1 && E.inotify != -1)
+        inotify_rm_watch(E.inotify, f->disk.wd);
+#endif
+    f->disk.wd = -1;
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void editorUpdateSyntax(erow *row)
+/* Record the state of the file the buffer matches, as it is now. */
+void editorDiskRecord(struct fileState *f)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    struct stat st;
 
-    /* No syntax, everything is HL_NORMAL. */
-    if (E.file[E.current_file]->syntax == NULL)
+    f->disk.changed = 0;
+    f->disk.pending = 0;
+
+    if (f->filename == NULL || stat(f->filename, &st) != 0)
+    {
+        f->disk.size = -1;
+        editorDiskUnwatch(f);
         return;
+    }
+
+    f->disk.size = st.st_size;
+    f->disk.mtime = editorStatTime(&st);
+    f->disk.ino = st.st_ino;
+    f->disk.dev = st.st_dev;
 
-    int i, prev_sep, in_string, in_comment;
-    char *p;
-    char **keywords = E.file[E.current_file]->syntax->keywords;
+    editorDiskWatch(f);
+}
 
-    /* Point to the first non-space char. */
-    p = row->render;
-    i = 0; /* Current char offset */
+/* Tell the user if the file has changed since we recorded it. */
+void editorDiskCheck(struct fileState *f)
+{
+    struct stat st;
 
-    while (*p && isspace(*p))
+    if (f->follow)
     {
-        p++;
-        i++;
+        editorFollowUpdate(f);
+        return;
     }
 
-    prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
-    in_string = 0; /* Are we inside "" or '' ? */
-    in_comment = 0; /* Are we inside multi-line comment? */
-
-    /* If the previous line has an open comment, this line starts
-     * with an open comment state. */
-    if (row->idx > 0 && editorRowHasOpenComment(&E.file[E.current_file]->row[row->idx - 1]))
-        in_comment = 1;
+    if (f->filename == NULL || f->disk.size < 0 || f->disk.changed)
+        return;
 
-    while (*p)
-    {
+    if (stat(f->filename, &st) != 0)
+        return;
 
-        /* Handle multi line comments. */
-        if (in_comment)
-        {
-            row->hl[i] = HL_MLCOMMENT;
+    if (st.st_size == f->disk.size && editorStatTime(&st) == f->disk.mtime &&
+            (uint64_t)st.st_ino == f->disk.ino && (uint64_t)st.st_dev == f->disk.dev)
+        return;
 
-            if (strncmp(p, E.file[E.current_file]->syntax->multiline_comment_end,
-                        strlen(E.file[E.current_file]->syntax->multiline_comment_end)) == 0)
-            {
+    f->disk.changed = 1;
+    editorSetStatusMessage(1, "%s has changed on disk, M-x reload() to load it", f->filename);
+}
 
-                for (int x = 0; x < (int)strlen(E.file[E.current_file]->syntax->multiline_comment_end); x++)
-                {
-                    row->hl[i + x] = HL_MLCOMMENT;
-                }
+/* Handle the events inotify has for us, checking the buffers concerned. */
+void editorDiskEvents(void)
+{
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
 
-                p += strlen(E.file[E.current_file]->syntax->multiline_comment_end) ;
-                i += strlen(E.file[E.current_file]->syntax->multiline_comment_end) ;
-                in_comment = 0;
-                prev_sep = 1;
-                continue;
-            }
-            else
-            {
-                prev_sep = 0;
-                p++;
-                i++;
-                continue;
-            }
-        }
-        else if (strlen(E.file[E.current_file]->syntax->multiline_comment_start) && strncmp(p, E.file[E.current_file]->syntax->multiline_comment_start,
-                 strlen(E.file[E.current_file]->syntax->multiline_comment_start)) == 0)
+    while ((len = read(E.inotify, buf, sizeof(buf))) > 0)
+    {
+        for (char *c = buf; c < buf + len;)
         {
+            struct inotify_event *ev = (struct inotify_event *)c;
 
-            for (int  x = 0; x < (int)strlen(E.file[E.current_file]->syntax->multiline_comment_start) ; x++)
+            for (int i = 0; i < E.max_files; i++)
             {
-                row->hl[i + x] = HL_MLCOMMENT;
+                if (E.file[i]->disk.wd == ev->wd)
+                    E.file[i]->disk.pending = 1;
             }
 
-            p += (int)strlen(E.file[E.current_file]->syntax->multiline_comment_start) ;
-            i += (int)strlen(E.file[E.current_file]->syntax->multiline_comment_start) ;
-            in_comment = 1;
-            prev_sep = 0;
-            continue;
+            c += sizeof(struct inotify_event) + ev->len;
         }
+    }
 
-        /* Handle // comments - colour the rest of the line and return. */
-        if (prev_sep && strlen(E.file[E.current_file]->syntax->singleline_comment_start) > 0
-                && (strncmp(p, E.file[E.current_file]->syntax->singleline_comment_start, strlen(E.file[E.current_file]->syntax->singleline_comment_start)) == 0))
+    for (int i = 0; i < E.max_files; i++)
+    {
+        if (E.file[i]->disk.pending)
         {
-            /* From here to end is a comment */
-            memset(row->hl + i, HL_COMMENT, row->rsize - i);
-            return;
+            E.file[i]->disk.pending = 0;
+            editorDiskCheck(E.file[i]);
         }
+    }
+#endif
+}
 
-        /* Handle "" and '' */
-        if (in_string)
-        {
-            if (E.file[E.current_file]->syntax->flags & HL_HIGHLIGHT_STRINGS)
-                row->hl[i] = HL_STRING;
+/* Check every buffer's file, in case we weren't told of a change, or
+ * are waiting for a rotated file to reappear. */
+void editorDiskPoll(void)
+{
+    for (int i = 0; i < E.max_files; i++)
+        editorDiskCheck(E.file[i]);
+}
 
-            if (*p == '\\')
-            {
-                if (E.file[E.current_file]->syntax->flags & HL_HIGHLIGHT_STRINGS)
-                    row->hl[i + 1] = HL_STRING;
+/* Find which of the `m` lines in `b` are unchanged rows of the `n` in
+ * `a`, using Myers' O(ND) algorithm.
+ *
+ * On return match[j] is the row of `a` which line `j` of `b` is, or -1
+ * if it is new.  If more than `limit` lines differ we give up, and report
+ * that every line is new. */
+void editorDiffLines(erow *a, int n, char **b, int *bsize, int m, int *match, int limit)
+{
+    for (int j = 0; j < m; j++)
+        match[j] = -1;
 
-                p += 2;
-                i += 2;
-                prev_sep = 0;
-                continue;
-            }
+    if (n == 0 || m == 0)
+        return;
 
-            if (*p == in_string)
-                in_string = 0;
+    /*
+     * The furthest x reached on each diagonal k = x - y, for each number
+     * of edits d.  Only diagonals -d, -d+2, ... d can be reached with d
+     * edits, so the values for d are held at trace[d * (d + 1) / 2].
+     */
+    int max = n + m < limit ? n + m : limit;
+    int *trace = malloc(sizeof(int) * ((size_t)(max + 1) * (max + 2) / 2));
+    int d, found = 0;
 
-            p++;
-            i++;
-            continue;
-        }
-        else
+#define V(d, k) trace[(size_t)(d) * ((d) + 1) / 2 + ((k) + (d)) / 2]
+
+    for (d = 0; d <= max && !found; d++)
+    {
+        for (int k = -d; k <= d; k += 2)
         {
-            if (*p == '"' || *p == '\'')
+            int x;
+
+            if (d == 0)
+                x = 0;
+            else if (k == -d || (k != d && V(d - 1, k - 1) < V(d - 1, k + 1)))
+                x = V(d - 1, k + 1);
+            else
+                x = V(d - 1, k - 1) + 1;
+
+            int y = x - k;
+
+            while (x < n && y < m && a[x].size == bsize[y] &&
+                    memcmp(a[x].chars, b[y], bsize[y]) == 0)
             {
-                in_string = *p;
+                x++;
+                y++;
+            }
 
-                if (E.file[E.current_file]->syntax->flags & HL_HIGHLIGHT_STRINGS)
-                    row->hl[i] = HL_STRING;
+            V(d, k) = x;
 
-                p++;
-                i++;
-                prev_sep = 0;
-                continue;
+            if (x >= n && y >= m)
+            {
+                found = 1;
+                break;
             }
         }
+    }
 
-        /* Handle numbers */
-        if ((isdigit(*p) && (prev_sep || row->hl[i - 1] == HL_NUMBER)) ||
-                (*p == '.' && i > 0 && row->hl[i - 1] == HL_NUMBER))
-        {
-            if (E.file[E.current_file]->syntax->flags & HL_HIGHLIGHT_NUMBERS)
-                row->hl[i] = HL_NUMBER;
+    if (!found)
+    {
+        free(trace);
+        return;
+    }
 
-            p++;
-            i++;
-            prev_sep = 0;
-            continue;
-        }
+    /*
+     * Walk back from the end, recording the diagonals as matches.
+     */
+    int x = n, y = m;
 
-        if (is_separator(*p))
-            row->hl[i] = HL_KEYWORD1;
+    for (d = d - 1; d > 0; d--)
+    {
+        int k = x - y;
+        int pk = (k == -d || (k != d && V(d - 1, k - 1) < V(d - 1, k + 1))) ? k + 1 : k - 1;
+        int px = V(d - 1, pk);
+        int sx = pk == k - 1 ? px + 1 : px;
 
-        /* Handle keywords and lib calls */
-        if (prev_sep)
+        while (x > sx)
         {
-            int j;
-
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
+            x--;
+            y--;
+            match[y] = x;
+        }
 
-                /*
-                 * Take a copy of the keyword, so that we can
-                 * remove the "|" from it, if we required
-                 */
-                char *tmp = strdup(keywords[j]);
+        x = px;
+        y = px - pk;
+    }
 
-                /*
-                 * Compare the keyword as a regexp.
-                 */
-                if (kw2)
-                    klen--;
+    while (x > 0 && y > 0)
+    {
+        x--;
+        y--;
+        match[y] = x;
+    }
 
-#ifdef _REGEXP
-                regex_t regex;
+#undef V
 
-                /*
-                 * Strip the trailing "|"
-                 */
-                if (kw2)
-                    tmp[klen] = '\0';
+    free(trace);
+}
 
-                /*
-                 * Can't compile?  Skip.
-                 */
-                if (regcomp(&regex, tmp, REG_EXTENDED) != 0)
-                {
-                    free(tmp);
-                    continue;
-                }
+/* Move a view of the rows that were, to the same rows after a reload. */
+void editorReloadView(struct fileState *f, struct editorView *v, int *where, int n)
+{
+    int old = v->rowoff + v->cy < n ? v->rowoff + v->cy : n;
+    int line = where[old];
 
-                regmatch_t result[1];
-                int res = regexec(&regex, p, 1, result, 0);
+    v->rowoff += line - old;
 
-                /* the offset of the match */
-                int offset = result[0].rm_so;
+    if (v->rowoff < 0)
+        v->rowoff = 0;
 
-                /* the length of the match */
-                klen = (result[0]).rm_eo - (result[0]).rm_so;
-                free(tmp);
+    if (line >= f->numrows)
+        line = f->numrows > 0 ? f->numrows - 1 : 0;
 
-                /*
-                 * We need :
-                 *
-                 *  The match succeeded:  (res == 0 )
-                 *
-                 *  The match was made at the current position
-                 *   (offset == 0 )
-                 *
-                 *  The separator magic.
-                 */
-                if ((res == 0) && (offset == 0) && (is_separator(*(p + klen))))
-                {
-                    memset(row->hl + i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    p += klen;
-                    i += klen;
-                    break;
-                }
+    if (v->rowoff > line)
+        v->rowoff = line;
 
-#else
+    v->cy = line - v->rowoff;
 
-                if (!memcmp(p, keywords[j], klen) &&
-                        is_separator(*(p + klen)))
-                {
-                    /* Keyword */
-                    memset(row->hl + i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    p += klen;
-                    i += klen;
-                    free(tmp);
-                    break;
+    int size = line < f->numrows ? f->row[line].size : 0;
 
-                }
+    if (v->coloff + v->cx > size)
+    {
+        v->cx = size < v->coloff ? 0 : size - v->coloff;
+        v->coloff = size < v->coloff ? size : v->coloff;
+    }
+}
 
-                free(tmp);
-#endif
-            }
+/* Bring the buffer up to date with its file, replacing only the rows
+ * which differ.  The cursor, mark, and undo history are kept. */
+int editorReload(struct fileState *f)
+{
+    if (f->filename == NULL)
+        return 1;
 
-            if (keywords[j] != NULL)
-            {
-                prev_sep = 0;
-                continue; /* We had a keyword match */
-            }
+    if (f->pager)
+    {
+        editorPagerOpen(f, f->filename);
+        f->dirty = 0;
+        editorDiskRecord(f);
+        return 0;
+    }
 
+    if (f->hex)
+    {
+        if (editorHexOpen(f, f->filename) != 0)
+        {
+            editorSetStatusMessage(1, "Can't reload %s: %s", f->filename, strerror(errno));
+            return 1;
         }
 
-        /* Not special chars */
-        prev_sep = is_separator(*p);
-        p++;
-        i++;
+        editorHexMove(f, 0);
+        f->dirty = 0;
+        editorDiskRecord(f);
+        return 0;
     }
 
-    /* Propagate syntax change to the next row if the open comment
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
-    int oc = editorRowHasOpenComment(row);
+    FILE *fp = fopen(f->filename, "r");
+    struct stat st;
 
-    if (row->hl_oc != oc && row->idx + 1 < E.file[E.current_file]->numrows)
-        editorUpdateSyntax(&E.file[E.current_file]->row[row->idx + 1]);
+    if (fp == NULL || fstat(fileno(fp), &st) != 0)
+    {
+        if (fp)
+            fclose(fp);
+        editorSetStatusMessage(1, "Can't reload %s: %s", f->filename, strerror(errno));
+        return 1;
+    }
 
-    row->hl_oc = oc;
-}
+    /*
+     * Read the file, and split it into lines in place.
+     */
+    char *text;
+    size_t len;
 
-/* Maps syntax highlight token types to terminal colors. */
-int editorSyntaxToColor(int hl)
-{
-    switch (hl)
+#ifdef _GZIP
+
+    if (editorGzipped(fp))
     {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 36;     /* cyan */
+        fclose(fp);
 
-    case HL_KEYWORD1:
-        return 33;    /* yellow */
+        /* Keep what we have, rather than part of the file. */
+        if ((text = editorGzipRead(f->filename, &len)) == NULL)
+            return 1;
+    }
+    else
+#endif
+    {
+        text = malloc(st.st_size + 1);
+        len = fread(text, 1, st.st_size, fp);
+        fclose(fp);
+    }
 
-    case HL_KEYWORD2:
-        return 32;    /* green */
+    editorScanReset(&f->scan);
+    editorScanText(&f->scan, text, len);
+    editorScanEnd(&f->scan);
+    f->crlf = f->scan.dos == 1;
 
-    case HL_STRING:
-        return 35;      /* magenta */
+    int m = 0, room = 1024;
+    char **line = malloc(sizeof(char *) * room);
+    int *size = malloc(sizeof(int) * room);
 
-    case HL_NUMBER:
-        return 31;      /* red */
+    for (char *c = text, *end = text + len; c < end;)
+    {
+        char *nl = memchr(c, '\n', end - c);
 
-    case HL_MATCH:
-        return 34;      /* blue */
+        if (m == room)
+        {
+            room *= 2;
+            line = realloc(line, sizeof(char *) * room);
+            size = realloc(size, sizeof(int) * room);
+        }
 
-    case HL_SELECTION:
-        return 30;
+        line[m] = c;
+        size[m] = nl ? nl - c : end - c;
+        c += size[m] + 1;
 
-    default:
-        return 37;             /* white */
+        if (nl && f->crlf && size[m] && line[m][size[m] - 1] == '\r')
+            size[m]--;
+
+        m++;
     }
-}
 
+    /*
+     * The rows are compared, and rebuilt, so we need all of their text.
+     */
+    editorColdThawAll(f);
 
+    /*
+     * Lines at the start and end which are unchanged needn't be diffed.
+     */
+    int n = f->numrows;
+    int head = 0, tail = 0;
 
+    while (head < n && head < m && f->row[head].size == size[head] &&
+            memcmp(f->row[head].chars, line[head], size[head]) == 0)
+        head++;
 
+    while (tail < n - head && tail < m - head &&
+            f->row[n - 1 - tail].size == size[m - 1 - tail] &&
+            memcmp(f->row[n - 1 - tail].chars, line[m - 1 - tail], size[m - 1 - tail]) == 0)
+        tail++;
 
-/* ======================= Input functions           ======================= */
+    int *match = malloc(sizeof(int) * (m + 1));
 
-/* Show a prompt.  Read input until either `Esc` or `Return`. */
-char *get_input(char *prompt)
-{
-    char query[KILO_QUERY_LEN + 1] = {0};
-    int qlen = 0;
+    editorDiffLines(f->row + head, n - head - tail, line + head, size + head, m - head - tail,
+                    match + head, KILO_DIFF_LIMIT);
 
-    /* Save the cursor position in order to restore it later. */
-    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
-    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+    for (int j = 0; j < head; j++)
+        match[j] = j;
 
-    while (1)
+    for (int j = head; j < m - tail; j++)
     {
-        editorSetStatusMessage(0, "%s%s", prompt, query);
-        editorRefreshScreen();
+        if (match[j] != -1)
+            match[j] += head;
+    }
 
-        int c = editorReadKey(STDIN_FILENO);
+    for (int j = m - tail; j < m; j++)
+        match[j] = j - m + n;
 
-        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE)
+    /*
+     * Build the new rows, reusing those which are unchanged.
+     */
+    erow *rows = malloc(sizeof(erow) * (m + 1));
+    int *keep = calloc(n + 1, sizeof(int));
+    int *where = malloc(sizeof(int) * (n + 1));
+    int changed = 0;
+
+    for (int j = 0; j < m; j++)
+    {
+        int i = match[j];
+
+        if (i != -1)
         {
-            if (qlen != 0) query[--qlen] = '\0';
+            rows[j] = f->row[i];
+            keep[i] = 1;
         }
-        else if (c == ESC)
+        else
         {
-            E.file[E.current_file]->cx = saved_cx;
-            E.file[E.current_file]->cy = saved_cy;
-            E.file[E.current_file]->coloff = saved_coloff;
-            E.file[E.current_file]->rowoff = saved_rowoff;
-            editorSetStatusMessage(0, "");
-            return NULL;
+            rows[j].chars = arena_strndup(&f->arena, line[j], size[j]);
+            rows[j].size = size[j];
+            rows[j].arena = 1;
+            rows[j].hl = NULL;
+            rows[j].nhl = 0;
+            rows[j].hl_oc = 0;
+            rows[j].cold = 0;
+            rows[j].cols = NULL;
+            rows[j].giant = NULL;
+            changed++;
         }
-        else if (c == ENTER)
+
+        rows[j].idx = j;
+    }
+
+    /*
+     * Where each old row went, or where it would have been if it was
+     * removed.
+     */
+    for (int i = 0, j = 0; i <= n; i++)
+    {
+        while (j < m && (match[j] == -1 || match[j] < i))
+            j++;
+
+        where[i] = j;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!keep[i])
         {
-            E.file[E.current_file]->cx = saved_cx;
-            E.file[E.current_file]->cy = saved_cy;
-            E.file[E.current_file]->coloff = saved_coloff;
-            E.file[E.current_file]->rowoff = saved_rowoff;
-            editorSetStatusMessage(0, "");
-            return (strdup(query));
+            editorFreeRow(&f->row[i]);
+            changed++;
         }
-        else if (isprint(c))
+    }
+
+    free(f->row);
+    f->row = rows;
+    f->numrows = m;
+    f->version++;
+    editorWrapFree(f);
+
+    /*
+     * Highlight the new rows, and the rows after them whose state may
+     * have changed.
+     */
+    for (int j = 0; j < m; j++)
+    {
+        if (match[j] == -1)
+            editorUpdateRow(f, &f->row[j]);
+        else if (j == 0 ? match[j] != 0 : match[j - 1] != match[j] - 1)
+            editorUpdateSyntax(f, &f->row[j]);
+    }
+
+    /*
+     * Move the cursor, mark, and other windows' views along with the
+     * text they were on.
+     */
+    struct editorView v;
+    editorGetView(f, &v);
+    editorReloadView(f, &v, where, n);
+    editorSetView(f, &v);
+
+    if (f->marky >= 0)
+    {
+        f->marky = where[f->marky < n ? f->marky : n];
+
+        if (f->marky >= m)
+            f->markx = f->marky = -1;
+    }
+
+    for (struct editorWindow *w = E.root ? editorFirstWindow(E.root) : NULL; w;)
+    {
+        if (w != E.window && w->buffer == f->id)
+            editorReloadView(f, &w->view, where, n);
+
+        w = editorNextWindow(w);
+
+        if (w == editorFirstWindow(E.root))
+            break;
+    }
+
+#ifdef _UNDO
+    /*
+     * Undo actions on rows which were kept move with them.  Anything on
+     * a row which changed can't be undone, nor can anything before it.
+     */
+    UndoStack *undo = f->undo;
+
+    for (int i = undo->size - 1; i >= 0; i--)
+    {
+        UndoAction *a = undo->elements[i];
+
+        if (a->y < 0 || a->y > n || (a->y < n && !keep[a->y]))
         {
-            if (qlen < KILO_QUERY_LEN)
-            {
-                query[qlen++] = c;
-                query[qlen] = '\0';
-            }
+            us_drop(undo, i + 1);
+            break;
+        }
+
+        a->y = where[a->y];
+    }
+#endif
+
+    f->dirty = 0;
+    editorDiskRecord(f);
+    editorSetStatusMessage(1, "Reloaded %s, %d line(s) changed", f->filename, changed);
+
+    free(keep);
+    free(where);
+    free(match);
+    free(line);
+    free(size);
+    free(text);
+    return 0;
+}
+
+
+
+/* ============================ Following files ============================ */
+
+/*
+ * A buffer may follow its file, like `tail -f`, in which case whatever is
+ * appended to the file is appended to the buffer.  We're told the file has
+ * changed by inotify, where available, and we also look once a second in
+ * case we weren't told.
+ *
+ * We keep the file open, so that if it is rotated we can read the last
+ * lines written to the old file before we move on to the new one.
+ */
+
+/* Append text to the end of the buffer, splitting it into rows.
+ *
+ * If `partial` is set the last row is incomplete, and the text up to the
+ * first newline is added to it.  On return `partial` is set if the text
+ * didn't end with a newline. */
+void editorAppendText(struct fileState *f, char *text, size_t len, int *partial)
+{
+    char *end = text + len;
+    char *nl;
+    int dirty = f->dirty;
+    int count = 0;
+
+    if (len == 0)
+        return;
+
+    editorScanText(&f->scan, text, len);
+
+    if (*partial && f->numrows > 0)
+    {
+        nl = memchr(text, '\n', len);
+
+        size_t n = nl ? (size_t)(nl - text) : len;
+        erow *row = &f->row[f->numrows - 1];
+        editorRowAppendString(f, row, text, n);
+        text += nl ? n + 1 : n;
+
+        /* The CR of a CRLF may have arrived before its LF. */
+        if (nl && f->scan.dos == 1 && row->size && row->chars[row->size - 1] == '\r')
+        {
+            row->chars[--row->size] = '\0';
+            editorUpdateRow(f, row);
+        }
+    }
+
+    /*
+     * Make room for all of the new rows at once.
+     */
+    for (char *c = text; c < end && (c = memchr(c, '\n', end - c)) != NULL; c++)
+        count++;
+
+    if (text < end && end[-1] != '\n')
+        count++;
+
+    f->row = realloc(f->row, sizeof(erow) * (f->numrows + count));
+
+    while (text < end)
+    {
+        nl = memchr(text, '\n', end - text);
+
+        size_t n = nl ? (size_t)(nl - text) : (size_t)(end - text);
+        size_t size = n;
+        erow *row = &f->row[f->numrows];
+
+        if (nl && f->scan.dos == 1 && size && text[size - 1] == '\r')
+            size--;
+
+        row->chars = arena_strndup(&f->arena, text, size);
+        row->size = size;
+        row->arena = 1;
+        row->hl = NULL;
+        row->nhl = 0;
+        row->hl_oc = 0;
+        row->cold = 0;
+        row->cols = NULL;
+        row->giant = NULL;
+        row->idx = f->numrows;
+        editorWrapInsert(f, f->numrows);
+        editorUpdateRow(f, row);
+        f->numrows++;
+
+        text += nl ? n + 1 : n;
+    }
+
+    *partial = end[-1] != '\n';
+
+    /* Text read from the file isn't a modification. */
+    f->dirty = dirty;
+
+    if ((f->numrows >> 16) != ((f->numrows - count) >> 16))
+        editorColdCheck(f);
+}
+
+/* Move a view which was on the last of `old` rows to the new last row. */
+void editorFollowView(struct fileState *f, struct editorView *v, int rows, int old)
+{
+    if (v->rowoff + v->cy < old - 1 || f->numrows == 0)
+        return;
+
+    int line = f->numrows - 1;
+
+    if (line >= v->rowoff + rows)
+        v->rowoff = line - rows + 1;
+
+    v->cy = line - v->rowoff;
+    v->cx = v->coloff = 0;
+}
+
+/* Empty the buffer, because the file it follows was truncated. */
+void editorFollowReset(struct fileState *f)
+{
+    for (int i = 0; i < f->numrows; i++)
+        editorFreeRow(&f->row[i]);
+
+    free(f->row);
+    f->row = NULL;
+    f->numrows = 0;
+    f->version++;
+    arena_free(&f->arena);
+    editorColdFree(f);
+    editorWrapFree(f);
+    editorScanReset(&f->scan);
+
+    f->cx = f->cy = f->rowoff = f->coloff = f->wrapoff = 0;
+    f->markx = f->marky = -1;
+    f->dirty = 0;
+    f->follow->offset = 0;
+    f->follow->partial = 0;
+
+#ifdef _UNDO
+    us_clear(f->undo);
+#endif
+}
+
+/* Read whatever has been appended to the file since we last looked. */
+void editorFollowRead(struct fileState *f)
+{
+    static char buf[64 * 1024];
+    struct editorFollow *w = f->follow;
+    int old = f->numrows;
+    ssize_t n;
+
+    if (f->pager)
+    {
+        struct editorPager *p = f->pager;
+        struct stat st;
+
+        if (fstat(w->fd, &st) != 0 || st.st_size == p->size)
+            return;
+
+        /*
+         * The pager reads the file itself, it just needs to know that
+         * there's more of it, and the line-count is no longer known.
+         */
+        int end = p->lines >= 0 && p->end >= p->lines &&
+                  f->rowoff + f->cy >= f->numrows - 1;
+
+        p->size = w->offset = st.st_size;
+        p->lines = -1;
+
+        if (end && f == E.file[E.current_file])
+            editorPagerShow(f, INT64_MAX / 2);
+
+        return;
+    }
+
+    while ((n = pread(w->fd, buf, sizeof(buf), w->offset)) > 0)
+    {
+        editorAppendText(f, buf, n, &w->partial);
+        w->offset += n;
+    }
+
+    editorFollowWindows(f, old);
+}
+
+/* Windows which were showing the last of `old` rows move to the new end. */
+void editorFollowWindows(struct fileState *f, int old)
+{
+    if (f->numrows == old || E.root == NULL)
+        return;
+
+    for (struct editorWindow *win = editorFirstWindow(E.root);;)
+    {
+        if (win == E.window && f == E.file[E.current_file])
+        {
+            struct editorView v;
+            editorGetView(f, &v);
+            editorFollowView(f, &v, E.screenrows, old);
+            editorSetView(f, &v);
+        }
+        else if (win->buffer == f->id)
+            editorFollowView(f, &win->view, win->height - 1, old);
+
+        win = editorNextWindow(win);
+
+        if (win == editorFirstWindow(E.root))
+            break;
+    }
+}
+
+/* Bring a followed buffer up to date with its file. */
+void editorFollowUpdate(struct fileState *f)
+{
+    struct editorFollow *w = f->follow;
+    struct stat st, now;
+
+    if (fstat(w->fd, &st) != 0)
+        return;
+
+    /*
+     * The file was truncated, so start again from the beginning.
+     */
+    if (st.st_size < w->offset)
+    {
+        if (f->pager)
+        {
+            editorPagerOpen(f, f->filename);
+            w->offset = 0;
         }
+        else
+            editorFollowReset(f);
+    }
+
+    editorFollowRead(f);
+
+    /*
+     * If the file was rotated then we've read the end of the old one,
+     * and continue with the new one - once it exists.
+     */
+    if (stat(f->filename, &now) == 0 && (now.st_ino != st.st_ino || now.st_dev != st.st_dev))
+    {
+        int fd = open(f->filename, O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1)
+            return;
+
+        close(w->fd);
+        w->fd = fd;
+        w->offset = 0;
+
+        editorDiskRecord(f);
+
+        if (f->pager)
+            editorPagerOpen(f, f->filename);
+        else
+            editorFollowRead(f);
+    }
+}
+
+/* Start following the file of the given buffer.
+ *
+ * We continue reading from where the file ended when we last loaded, or
+ * saved, it, whatever edits have been made to the buffer since.  If we
+ * have no record of that file, or it has since been replaced or cut
+ * short, we can't know where that was. */
+int editorFollowStart(struct fileState *f)
+{
+    if (f->follow || f->filename == NULL || f->hex || f->gzip)
+        return f->follow != NULL;
+
+    int fd = open(f->filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) != 0 || f->disk.size < 0 || st.st_size < f->disk.size ||
+            (uint64_t)st.st_ino != f->disk.ino || (uint64_t)st.st_dev != f->disk.dev)
+    {
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+
+    struct editorFollow *w = calloc(1, sizeof(struct editorFollow));
+    w->fd = fd;
+
+    if (f->pager)
+        w->offset = f->pager->size;
+    else
+    {
+        /*
+         * Continue from the size of the file we loaded, rather than
+         * counting our rows, which have lost any CRs.
+         */
+        char last = '\n';
+
+        w->offset = f->disk.size;
+
+        /* The last line had no newline. */
+        if (w->offset > 0 && pread(fd, &last, 1, w->offset - 1) == 1 && last != '\n')
+            w->partial = 1;
+    }
+
+    f->follow = w;
+    editorDiskRecord(f);
+    editorFollowUpdate(f);
+    return 1;
+}
+
+/* Stop following the file of the given buffer. */
+void editorFollowStop(struct fileState *f)
+{
+    if (f->follow == NULL)
+        return;
+
+    close(f->follow->fd);
+    free(f->follow);
+    f->follow = NULL;
+
+    /* The buffer is as up to date as the file. */
+    editorDiskRecord(f);
+}
+
+
+
+/* ================================ Cold rows ================================ */
+
+/*
+ * Once a buffer holds more than E.compress_rows bytes of text, the rows
+ * which are far from any window are compressed, in blocks of
+ * KILO_COLD_ROWS.  A block is decompressed again when one of its rows is
+ * needed, and at most KILO_COLD_HOT blocks are kept that way, beyond
+ * those close to a window.
+ */
+
+/* Find the block holding the row `at`, or -1 if it isn't in one. */
+int editorColdFind(struct editorCold *c, int at)
+{
+    int lo = 0, hi = c->count - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        struct editorColdBlock *k = &c->block[mid];
+
+        if (at < k->first)
+            hi = mid - 1;
+        else if (at >= k->first + k->count)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+/* Are any of the rows [lo, hi) close to a window onto the buffer? */
+int editorColdNear(struct fileState *f, int lo, int hi)
+{
+    int margin = KILO_COLD_ROWS;
+
+    if (hi > f->rowoff - margin && lo < f->rowoff + E.screenrows + margin)
+        return 1;
+
+    if (E.root == NULL)
+        return 0;
+
+    for (struct editorWindow *win = editorFirstWindow(E.root);;)
+    {
+        if (win->buffer == f->id && hi > win->view.rowoff - margin &&
+                lo < win->view.rowoff + win->height + margin)
+            return 1;
+
+        win = editorNextWindow(win);
+
+        if (win == editorFirstWindow(E.root))
+            return 0;
     }
 }
 
+/* Compress the text of the rows of the block `k`, and free it. */
+void editorColdFreeze(struct fileState *f, struct editorColdBlock *k)
+{
+    struct editorCold *c = f->cold;
+    erow *row = &f->row[k->first];
+    int clean = k->clean && k->data != NULL;
+
+    /*
+     * Rows which have been changed have their own copy of their text,
+     * so we must compress them again.
+     */
+    for (int i = 0; i < k->count && clean; i++)
+        clean = row[i].arena;
+
+    if (!clean)
+    {
+        size_t length = 0;
+
+        for (int i = 0; i < k->count; i++)
+            length += row[i].size + 1;
+
+        char *text = malloc(length), *p = text;
+
+        for (int i = 0; i < k->count; i++)
+        {
+            memcpy(p, row[i].chars, row[i].size);
+            p[row[i].size] = '\0';
+            p += row[i].size + 1;
+        }
+
+        char *data = malloc(lz_bound(length));
+        size_t size = lz_compress(text, length, data);
+        free(text);
+
+        if (k->data)
+        {
+            c->bytes -= k->size;
+            free(k->data);
+        }
+
+        k->data = realloc(data, size);
+        k->size = size;
+        k->length = length;
+        c->bytes += size;
+    }
+
+    for (int i = 0; i < k->count; i++)
+    {
+        if (!row[i].arena)
+            free(row[i].chars);
+
+        row[i].chars = NULL;
+        row[i].arena = 1;
+        row[i].cold = 1;
+    }
+
+    if (k->text)
+    {
+        free(k->text);
+        k->text = NULL;
+        c->thawed -= 1;
+    }
+
+    k->clean = 1;
+}
+
+/* Decompress the block `b`, so that its rows may be used. */
+void editorColdThaw(struct fileState *f, int b)
+{
+    struct editorCold *c = f->cold;
+    struct editorColdBlock *k = &c->block[b];
+    erow *row = &f->row[k->first];
+
+    k->text = malloc(k->length);
+
+    if (lz_decompress(k->data, k->size, k->text, k->length) != (long)k->length)
+    {
+        fprintf(stderr, "Compressed rows are corrupt - aborting\n");
+        exit(1);
+    }
+
+    char *p = k->text;
+
+    for (int i = 0; i < k->count; i++)
+    {
+        row[i].chars = p;
+        row[i].cold = 0;
+        p += row[i].size + 1;
+    }
+
+    k->used = ++c->clock;
+    c->thawed += 1;
+
+    /*
+     * Compress the least recently used block again, if we have too many,
+     * so that reading every row doesn't need room for them all.
+     */
+    if (c->thawed > KILO_COLD_HOT)
+    {
+        struct editorColdBlock *lru = NULL;
+
+        for (int i = 0; i < c->count; i++)
+        {
+            struct editorColdBlock *o = &c->block[i];
+
+            if (o->text && o != k && (lru == NULL || o->used < lru->used) &&
+                    !editorColdNear(f, o->first, o->first + o->count))
+                lru = o;
+        }
+
+        if (lru)
+            editorColdFreeze(f, lru);
+    }
+}
+
+/* Make sure the text of the row is in memory.
+ *
+ * Using another row may compress it again, unless it is close to a
+ * window, so don't hold on to the text for long. */
+void editorRowWarm(struct fileState *f, erow *row)
+{
+    if (row->cold)
+        editorColdThaw(f, editorColdFind(f->cold, row->idx));
+}
+
+/* A row is about to be inserted at `at`, so move the blocks after it.
+ *
+ * If it falls within a block it becomes part of that block. */
+void editorColdInsert(struct fileState *f, int at)
+{
+    struct editorCold *c = f->cold;
+
+    if (c == NULL)
+        return;
+
+    for (int i = c->count - 1; i >= 0 && c->block[i].first + c->block[i].count > at; i--)
+    {
+        struct editorColdBlock *k = &c->block[i];
+
+        if (k->first >= at)
+        {
+            k->first += 1;
+            continue;
+        }
+
+        if (k->text == NULL)
+            editorColdThaw(f, i);
+
+        k->count += 1;
+        k->clean = 0;
+    }
+}
+
+/* The row `at` is about to be deleted, so move the blocks after it. */
+void editorColdDelete(struct fileState *f, int at)
+{
+    struct editorCold *c = f->cold;
+
+    if (c == NULL)
+        return;
+
+    for (int i = c->count - 1; i >= 0 && c->block[i].first + c->block[i].count > at; i--)
+    {
+        struct editorColdBlock *k = &c->block[i];
+
+        if (k->first > at)
+        {
+            k->first -= 1;
+            continue;
+        }
+
+        /*
+         * The rest of the block must be compressed again, so we need
+         * the text of each of its rows.
+         */
+        if (k->text == NULL)
+            editorColdThaw(f, i);
+
+        k->count -= 1;
+        k->clean = 0;
+
+        if (k->count == 0)
+        {
+            c->bytes -= k->size;
+            c->thawed -= 1;
+            free(k->data);
+            free(k->text);
+            memmove(k, k + 1, sizeof(*k) * (c->count - i - 1));
+            c->count -= 1;
+        }
+    }
+}
+
+/* Copy the text of the rows which aren't in a block into a new arena,
+ * and free the old one, which held the text of those we compressed. */
+void editorColdCompact(struct fileState *f)
+{
+    struct editorCold *c = f->cold;
+    Arena fresh = { NULL, 0, f->arena.intern, NULL, 0, 0 };
+    int b = 0;
+
+    for (int i = 0; i < f->numrows; i++)
+    {
+        if (b < c->count && i == c->block[b].first)
+        {
+            i += c->block[b++].count - 1;
+            continue;
+        }
+
+        if (f->row[i].arena)
+            f->row[i].chars = arena_strndup(&fresh, f->row[i].chars, f->row[i].size);
+    }
+
+    arena_free(&f->arena);
+    f->arena = fresh;
+}
+
+/* Compress the rows which are far from any window, and not already in
+ * a block, in blocks of KILO_COLD_ROWS. */
+void editorColdSweep(struct fileState *f)
+{
+    struct editorCold *c = f->cold;
+    struct editorColdBlock *old = c->block;
+    int count = c->count, froze = 0;
+
+    c->block = NULL;
+    c->count = 0;
+
+    for (int i = 0, b = 0;; b++)
+    {
+        int end = b < count ? old[b].first : f->numrows;
+
+        /*
+         * Rows in the gap before the next block.
+         */
+        while (end - i >= KILO_COLD_ROWS)
+        {
+            if (editorColdNear(f, i, i + KILO_COLD_ROWS))
+            {
+                i += 1;
+                continue;
+            }
+
+            c->block = realloc(c->block, sizeof(struct editorColdBlock) * (c->count + 1));
+
+            struct editorColdBlock *k = &c->block[c->count++];
+            memset(k, 0, sizeof(*k));
+            k->first = i;
+            k->count = KILO_COLD_ROWS;
+            editorColdFreeze(f, k);
+
+            i += KILO_COLD_ROWS;
+            froze = 1;
+        }
+
+        if (b == count)
+            break;
+
+        c->block = realloc(c->block, sizeof(struct editorColdBlock) * (c->count + 1));
+        c->block[c->count++] = old[b];
+        i = old[b].first + old[b].count;
+    }
+
+    free(old);
+
+    if (froze)
+        editorColdCompact(f);
+}
+
+/* Compress the buffer's cold rows, if it is large enough to need it. */
+void editorColdCheck(struct fileState *f)
+{
+    if (f->pager || E.compress_rows <= 0)
+        return;
+
+    if (f->cold == NULL)
+    {
+        if ((int64_t)f->arena.bytes < E.compress_rows)
+            return;
+
+        f->cold = calloc(1, sizeof(struct editorCold));
+    }
+
+    editorColdSweep(f);
+}
+
+/* Decompress every row, into the arena, and stop compressing them. */
+void editorColdThawAll(struct fileState *f)
+{
+    struct editorCold *c = f->cold;
+
+    if (c == NULL)
+        return;
+
+    /*
+     * Don't let decompressing one block compress another.
+     */
+    c->thawed = -c->count;
+
+    for (int b = 0; b < c->count; b++)
+    {
+        struct editorColdBlock *k = &c->block[b];
+        erow *row = &f->row[k->first];
+
+        if (k->text == NULL)
+            editorColdThaw(f, b);
+
+        for (int i = 0; i < k->count; i++)
+            if (row[i].arena)
+                row[i].chars = arena_strndup(&f->arena, row[i].chars, row[i].size);
+    }
+
+    editorColdFree(f);
+}
+
+/* Free the blocks of compressed rows, once the rows have been freed. */
+void editorColdFree(struct fileState *f)
+{
+    struct editorCold *c = f->cold;
+
+    if (c == NULL)
+        return;
+
+    for (int b = 0; b < c->count; b++)
+    {
+        free(c->block[b].data);
+        free(c->block[b].text);
+    }
+
+    free(c->block);
+    free(c);
+    f->cold = NULL;
+}
+
+
+
+/* ================================ Streams ================================ */
+
+/*
+ * Given `-` as a filename we read our standard input into the *stdin*
+ * buffer, as it arrives, and read keys from the terminal instead.
+ */
+
+/* Start reading our standard input into the given buffer. */
+void editorStreamOpen(struct fileState *f)
+{
+    if (E.stream.fd != -1)
+        return;
+
+    int tty = open("/dev/tty", O_RDWR);
+
+    if (tty == -1)
+    {
+        perror("Opening /dev/tty");
+        exit(1);
+    }
+
+    /*
+     * Keep hold of the input, and replace it with the terminal.
+     */
+    E.stream.fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+
+    E.stream.buffer = f->id;
+    E.stream.partial = 0;
+
+    /*
+     * The size was read from the pipe, which has none; ask the terminal.
+     */
+    getWindowSize();
+    editorResizeScreen(E.screenrows, E.screencols);
+}
+
+/* Read what is available from our standard input. */
+void editorStreamRead(void)
+{
+    static char buf[64 * 1024];
+    struct fileState *f = editorBufferById(E.stream.buffer);
+    ssize_t n = read(E.stream.fd, buf, sizeof(buf));
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    /*
+     * At the end of the input, or once the buffer is killed, we're done.
+     */
+    if (n <= 0 || f == NULL)
+    {
+        close(E.stream.fd);
+        E.stream.fd = -1;
+        return;
+    }
+
+    int old = f->numrows;
+    editorAppendText(f, buf, n, &E.stream.partial);
+    editorFollowWindows(f, old);
+}
+
+
+
+/* ======================= Lua Functions ======================= */
+
+
+/* Accessors */
+
+/* get the character that the current position */
+int at_lua(lua_State *L)
+{
+    char tmp[2] = {'\n', '\0'};
+    tmp[0] = at();
+    lua_pushstring(L, tmp);
+    return 1;
+}
+
+/* is the buffer dirty? */
+int dirty_lua(lua_State *L)
+{
+    if (dirty())
+        lua_pushboolean(L, 1);
+    else
+        lua_pushboolean(L, 0);
+
+    return 1;
+}
+/* return the contents of the line from the point-onwards */
+int get_line_lua(lua_State *L)
+{
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    if (row)
+    {
+        editorRowWarm(E.file[E.current_file], row);
+        lua_pushstring(L, row->chars + E.file[E.current_file]->cx);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Movement */
+/* move cursor one character down */
+int down_lua(lua_State *L)
+{
+    (void)L;
+    editorMoveCursor(ARROW_DOWN);
+    return 0;
+}
+
+/* move to end of line */
+int eol_lua(lua_State *L)
+{
+    (void)L;
+
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    /* The last byte of the line, which may be short, of a binary file. */
+    if (E.file[E.current_file]->hex)
+    {
+        E.file[E.current_file]->cx = KILO_HEX_WIDTH - 1;
+        editorHexMove(E.file[E.current_file], 0);
+    }
+
+    if (row)
+    {
+        /*
+         * Row width.
+         */
+        int size = row->size;
+        int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+
+        /* Multi-byte characters are passed in one step. */
+        while (x < size)
+        {
+            editorMoveCursor(ARROW_RIGHT);
+            x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+        }
+    }
+
+    return 0;
+}
+
+/* move the cursor one character left */
+int left_lua(lua_State *L)
+{
+    (void)L;
+    editorMoveCursor(ARROW_LEFT);
+    return 0;
+}
+
+/* page down */
+int page_down_lua(lua_State *L)
+{
+    (void)L;
+
+    int times = E.screenrows - 1;
+
+    while (times--)
+        down_lua(L);
+
+    return 0;
+}
+
+/* page up */
+int page_up_lua(lua_State *L)
+{
+    (void)L;
+    int times = E.screenrows - 1;
+
+    while (times--)
+        up_lua(L);
+
+    return 0;
+}
+
+/* move the cursor one character right */
+int right_lua(lua_State *L)
+{
+    (void)L;
+    editorMoveCursor(ARROW_RIGHT);
+    return 0;
+}
+
+/* Move to start of line */
+int sol_lua(lua_State *L)
+{
+    (void)L;
+
+    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+
+    /* Multi-byte characters are passed in one step. */
+    while (x > 0)
+    {
+        editorMoveCursor(ARROW_LEFT);
+        x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    }
+
+    return 0;
+}
+
+/* move cursor one character up */
+int up_lua(lua_State *L)
+{
+    (void)L;
+    editorMoveCursor(ARROW_UP);
+    return 0;
+}
+
+/* Selection */
+
+/* Delete the text between the point and the mark */
+int cut_selection_lua(lua_State *L)
+{
+    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+
+    /* There is no mark. */
+    if ((E.file[E.current_file]->markx == -1) && (E.file[E.current_file]->marky == -1))
+        return 0;
+
+    /* The cursor is at the mark. */
+    if ((E.file[E.current_file]->markx == x) && (E.file[E.current_file]->marky == y))
+        return 0;
+
+    int left = 0;
+
+    if ((y > E.file[E.current_file]->marky) || (x > E.file[E.current_file]->markx && y == E.file[E.current_file]->marky))
+        left = 1;
+
+    /* Get the selection text */
+    char *sel = get_selection();
+
+    /* Delete the number of characters that the selection includes. */
+    int max = (int)strlen(sel);
+
+    if (left == 0)
+    {
+        for (int i = 0; i < max ; i++)
+        {
+            editorMoveCursor(ARROW_RIGHT);
+            delete_lua(L);
+        }
+    }
+    else
+    {
+        /* we want to delete the character under the cursor too - so
+           we move one place right before we remove the characters. */
+        editorMoveCursor(ARROW_RIGHT);
+
+        for (int i = 0; i < max ; i++)
+            delete_lua(L);
+    }
+
+    /* Cleanup & remove the mark. */
+    free(sel);
+    E.file[E.current_file]->markx = -1;
+    E.file[E.current_file]->marky = -1;
+    return 0;
+}
+
+/* Get the text between the point and the mark */
+int selection_lua(lua_State *L)
+{
+    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+
+    /*
+     * No selection - either because the mark is not set, and
+     * the cursor is in the mark.
+     */
+    if ((E.file[E.current_file]->markx == -1) && (E.file[E.current_file]->marky == -1))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if ((E.file[E.current_file]->markx == x) && (E.file[E.current_file]->marky == y))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    char *t = get_selection();
+    lua_pushstring(L, t);
+    free(t);
+    return 1;
+
+}
+
+
+/* Removals */
+
+/* Delete the char at the current position. */
+int delete_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.file[E.current_file]->hex)
+    {
+        editorSetStatusMessage(1, "Bytes of a binary file may only be overwritten");
+        return 0;
+    }
+
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    if (!row || (filecol == 0 && filerow == 0))
+        return 0;
+
+
+    if (filecol == 0)
+    {
+#ifdef _UNDO
+        int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+        int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+        add_undo(E.file[E.current_file]->undo, INSERT, '\n', x, y);
+#endif
+
+        /* Handle the case of column 0, we need to move the current line
+         * on the right of the previous one. */
+        filecol = E.file[E.current_file]->row[filerow - 1].size;
+        editorRowWarm(E.file[E.current_file], row);
+        editorRowAppendString(E.file[E.current_file], &E.file[E.current_file]->row[filerow - 1], row->chars, row->size);
+        editorDelRow(E.file[E.current_file], filerow);
+        row = NULL;
+
+        if (E.file[E.current_file]->cy == 0)
+            E.file[E.current_file]->rowoff--;
+        else
+            E.file[E.current_file]->cy--;
+
+        E.file[E.current_file]->cx = filecol;
+
+        if (E.file[E.current_file]->cx >= E.screencols)
+        {
+            int shift = (E.screencols - E.file[E.current_file]->cx) + 1;
+            E.file[E.current_file]->cx -= shift;
+            E.file[E.current_file]->coloff += shift;
+        }
+    }
+    else
+    {
+        /* Delete the whole of a multi-byte character. */
+        int prev = editorRowPrev(E.file[E.current_file], row, filecol);
+
+        while (filecol > prev)
+        {
+            editorRowDelChar(E.file[E.current_file], row, --filecol);
+
+            if (E.file[E.current_file]->cx == 0 && E.file[E.current_file]->coloff)
+                E.file[E.current_file]->coloff--;
+            else
+                E.file[E.current_file]->cx--;
+        }
+    }
+
+    /*
+     * BUGFIX: Ensure we don't walk off the screen, and draw gibberish.
+     *
+     * This seems to happen when `shift` becomes negative above.
+     */
+    if (E.file[E.current_file]->coloff < 0)
+        E.file[E.current_file]->coloff = 0;
+
+    if (E.file[E.current_file]->rowoff < 0)
+        E.file[E.current_file]->rowoff = 0;
+
+    E.file[E.current_file]->dirty++;
+    return 0;
+}
+
+/* Remove the current line. */
+int kill_line_lua(lua_State *L)
+{
+    (void)L;
+
+    /* move to end of line. */
+    eol_lua(L);
+
+    /* number of deletes we need. */
+    int len = 0;
+
+    /* count the characters */
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    if (row)
+        len = row->size;
+
+    while (len > 0)
+    {
+        delete_lua(L);
+        len -= 1;
+    }
+
+    /*
+     * Remove the line itself.
+     */
+    right_lua(L);
+    delete_lua(L);
+
+    return 0;
+}
+
+/* read a single key */
+int key_lua(lua_State *L)
+{
+    char buf[2] = { '\0', '\0' };
+    buf[0] = editorReadKey(E.infd);
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+/* insert a string. */
+int insert_lua(lua_State *L)
+{
+    const char *str = lua_tostring(L, -1);
+
+    if (str != NULL)
+    {
+        size_t len = strlen(str);
+
+        for (unsigned int i = 0; i < len; i++)
+        {
+            editorInsertChar(str[i]);
+#ifdef _UNDO
+            /*
+             * Add the undo-record.
+             */
+            int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+            int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+            add_undo(E.file[E.current_file]->undo, DELETE, ' ', x, y);
+#endif
+        }
+    }
+
+    return 0;
+}
+
+
+/* Macros */
+
+/* Start recording a keyboard macro. */
+int macro_record_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.macro.playing)
+        return 0;
+
+    E.macro.len = 0;
+    E.macro.seq_start = 0;
+    E.macro.recording = 1;
+    editorSetStatusMessage(1, "Defining keyboard macro...");
+    return 0;
+}
+
+/* Stop recording the keyboard macro. */
+int macro_stop_lua(lua_State *L)
+{
+    (void)L;
+
+    if (!E.macro.recording)
+        return 0;
+
+    /*
+     * Forget the key-sequence which invoked us.
+     */
+    E.macro.len = E.macro.seq_start;
+    E.macro.recording = 0;
+    editorSetStatusMessage(1, "Keyboard macro defined (%d keys)", E.macro.len);
+    return 0;
+}
+
+/* Replay the keyboard macro, optionally N times.
+ *
+ * The screen isn't updated until we're done, and the changes made
+ * are undone as a single group.  Each key is still dispatched by
+ * on_key(), as the commands it resolves to are known only to Lua. */
+int macro_replay_lua(lua_State *L)
+{
+    int times = 1;
+
+    if (lua_isnumber(L, -1))
+        times = lua_tonumber(L, -1);
+
+    /* We don't want to replay ourselves. */
+    if (E.macro.playing || E.macro.recording)
+        return 0;
+
+    if (E.macro.len == 0)
+    {
+        editorSetStatusMessage(1, "No keyboard macro defined");
+        return 0;
+    }
+
+#ifdef _UNDO
+
+    for (int i = 0; i < E.max_files; i++)
+        us_begin_group(E.file[i]->undo);
+
+#endif
+
+    E.macro.playing = 1;
+
+    for (int i = 0; i < times; i++)
+    {
+        E.macro.pos = 0;
+
+        while (E.macro.pos < E.macro.len)
+            editorProcessKeypress(E.infd);
+    }
+
+    E.macro.playing = 0;
+
+#ifdef _UNDO
+
+    for (int i = 0; i < E.max_files; i++)
+        us_end_group(E.file[i]->undo);
+
+#endif
+
+    return 0;
+}
+
+
+/* Markers */
+
+/* Get/Set X,Y position of the mark. */
+int mark_lua(lua_State *L)
+{
+    if (lua_isnumber(L, -2) &&
+            lua_isnumber(L, -1))
+    {
+        int y = lua_tonumber(L, -1);
+        int x = lua_tonumber(L, -2);
+
+        if ((x >= 0 || x == -1) &&
+                (y >= 0 || y == -1))
+        {
+            E.file[E.current_file]->markx = x ;
+            E.file[E.current_file]->marky = y ;
+        }
+
+    }
+
+    lua_pushnumber(L, E.file[E.current_file]->markx);
+    lua_pushnumber(L, E.file[E.current_file]->marky);
+    return 2;
+}
+
+/* Get/Set X,Y position of the cursor. */
+int point_lua(lua_State *L)
+{
+    if (lua_isnumber(L, -2) &&
+            lua_isnumber(L, -1))
+    {
+        int y = lua_tonumber(L, -1) - 1;
+        int x = lua_tonumber(L, -2) - 1;
+
+        warp(x, y);
+    }
+
+    lua_pushnumber(L, E.file[E.current_file]->cx + E.file[E.current_file]->coloff);
+    lua_pushnumber(L, E.file[E.current_file]->cy + E.file[E.current_file]->rowoff);
+    return 2;
+}
+
+
+/* Core */
+
+/* prompt for a string, and evaluate that as lua. */
+int eval_lua(lua_State *L)
+{
+    (void)L;
+
+    char *txt = get_input("Eval: ");
+
+    if (txt)
+    {
+        int res =  luaL_loadstring(lua, txt);
+
+        if (res == 0)
+        {
+            res = lua_pcall(lua, 0, LUA_MULTRET, 0);
+        }
+        else
+        {
+            const char *er = lua_tostring(lua, -1);
+
+            if (er)
+                editorSetStatusMessage(1, er);
+        }
+
+        free(txt);
+    }
+
+    return 0;
+}
+
+/* exit the editor */
+int exit_lua(lua_State *L)
+{
+    (void)L;
+    exit(0);
+    return 0;
+}
+
+/* Switch to find-mode */
+int find_lua(lua_State *L)
+{
+    (void)L;
+    char query[KILO_QUERY_LEN + 1] = {0};
+    int qlen = 0;
+    int last_match = -1; /* Last line where a match was found. -1 for none. */
+    int find_next = 0; /* if 1 search next, if -1 search prev. */
+
+#define FIND_RESTORE_HL do { \
+    if (E.file[E.current_file]->matchlen) { \
+        E.file[E.current_file]->matchlen = 0; \
+        E.file[E.current_file]->version++; \
+    } \
+} while (0)
+
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
+    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+
+    while (1)
+    {
+        editorSetStatusMessage(1,
+                               "Search: %s (Use ESC/Arrows/Enter)", query);
+        editorRefreshScreen();
+
+        int c = editorReadKey(E.infd);
+
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE)
+        {
+            if (qlen != 0) query[--qlen] = '\0';
+
+            last_match = -1;
+        }
+        else if (c == ESC || c == ENTER)
+        {
+            if (c == ESC)
+            {
+                E.file[E.current_file]->cx = saved_cx;
+                E.file[E.current_file]->cy = saved_cy;
+                E.file[E.current_file]->coloff = saved_coloff;
+                E.file[E.current_file]->rowoff = saved_rowoff;
+            }
+
+            FIND_RESTORE_HL;
+            editorSetStatusMessage(0, "");
+            return 0;
+        }
+        else if (c == ARROW_RIGHT || c == ARROW_DOWN)
+        {
+            find_next = 1;
+        }
+        else if (c == ARROW_LEFT || c == ARROW_UP)
+        {
+            find_next = -1;
+        }
+        else if (isprint(c))
+        {
+            if (qlen < KILO_QUERY_LEN)
+            {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+                last_match = -1;
+            }
+        }
+
+        /* Search occurrence. */
+        if (last_match == -1) find_next = 1;
+
+        if (find_next)
+        {
+            char *match = NULL;
+            int match_offset = 0;
+            int i, current = last_match;
+
+            for (i = 0; i < E.file[E.current_file]->numrows; i++)
+            {
+                current += find_next;
+
+                if (current == -1)
+                    current = E.file[E.current_file]->numrows - 1;
+                else if (current == E.file[E.current_file]->numrows)
+                    current = 0;
+
+                editorRowWarm(E.file[E.current_file], &E.file[E.current_file]->row[current]);
+                match = strstr(E.file[E.current_file]->row[current].chars, query);
+
+                if (match)
+                {
+                    match_offset = match - E.file[E.current_file]->row[current].chars;
+                    break;
+                }
+            }
+
+            find_next = 0;
+
+            /* Highlight */
+            FIND_RESTORE_HL;
+
+            if (match)
+            {
+                last_match = current;
+
+                /* The match is drawn over the row's own highlighting. */
+                E.file[E.current_file]->matchx = match_offset;
+                E.file[E.current_file]->matchy = current;
+                E.file[E.current_file]->matchlen = qlen;
+                E.file[E.current_file]->version++;
+
+                /*
+                 * NOTE: This breaks our undo, by warping to a new
+                 * position that isn't tracked by our stack.
+                 */
+                E.file[E.current_file]->cy = 0;
+                E.file[E.current_file]->cx = match_offset;
+                E.file[E.current_file]->rowoff = current;
+                E.file[E.current_file]->coloff = 0;
+
+                /* Scroll horizontally as needed. */
+                if (E.file[E.current_file]->cx > E.screencols)
+                {
+                    int diff = E.file[E.current_file]->cx - E.screencols;
+                    E.file[E.current_file]->cx -= diff;
+                    E.file[E.current_file]->coloff += diff;
+                }
+            }
+        }
+    }
+}
+
+
+/* Reload the current buffer from its file, if it has changed. */
+int reload_lua(lua_State *L)
+{
+    (void)L;
+    editorReload(E.file[E.current_file]);
+    return 0;
+}
+
+/* Get/Set whether the current buffer follows its file as it grows. */
+int follow_lua(lua_State *L)
+{
+    struct fileState *f = E.file[E.current_file];
+
+    if (lua_gettop(L) > 0)
+    {
+        if (lua_toboolean(L, 1) && !(lua_isnumber(L, 1) && lua_tonumber(L, 1) == 0))
+        {
+            if (!editorFollowStart(f))
+                editorSetStatusMessage(1, "Can't follow %s", f->filename ? f->filename : "a buffer without a file");
+        }
+        else
+            editorFollowStop(f);
+    }
+
+    lua_pushboolean(L, f->follow != NULL);
+    return 1;
+}
+
+/* Get/Set whether the lines of the current buffer end in CRLF. */
+int crlf_lua(lua_State *L)
+{
+    struct fileState *f = E.file[E.current_file];
+
+    if (lua_gettop(L) > 0)
+    {
+        int crlf = lua_toboolean(L, 1) && !(lua_isnumber(L, 1) && lua_tonumber(L, 1) == 0);
+
+        if (crlf != f->crlf)
+        {
+            f->crlf = crlf;
+            f->dirty++;
+        }
+    }
+
+    lua_pushboolean(L, f->crlf);
+    return 1;
+}
+
+/* Return a table describing what we found when loading the current
+ * buffer's file. */
+int file_info_lua(lua_State *L)
+{
+    struct editorScan *s = &E.file[E.current_file]->scan;
+
+    lua_newtable(L);
+
+    lua_pushnumber(L, s->lf - s->crlf);
+    lua_setfield(L, -2, "lf");
+    lua_pushnumber(L, s->crlf);
+    lua_setfield(L, -2, "crlf");
+    lua_pushnumber(L, s->nul);
+    lua_setfield(L, -2, "nul");
+    lua_pushnumber(L, s->invalid);
+    lua_setfield(L, -2, "invalid");
+    lua_pushboolean(L, s->invalid == 0);
+    lua_setfield(L, -2, "utf8");
+    lua_pushboolean(L, editorScanBinary(s));
+    lua_setfield(L, -2, "binary");
+    return 1;
+}
+
+/* Get/Set the compression level used when saving gzipped files. */
+int gzip_level_lua(lua_State *L)
+{
+#ifdef _GZIP
+    if (lua_isnumber(L, -1))
+    {
+        int level = lua_tonumber(L, -1);
+
+        if (level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION)
+            E.gzip_level = level;
+    }
+
+    lua_pushnumber(L, E.gzip_level);
+    return 1;
+#else
+    (void)L;
+    editorSetStatusMessage(1, "gzip-support is not compiled in");
+    return 0;
+#endif
+}
+
+/* Move the cursor to the start of the given line. */
+int goto_line_lua(lua_State *L)
+{
+    struct fileState *f = E.file[E.current_file];
+    double want = luaL_checknumber(L, 1) - 1;
+    int64_t line = want < 0 ? 0 : (want > 1e18 ? (int64_t)1e18 : (int64_t)want);
+
+    f->cx = f->coloff = 0;
+
+    if (f->pager)
+    {
+        editorPagerShow(f, line);
+        return 0;
+    }
+
+    /* The lines of a binary file are those we show. */
+    int64_t rows = f->hex ? (f->hex->size + KILO_HEX_WIDTH - 1) / KILO_HEX_WIDTH : f->numrows;
+
+    if (line >= rows)
+        line = rows > 0 ? rows - 1 : 0;
+
+    /*
+     * Show the line in the middle of the screen, if it isn't on it.
+     */
+    if (line < f->rowoff || line >= f->rowoff + E.screenrows)
+    {
+        f->rowoff = line > E.screenrows / 2 ? line - E.screenrows / 2 : 0;
+        f->wrapoff = 0;
+    }
+
+    f->cy = line - f->rowoff;
+    return 0;
+}
+
+/* Get/Set whether the current buffer shows its file as hex. */
+int hex_lua(lua_State *L)
+{
+    struct fileState *f = E.file[E.current_file];
+
+    if (lua_gettop(L) > 0)
+    {
+        int hex = lua_toboolean(L, 1) && !(lua_isnumber(L, 1) && lua_tonumber(L, 1) == 0);
+
+        if (hex != (f->hex != NULL))
+        {
+            if (f->filename == NULL)
+                editorSetStatusMessage(1, "No filename is set!");
+            else if (editorBufferDirty(f))
+                editorSetStatusMessage(1, "Save or reload %s first", f->filename);
+            else
+            {
+                /* Opening the file replaces the buffer's name. */
+                char *path = strdup(f->filename);
+                editorOpenAs(path, hex);
+                free(path);
+            }
+        }
+    }
+
+    lua_pushboolean(L, f->hex != NULL);
+    return 1;
+}
+
+/* Get/Set whether long lines are wrapped, rather than scrolled. */
+int wrap_lua(lua_State *L)
+{
+    if (lua_gettop(L) > 0)
+    {
+        int wrap = lua_toboolean(L, 1) && !(lua_isnumber(L, 1) && lua_tonumber(L, 1) == 0);
+
+        if (wrap != E.wrap)
+        {
+            struct fileState *f = E.file[E.current_file];
+
+            E.wrap = wrap;
+            E.redraw = 1;
+
+            /*
+             * Scroll the current buffer back to the start of its rows,
+             * and the cursor back into the window.
+             */
+            f->cx += f->coloff;
+            f->coloff = 0;
+            f->wrapoff = 0;
+
+            if (f->cx > E.screencols - 1)
+            {
+                f->coloff = f->cx - E.screencols + 1;
+                f->cx = E.screencols - 1;
+            }
+        }
+    }
+
+    lua_pushboolean(L, E.wrap);
+    return 1;
+}
+
+/* Get/Set whether identical lines loaded into a buffer share their text. */
+int intern_lua(lua_State *L)
+{
+    if (lua_gettop(L) > 0)
+    {
+        E.intern = lua_toboolean(L, 1) && !(lua_isnumber(L, 1) && lua_tonumber(L, 1) == 0);
+        E.file[E.current_file]->arena.intern = E.intern;
+    }
+
+    lua_pushboolean(L, E.intern);
+    return 1;
+}
+
+/* Get/Set the size above which buffers compress their cold rows. */
+int compress_rows_lua(lua_State *L)
+{
+    if (lua_isnumber(L, -1))
+        E.compress_rows = lua_tonumber(L, -1);
+
+    lua_pushnumber(L, E.compress_rows);
+    return 1;
+}
+
+/* Get/Set the size at which files are paged, rather than loaded. */
+int large_file_lua(lua_State *L)
+{
+    if (lua_isnumber(L, -1))
+        E.large_file = lua_tonumber(L, -1);
+
+    lua_pushnumber(L, E.large_file);
+    return 1;
+}
+
+/* Return a table describing our memory usage. */
+int memory_stats_lua(lua_State *L)
+{
+    long rows = 0, text = 0, render = 0, arena = 0, compressed = 0, rss = 0;
+
+    for (int i = 0; i < E.max_files; i++)
+    {
+        struct fileState *f = E.file[i];
+        rows += f->numrows;
+        arena += f->arena.bytes + f->arena.slots * sizeof(char *);
+
+        if (f->cold)
+            compressed += f->cold->bytes;
+
+        for (int j = 0; j < f->numrows; j++)
+        {
+            text += f->row[j].size;
+
+            if (f->row[j].cols)
+                render += sizeof(colstop) * (f->row[j].cols[0].at + 1);
+
+            render += sizeof(hlspan) * f->row[j].nhl;
+        }
+    }
+
+    /*
+     * The second field of statm is the resident set, in pages.
+     */
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp)
+    {
+        long size;
+
+        if (fscanf(fp, "%ld %ld", &size, &rss) == 2)
+            rss *= sysconf(_SC_PAGESIZE);
+        else
+            rss = 0;
+
+        fclose(fp);
+    }
+
+    lua_newtable(L);
+
+    lua_pushnumber(L, E.max_files);
+    lua_setfield(L, -2, "buffers");
+    lua_pushnumber(L, rows);
+    lua_setfield(L, -2, "rows");
+    lua_pushnumber(L, text);
+    lua_setfield(L, -2, "text");
+    lua_pushnumber(L, render);
+    lua_setfield(L, -2, "render");
+    lua_pushnumber(L, arena);
+    lua_setfield(L, -2, "arena");
+    lua_pushnumber(L, compressed);
+    lua_setfield(L, -2, "compressed");
+    lua_pushnumber(L, rss);
+    lua_setfield(L, -2, "rss");
+
+    return 1;
+}
+
+/* Prompt for a filename and open it. */
+int open_lua(lua_State *L)
+{
+    (void)L;
+    /*
+     * If we got a string then open it as a filename.
+     */
+    char *path = (char *)lua_tostring(L, -1);
+
+    if (path != NULL)
+    {
+        editorOpen(path);
+        return 0;
+    }
+
+    /*
+     * Prompt for a path.
+     */
+    path = get_input("Open: ");
+
+    if (path)
+    {
+        editorOpen(path);
+        free(path);
+    }
+
+    return 0;
+}
+
+/* prompt for input */
+int prompt_lua(lua_State *L)
+{
+    char *prompt = (char *)lua_tostring(L, -1);
+    char *buf = get_input(prompt);
+
+    if (buf)
+    {
+        lua_pushstring(lua, buf);
+        free(buf);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Save the current file on disk. Return 0 on success, 1 on error. */
+int save_lua(lua_State *L)
+{
+
+    /*
+     * If we were given a filename then use that.
+     */
+    char *path = (char *)lua_tostring(L, -1);
+
+    if (path != NULL)
+    {
+        /*
+         * Saved under another name, whether it's compressed is decided
+         * by that name, rather than by the file we loaded.
+         */
+        if (E.file[E.current_file]->filename == NULL ||
+                strcmp(path, E.file[E.current_file]->filename) != 0)
+            E.file[E.current_file]->gzip = 0;
+
+        editorSetBufferName(E.file[E.current_file], path);
+    }
+
+    /*
+     * If we don't have a filename we can't save
+     */
+    if (E.file[E.current_file]->filename == NULL)
+    {
+        editorSetStatusMessage(1, "No filename is set!");
+        return 0;
+    }
+
+    if (E.file[E.current_file]->pager)
+        return editorPagerSave(E.file[E.current_file]);
+
+    if (E.file[E.current_file]->hex)
+        return editorHexSave(E.file[E.current_file]);
+
+#ifdef _GZIP
+    /*
+     * Compressed files, and new files named as if they were, are written
+     * compressed.
+     */
+    int namelen = strlen(E.file[E.current_file]->filename);
+
+    if (E.file[E.current_file]->gzip ||
+            (namelen > 3 && strcmp(E.file[E.current_file]->filename + namelen - 3, ".gz") == 0))
+        return editorGzipSave(E.file[E.current_file]);
+
+#endif
+
+    int len;
+    char *buf = editorRowsToString(E.file[E.current_file], &len);
+    int fd = open(E.file[E.current_file]->filename, O_RDWR | O_CREAT, 0644);
+
+    if (fd == -1) goto writeerr;
+
+    /* Use truncate + a single write(2) call in order to make saving
+     * a bit safer, under the limits of what we can do in a small editor. */
+    if (ftruncate(fd, len) == -1) goto writeerr;
+
+    if (write(fd, buf, len) != len) goto writeerr;
+
+    close(fd);
+    free(buf);
+    E.file[E.current_file]->dirty = 0;
+    editorDiskRecord(E.file[E.current_file]);
+
+    editorSetStatusMessage(1, "%d bytes written to %s", len, E.file[E.current_file]->filename);
+
+    /* invoke our lua callback function */
+    call_lua("on_saved", E.file[E.current_file]->filename);
+
+#ifdef _UNDO
+    /* since we've saved - kill our undo stack */
+    us_clear(E.file[E.current_file]->undo);
+#endif
+
+    return 0;
+
+writeerr:
+    free(buf);
+
+    if (fd != -1) close(fd);
+
+    editorSetStatusMessage(1, "Can't save! I/O error: %s", strerror(errno));
+    return 1;
+}
+
+
+/* Search for the given string */
+int search_lua(lua_State *L)
+{
+    /*
+     * Get the search pattern.
+     */
+    char *term = (char *)lua_tostring(L, -1);
+
+    if (term == NULL)
+    {
+        editorSetStatusMessage(1, "No search term given!");
+        return 0;
+    }
+
+#ifdef _REGEXP
+    regex_t regex;
+
+    if (regcomp(&regex, term, REG_EXTENDED) != 0)
+    {
+        editorSetStatusMessage(1, "Failed to compile regular expression!");
+        return 0;
+    };
+
+#endif
+
+
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
+
+    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+
+    /*
+     * Move forward one character - to ensure that we
+     * are able to find the next match, not keep on the first
+     * one.
+     */
+    right_lua(L);
+
+    /*
+     * Current line;
+     */
+    int current = E.file[E.current_file]->cy + E.file[E.current_file]->rowoff;
+
+    /*
+     * Now for each line ..
+     */
+    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+    {
+        editorRowWarm(E.file[E.current_file], &E.file[E.current_file]->row[current]);
+
+        /*
+         * For each character in the current row .. do we match?
+         */
+        for (int x = E.file[E.current_file]->cx + E.file[E.current_file]->coloff; x < E.file[E.current_file]->row[current].size; x++)
+        {
+            int match     = 0;
+            int match_len = 0;
+
+#ifdef _REGEXP
+            regmatch_t result[1];
+
+            if (regexec(&regex, E.file[E.current_file]->row[current].chars + x, 1, result, 0) == 0)
+            {
+                match = 1;
+                match_len = (result[0]).rm_eo - (result[0]).rm_so;
+
+                /*
+                 * Start of the match.
+                 */
+                x += (result[0]).rm_so;
+            }
+
+#else
+
+            if (strncmp(E.file[E.current_file]->row[current].chars + x, term, strlen(term)) == 0)
+            {
+                match = 1;
+                match_len = strlen(term);
+            }
+
+#endif
+
+            if (match)
+            {
+                /*
+                 * The column in which we matched.
+                 */
+                E.file[E.current_file]->cx = x;
+                E.file[E.current_file]->coloff = 0;
+
+                /* The matching row will be at the top of the screen. */
+                E.file[E.current_file]->cy = 0;
+                E.file[E.current_file]->rowoff = current;
+
+                /* Scroll horizontally as needed. */
+                if (E.file[E.current_file]->cx > E.screencols)
+                {
+                    int diff = abs(E.file[E.current_file]->cx - E.screencols);
+                    E.file[E.current_file]->cx -= diff;
+                    E.file[E.current_file]->coloff += diff;
+                }
+
+                /* Return the length of the match */
+                lua_pushnumber(L, match_len);
+                return 1;
+            }
+        }
+
+        /*
+         * Current line.
+         */
+        current += 1;
+
+        /*
+         * Wrap around the end/start of the file.
+         */
+        if (current == E.file[E.current_file]->numrows)
+            current = 0;
+
+        /*
+         * We've moved forward a row, so we can now start at the
+         * beginning of the row.
+         */
+        E.file[E.current_file]->cx = 0;
+        E.file[E.current_file]->coloff = 0;
+    }
+
+    /*
+     * If we didn't find a match we need to restore the
+     * position to where where we were before.
+     */
+    editorSetStatusMessage(1, "No match found");
+    E.file[E.current_file]->cx = saved_cx;
+    E.file[E.current_file]->cy = saved_cy;
+    E.file[E.current_file]->coloff = saved_coloff;
+    E.file[E.current_file]->rowoff = saved_rowoff;
+    lua_pushnumber(L, 0);
+    return 1;
+}
+
+/* Return a table of timing statistics for recent frames. */
+int stats_lua(lua_State *L)
+{
+#ifdef _STATS
+    lua_newtable(L);
+
+    lua_pushnumber(L, E.stats.frames);
+    lua_setfield(L, -2, "frames");
+
+    lua_pushnumber(L, E.stats.count);
+    lua_setfield(L, -2, "window");
+
+    for (int i = 0; i < STAT_MAX; i++)
+    {
+        double p50, p99, max, mean;
+
+        /* Times are reported in milliseconds, sizes in bytes. */
+        double scale = (i == STAT_BYTES) ? 1 : 1000.0;
+
+        stats_summary(&E.stats, i, &p50, &p99, &max, &mean);
+
+        lua_newtable(L);
+
+        lua_pushnumber(L, p50 / scale);
+        lua_setfield(L, -2, "p50");
+        lua_pushnumber(L, p99 / scale);
+        lua_setfield(L, -2, "p99");
+        lua_pushnumber(L, max / scale);
+        lua_setfield(L, -2, "max");
+        lua_pushnumber(L, mean / scale);
+        lua_setfield(L, -2, "mean");
+
+        /* The histogram buckets are powers of two, of microseconds/bytes. */
+        lua_newtable(L);
+
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            lua_pushnumber(L, E.stats.series[i].hist[b]);
+            lua_rawseti(L, -2, b + 1);
+        }
+
+        lua_setfield(L, -2, "hist");
+        lua_setfield(L, -2, stat_names[i]);
+    }
+
+    return 1;
+#else
+    (void)L;
+    editorSetStatusMessage(1, "statistics-support is not compiled in");
+    return 0;
+#endif
+}
+
+/* set the status-bar text */
+int status_lua(lua_State *L)
+{
+    const char *str = lua_tostring(L, -1);
+    editorSetStatusMessage(1, str);
+    editorRefreshScreen();
+    return 0;
+}
+
+/* Undo the most recent change, or group of changes. */
+int undo_lua(lua_State *L)
+{
+    (void)L;
+#ifdef _UNDO
+    UndoStack *undo = E.file[E.current_file]->undo;
+    UndoAction *action = us_pop(undo);
+
+    if (action == NULL)
+    {
+        editorSetStatusMessage(1, "Undo stack is empty!");
+        return 0;
+    }
+
+    int group = action->group;
+
+    while (action != NULL)
+    {
+        if (action->type == DELETE)
+        {
+            warp(action->x, action->y);
+            delete_lua(L);
+        }
+        else if (action->type == INSERT)
+        {
+            warp(action->x, action->y);
+
+            char str[2] = { '\0', '\0' };
+            str[0] = action->data;
+            lua_pushstring(L, str);
+            insert_lua(L);
+            lua_pop(L, 1);
+        }
+
+        /*
+         * Performing the action to undo the user's previous
+         * thing will add a new action to the undo-stack.
+         *
+         * So we need to explicitly remove that faux addition here.
+         */
+        free(us_pop(undo));
+        free(action);
+
+        /*
+         * If that was part of a group, keep going until we've undone
+         * the whole thing.
+         */
+        action = us_peek(undo);
+
+        if (group != 0 && action != NULL && action->group == group)
+            action = us_pop(undo);
+        else
+            action = NULL;
+    }
+
+#else
+    editorSetStatusMessage(1, "undo-support is not compiled in");
+#endif
+    return 0;
+}
+
+
+
+/* Syntax highlighting */
+
+/* Set comment handling. */
+int set_syntax_comments_lua(lua_State *L)
+{
+    char *single = (char *)lua_tostring(L, -3);
+    char *multi_open = (char *)lua_tostring(L, -2);
+    char *multi_end = (char *)lua_tostring(L, -1);
+
+    if ((single == NULL) ||
+            (multi_open == NULL) ||
+            (multi_end == NULL))
+        return 0;
+
+    /*
+     * If we don't have syntax that's a bug.
+     */
+    if (E.file[E.current_file]->syntax == NULL)
+        return 0;
+
+    strcpy(E.file[E.current_file]->syntax->singleline_comment_start, single);
+    strcpy(E.file[E.current_file]->syntax->multiline_comment_start, multi_open);
+    strcpy(E.file[E.current_file]->syntax->multiline_comment_end, multi_end);
+
+    /*
+     * Force re-render.
+     */
+    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+        editorUpdateRow(E.file[E.current_file], E.file[E.current_file]->row + i);
+
+    return 0;
+}
+
+/* set the syntax keywords. */
+int set_syntax_keywords_lua(lua_State *L)
+{
+    if (! lua_istable(L, 1))
+        return 0;
+
+    if (E.file[E.current_file]->syntax == NULL)
+    {
+        struct editorSyntax *s = (struct editorSyntax*)malloc(sizeof(struct editorSyntax));
+        s->keywords                    = NULL;
+        s->singleline_comment_start[0] = '\0';
+        s->multiline_comment_start[0]  = '\0';
+        s->multiline_comment_end[0]    = '\0';
+        s->flags                       =  HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS;
+#ifdef _REGEXP
+        s->regex                       = NULL;
+        s->compiled                    = NULL;
+#endif
+        E.file[E.current_file]->syntax = s;
+    }
+
+    size_t len = lua_rawlen(L, 1);
+    editorSyntaxFreeRegex(E.file[E.current_file]->syntax);
+    editorFreeKeywords(E.file[E.current_file]->syntax->keywords);
+    E.file[E.current_file]->syntax->keywords = malloc((1 + len) * sizeof(char*));
+
+    int i = 0;
+    lua_pushnil(L);
+
+    while (lua_next(L, -2) != 0)
+    {
+        const char *str = lua_tostring(L, -1);
+        E.file[E.current_file]->syntax->keywords[i] = strdup(str);
+        lua_pop(L, 1);
+        i += 1;
+    }
+
+    E.file[E.current_file]->syntax->keywords[i] = NULL;
+
+    /*
+     * Force re-render.
+     */
+    for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+        editorUpdateRow(E.file[E.current_file], E.file[E.current_file]->row + i);
+
+    return 0;
+}
+
+/* Enable highlighting of numbers. */
+int syntax_highlight_numbers_lua(lua_State *L)
+{
+    int cond = lua_tonumber(L, -1);
+
+    if (E.file[E.current_file]->syntax)
+    {
+        if (cond == 1)
+            E.file[E.current_file]->syntax->flags |= HL_HIGHLIGHT_NUMBERS;
+        else
+            E.file[E.current_file]->syntax->flags &= ~HL_HIGHLIGHT_NUMBERS;
+
+        /*
+         * Force re-render.
+         */
+        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+            editorUpdateRow(E.file[E.current_file], E.file[E.current_file]->row + i);
+    }
+
+    return 0;
+}
+
+/* Enable highlighting of strings. */
+int syntax_highlight_strings_lua(lua_State *L)
+{
+    int cond = lua_tonumber(L, -1);
+
+    if (E.file[E.current_file]->syntax)
+    {
+        if (cond == 1)
+            E.file[E.current_file]->syntax->flags |= HL_HIGHLIGHT_STRINGS;
+        else
+            E.file[E.current_file]->syntax->flags &= ~HL_HIGHLIGHT_STRINGS;
+
+        /*
+         * Force re-render.
+         */
+        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+            editorUpdateRow(E.file[E.current_file], E.file[E.current_file]->row + i);
+    }
+
+    return 0;
+}
+
+/* Get/Set tabsize. */
+int tabsize_lua(lua_State *L)
+{
+    if (lua_isnumber(L, -1))
+    {
+        int width = lua_tonumber(L, -1);
+        E.file[E.current_file]->tab_size = width;
+
+        /*
+         * Force a re-render
+         */
+        for (int i = 0; i < E.file[E.current_file]->numrows; i++)
+            editorUpdateRow(E.file[E.current_file], E.file[E.current_file]->row + i);
+
+    }
+
+    lua_pushnumber(L, E.file[E.current_file]->tab_size);
+    return 1;
+}
+
+
+/* Buffers */
+
+/* Choose a buffer, interatively */
+int choose_buffer_lua(lua_State *L)
+{
+    (void)L;
+
+    int offset = 0;
+
+    while (1)
+    {
+        struct abuf ab = ABUF_INIT;
+        abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
+        abAppend(&ab, "\x1b[H", 3); /* Go home. */
+
+        /*
+         * Draw the list of buffers.
+         */
+        for (int i = 0; i < E.max_files ; i ++)
+        {
+            int selected = (i == offset);
+
+            char *filename = E.file[i]->filename;
+            int dirty = 0;
+
+            if (E.file[i]->dirty != 0)
+                dirty = 1;
+
+            if (filename && filename[0] == '*')
+                dirty = 0;
+
+            if (selected)
+            {
+                abAppend(&ab, "\x1b[47m", 5);
+            }
+            else
+            {
+                abAppend(&ab, "\x1b[49m", 5);
+            }
+
+            char line[255];
+            snprintf(line, sizeof(line) - 1, "%d - %s%s", i + 1,
+                     filename == NULL ? "UNSET" : filename,
+                     dirty ? " (modified)" : "");
+
+            while ((int)strlen(line) < E.termcols)
+            {
+                strcat(line, " ");
+            }
+
+            strcat(line, "\r\n");
+            abAppend(&ab, line, strlen(line));
+        }
+
+        /*
+         * Reset the inverse selection.
+         */
+        abAppend(&ab, "\x1b[49m", 5);
+
+        /*
+         * Pad to the bottom of the screen in empty lines.
+         */
+        for (int i = E.max_files ; i < E.termrows - 2; i++)
+        {
+            abAppend(&ab, "\x1b[2K~\r\n", 7);
+        }
+
+        abAppend(&ab, "\x1b[D0", 3); /* clear screen */
+
+        if (!E.headless)
+            write(E.outfd, ab.b, ab.len);
+
+        abFree(&ab);
+
+        /*
+         * Get a keypress
+         */
+        int c = editorReadKey(E.infd);
+
+        /* We've drawn over our windows. */
+        if (c == ENTER || c == ESC)
+            E.redraw = 1;
+
+        if (c == ENTER)
+        {
+            /* Select the buffer.*/
+            E.current_file = offset;
+            return 0;
+        }
+
+        if (c == ESC)
+        {
+            /* Cancel */
+            return 0;
+        }
+
+        if (c == ARROW_UP)
+        {
+            if (offset > 0)
+                offset = 0;
+        }
+
+        if (c == ARROW_DOWN)
+        {
+            if (offset < (E.max_files - 1))
+            {
+                offset += 1;
+            }
+        }
+    }
+}
+
+
+/* ========================= Buffer registry =============================== */
+
+/*
+ * Each buffer has an ID which never changes, and they're hashed by both
+ * ID and name, so that we can find them quickly however many are open.
+ */
+
+/* Hash a buffer name. */
+unsigned int editorHashName(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+        h = (h * 33) + (unsigned char) * name++;
+
+    return h;
+}
+
+/* Add the buffer to the hash-chains for its ID and name. */
+void editorLinkBuffer(struct fileState *f)
+{
+    struct fileState **p = &E.by_id[f->id & (E.hash_size - 1)];
+    f->id_next = *p;
+    *p = f;
+
+    f->name_next = NULL;
+
+    if (f->filename)
+    {
+        p = &E.by_name[editorHashName(f->filename) & (E.hash_size - 1)];
+        f->name_next = *p;
+        *p = f;
+    }
+}
+
+/* Remove the buffer from the hash-chain for its name. */
+void editorUnlinkName(struct fileState *f)
+{
+    if (f->filename == NULL)
+        return;
+
+    struct fileState **p = &E.by_name[editorHashName(f->filename) & (E.hash_size - 1)];
+
+    while (*p != f)
+        p = &(*p)->name_next;
+
+    *p = f->name_next;
+}
+
+/* Remove the buffer from the hash-chains for its ID and name. */
+void editorUnlinkBuffer(struct fileState *f)
+{
+    struct fileState **p = &E.by_id[f->id & (E.hash_size - 1)];
+
+    while (*p != f)
+        p = &(*p)->id_next;
+
+    *p = f->id_next;
+
+    editorUnlinkName(f);
+}
+
+/* Find a buffer by ID, returning NULL if there is no such buffer. */
+struct fileState *editorBufferById(int id)
+{
+    if (E.hash_size == 0)
+        return NULL;
+
+    struct fileState *f = E.by_id[id & (E.hash_size - 1)];
+
+    while (f && f->id != id)
+        f = f->id_next;
+
+    return f;
+}
+
+/* Find a buffer by name, returning NULL if there is no such buffer. */
+struct fileState *editorBufferByName(const char *name)
+{
+    if (E.hash_size == 0)
+        return NULL;
+
+    struct fileState *f = E.by_name[editorHashName(name) & (E.hash_size - 1)];
+
+    while (f && strcmp(f->filename, name) != 0)
+        f = f->name_next;
+
+    return f;
+}
+
+/* Change the name of a buffer, which may be NULL. */
+void editorSetBufferName(struct fileState *f, const char *name)
+{
+    char *copy = name ? strdup(name) : NULL;
+
+    editorUnlinkName(f);
+    free(f->filename);
+    f->filename = copy;
+
+    if (f->filename)
+    {
+        struct fileState **p = &E.by_name[editorHashName(f->filename) & (E.hash_size - 1)];
+        f->name_next = *p;
+        *p = f;
+    }
+}
+
+/* Create a new buffer, with the given name, and make it current. */
+struct fileState *editorCreateBuffer(const char *name)
+{
+    /*
+     * Grow our list of buffers, and the hash-tables, geometrically.
+     */
+    if (E.max_files == E.file_size)
+    {
+        E.file_size = E.file_size ? E.file_size * 2 : 16;
+        E.file = realloc(E.file, sizeof(struct fileState *) * E.file_size);
+    }
+
+    if (E.max_files == E.hash_size)
+    {
+        E.hash_size = E.hash_size ? E.hash_size * 2 : 16;
+
+        free(E.by_id);
+        free(E.by_name);
+        E.by_id = calloc(E.hash_size, sizeof(struct fileState *));
+        E.by_name = calloc(E.hash_size, sizeof(struct fileState *));
+
+        for (int i = 0; i < E.max_files; i++)
+            editorLinkBuffer(E.file[i]);
+    }
+
+    struct fileState *f = malloc(sizeof(struct fileState));
+    f->markx = -1;
+    f->marky = -1;
+    f->matchlen = 0;
+    f->tab_size = 8;
+    f->cx = 0;
+    f->cy = 0;
+    f->rowoff = 0;
+    f->coloff = 0;
+    f->wrapoff = 0;
+    f->numrows = 0;
+    f->row = NULL;
+    f->version = 0;
+    f->arena.head = NULL;
+    f->arena.bytes = 0;
+    f->arena.intern = E.intern;
+    f->arena.table = NULL;
+    f->arena.slots = 0;
+    f->arena.count = 0;
+    f->cold = NULL;
+    f->wrap = NULL;
+    f->dirty = 0;
+    f->filename = name ? strdup(name) : NULL;
+    f->syntax = NULL;
+    f->pager = NULL;
+    f->hex = NULL;
+    f->follow = NULL;
+    f->gzip = 0;
+    f->crlf = 0;
+    editorScanReset(&f->scan);
+    memset(&f->disk, 0, sizeof(f->disk));
+    f->disk.size = -1;
+    f->disk.wd = -1;
+    f->id = E.next_id++;
+    f->index = E.max_files;
+
+#ifdef _UNDO
+    f->undo = us_create();
+#endif
+
+    E.file[E.max_files] = f;
+    E.max_files += 1;
+    E.current_file = f->index;
+
+    editorLinkBuffer(f);
+    return f;
+}
+
+/* Free a NULL-terminated array of syntax keywords. */
+void editorFreeKeywords(char **keywords)
+{
+    if (keywords == NULL)
+        return;
+
+    for (int i = 0; keywords[i]; i++)
+        free(keywords[i]);
+
+    free(keywords);
+}
+
+/* Free a buffer, and everything it holds.
+ *
+ * It is up to the caller to remove it from E.file[]. */
+void editorFreeBuffer(struct fileState *f)
+{
+    for (int i = 0; i < f->numrows; i++)
+        editorFreeRow(&f->row[i]);
+
+    free(f->row);
+    arena_free(&f->arena);
+    editorColdFree(f);
+    editorWrapFree(f);
+    editorFollowStop(f);
+    editorDiskUnwatch(f);
+    editorPagerFree(f->pager);
+    editorHexFree(f->hex);
+
+    if (f->syntax)
+    {
+        editorSyntaxFreeRegex(f->syntax);
+        editorFreeKeywords(f->syntax->keywords);
+    }
+
+    free(f->syntax);
+    free(f->filename);
+
+#ifdef _UNDO
+    us_clear(f->undo);
+    free(f->undo);
+#endif
+
+    free(f);
+}
+
+
+/* count the buffers */
+int count_buffers_lua(lua_State *L)
+{
+    lua_pushnumber(L, E.max_files);
+    return 1;
+}
+
+/* Return a table of the IDs of all buffers, in order. */
+int buffer_list_lua(lua_State *L)
+{
+    lua_newtable(L);
+
+    for (int i = 0; i < E.max_files; i++)
+    {
+        lua_pushnumber(L, E.file[i]->id);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+/* Create a new buffer, returning its ID */
+int create_buffer_lua(lua_State *L)
+{
+    /*
+     * Is there a name for the new buffer?
+     */
+    const char *name = lua_tostring(L, -1);
+
+    struct fileState *f = editorCreateBuffer(name);
+
+    lua_pushnumber(L, f->id);
+    return 1;
+}
+
+/* Return the ID of the current buffer */
+int current_buffer_lua(lua_State *L)
+{
+    lua_pushnumber(L, E.file[E.current_file]->id);
+    return 1;
+}
+
+/* Kill the current buffer. */
+int kill_buffer_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.max_files > 1)
+    {
+
+        /*
+         * Free the current buffer.
+         */
+        struct fileState *cur = E.file[E.current_file];
+
+        if (cur == E.log.buffer)
+            E.log.buffer = NULL;
+
+        editorUnlinkBuffer(cur);
+        editorFreeBuffer(cur);
+
+        /*
+         * Close the gap in our list of buffers.
+         */
+        E.max_files -= 1;
+
+        for (int i = E.current_file; i < E.max_files; i++)
+        {
+            E.file[i] = E.file[i + 1];
+            E.file[i]->index = i;
+        }
+
+        /*
+         * Change to the previous buffer.
+         */
+        if (E.current_file > 0)
+        {
+            E.current_file -= 1;
+        }
+        else
+        {
+            E.current_file = E.max_files - 1;
+        }
+
+#ifdef __GLIBC__
+        /* Hand the memory back to the system. */
+        malloc_trim(0);
+#endif
+    }
+    else
+    {
+        exit_lua(L);
+    }
+
+
+    return 0;
+}
+
+/* Move to the next buffer.*/
+int next_buffer_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.current_file < (E.max_files - 1))
+    {
+        E.current_file += 1;
+    }
+    else
+    {
+        E.current_file = 0;
+    }
+
+    return 0;
+}
+
+/* Move to the previous buffer.*/
+int prev_buffer_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.current_file > 0)
+    {
+        E.current_file -= 1;
+    }
+    else
+    {
+        E.current_file = E.max_files - 1;
+    }
+
+    return 0;
+}
+
+/* select a buffer, by ID or name */
+int select_buffer_lua(lua_State *L)
+{
+    struct fileState *f = NULL;
+
+    if (lua_isnumber(L, -1))
+        f = editorBufferById(lua_tonumber(L, -1));
+    else if (lua_isstring(L, -1))
+        f = editorBufferByName(lua_tostring(L, -1));
+
+    if (f != NULL)
+        E.current_file = f->index;
+
+    lua_pushnumber(L, f != NULL);
+    return 1;
+}
+
+
+
+/* ================================ Windows ================================ */
+
+/* Copy the view of a buffer into `v`. */
+void editorGetView(struct fileState *f, struct editorView *v)
+{
+    v->cx = f->cx;
+    v->cy = f->cy;
+    v->rowoff = f->rowoff;
+    v->coloff = f->coloff;
+    v->wrapoff = f->wrapoff;
+}
+
+/* Make `v` the view of a buffer. */
+void editorSetView(struct fileState *f, struct editorView *v)
+{
+    f->cx = v->cx;
+    f->cy = v->cy;
+    f->rowoff = v->rowoff;
+    f->coloff = v->coloff;
+    f->wrapoff = v->wrapoff;
+}
+
+/* Scroll a view such that the cursor fits within the given size. */
+void editorClampView(struct editorView *v, int rows, int cols)
+{
+    if (v->cy >= rows)
+    {
+        v->rowoff += v->cy - rows + 1;
+        v->cy = rows - 1;
+    }
+
+    if (v->cx >= cols)
+    {
+        v->coloff += v->cx - cols + 1;
+        v->cx = cols - 1;
+    }
+}
+
+/* Store the view of the current buffer in the active window. */
+void editorSaveView(void)
+{
+    struct fileState *f = E.file[E.current_file];
+    E.window->buffer = f->id;
+    editorGetView(f, &E.window->view);
+}
+
+/* Make the buffer of the active window current, with the window's view. */
+void editorLoadView(void)
+{
+    struct editorWindow *w = E.window;
+    struct fileState *f = editorBufferById(w->buffer);
+
+    if (f == NULL)
+    {
+        f = E.file[E.current_file];
+        w->buffer = f->id;
+        memset(&w->view, 0, sizeof(w->view));
+    }
+
+    /*
+     * The buffer may have shrunk since we last showed it.
+     */
+    if (w->view.rowoff + w->view.cy > f->numrows)
+        memset(&w->view, 0, sizeof(w->view));
+
+    E.current_file = f->index;
+    E.screenrows = w->height - 1;
+    E.screencols = w->width;
+
+    editorClampView(&w->view, E.screenrows, E.screencols);
+    editorSetView(f, &w->view);
+}
+
+/* Position the window `w`, and any windows within it. */
+void editorLayoutWindow(struct editorWindow *w, int top, int left, int height, int width)
+{
+    w->top = top;
+    w->left = left;
+    w->height = height;
+    w->width = width;
+
+    if (w->child[0] == NULL)
+    {
+        editorClampView(&w->view, height - 1, width);
+        return;
+    }
+
+    if (w->vertical)
+    {
+        int first = (width - 1) / 2;
+        editorLayoutWindow(w->child[0], top, left, height, first);
+        editorLayoutWindow(w->child[1], top, left + first + 1, height, width - first - 1);
+    }
+    else
+    {
+        int first = height / 2;
+        editorLayoutWindow(w->child[0], top, left, first, width);
+        editorLayoutWindow(w->child[1], top + first, left, height - first, width);
+    }
+}
+
+/* Lay out our windows to fill the screen, leaving the last line for the
+ * status-message, then load the view of the active window.
+ *
+ * The caller should have saved the view of the active window, if it is
+ * still wanted. */
+void editorLayout(void)
+{
+    editorLayoutWindow(E.root, 0, 0, E.termrows - 1, E.termcols);
+    editorLoadView();
+    E.redraw = 1;
+}
+
+/* Set the size of the terminal, creating our first window if need be. */
+void editorResizeScreen(int rows, int cols)
+{
+    E.termrows = rows;
+    E.termcols = cols;
+
+    if (E.root == NULL)
+    {
+        E.root = E.window = calloc(1, sizeof(struct editorWindow));
+        E.root->buffer = E.file[E.current_file]->id;
+    }
+    else
+    {
+        editorSaveView();
+    }
+
+    editorLayout();
+}
+
+/* Return the first window within `w`, in screen order. */
+struct editorWindow *editorFirstWindow(struct editorWindow *w)
+{
+    while (w->child[0])
+        w = w->child[0];
+
+    return w;
+}
+
+/* Return the window after `w`, in screen order, wrapping around. */
+struct editorWindow *editorNextWindow(struct editorWindow *w)
+{
+    while (w->parent && w == w->parent->child[1])
+        w = w->parent;
+
+    if (w->parent == NULL)
+        return editorFirstWindow(w);
+
+    return editorFirstWindow(w->parent->child[1]);
+}
+
+/* Free the window `w`, and any windows within it. */
+void editorFreeWindow(struct editorWindow *w)
+{
+    if (w == NULL)
+        return;
+
+    editorFreeWindow(w->child[0]);
+    editorFreeWindow(w->child[1]);
+    free(w);
+}
+
+/* Split the active window in two, both showing the current buffer.
+ *
+ * The active window becomes the top, or left, of the pair. */
+void editorSplitWindow(int vertical)
+{
+    struct editorWindow *w = E.window;
+
+    if (vertical ? (w->width < 21) : (w->height < 6))
+    {
+        editorSetStatusMessage(1, "Window too small to split");
+        return;
+    }
+
+    editorSaveView();
+
+    for (int i = 0; i < 2; i++)
+    {
+        w->child[i] = calloc(1, sizeof(struct editorWindow));
+        w->child[i]->parent = w;
+        w->child[i]->buffer = w->buffer;
+        w->child[i]->view = w->view;
+    }
+
+    w->vertical = vertical;
+    E.window = w->child[0];
+
+    editorLayout();
+}
+
+/* Delete the active window. */
+int delete_window_lua(lua_State *L)
+{
+    (void)L;
+
+    struct editorWindow *w = E.window;
+    struct editorWindow *parent = w->parent;
+
+    if (parent == NULL)
+    {
+        editorSetStatusMessage(1, "Attempt to delete the only window");
+        return 0;
+    }
+
+    /*
+     * Our sibling takes the place of our parent.
+     */
+    struct editorWindow *sibling = parent->child[parent->child[0] == w ? 1 : 0];
+    struct editorWindow *grandparent = parent->parent;
+
+    *parent = *sibling;
+    parent->parent = grandparent;
+
+    for (int i = 0; i < 2; i++)
+        if (parent->child[i])
+            parent->child[i]->parent = parent;
+
+    free(sibling);
+    free(w);
+
+    E.window = editorFirstWindow(parent);
+    editorLayout();
+    return 0;
+}
+
+/* Delete all windows but the active one. */
+int delete_other_windows_lua(lua_State *L)
+{
+    (void)L;
+
+    if (E.root == E.window)
+        return 0;
+
+    editorSaveView();
+
+    int buffer = E.window->buffer;
+    struct editorView view = E.window->view;
+
+    editorFreeWindow(E.root->child[0]);
+    editorFreeWindow(E.root->child[1]);
+
+    E.root->child[0] = E.root->child[1] = NULL;
+    E.root->buffer = buffer;
+    E.root->view = view;
+    E.window = E.root;
+
+    editorLayout();
+    return 0;
+}
+
+/* Make the next window active. */
+int other_window_lua(lua_State *L)
+{
+    (void)L;
+
+    editorSaveView();
+    E.window = editorNextWindow(E.window);
+    editorLoadView();
+    return 0;
+}
+
+/* Split the active window into two, one above the other. */
+int split_window_below_lua(lua_State *L)
+{
+    (void)L;
+    editorSplitWindow(0);
+    return 0;
+}
+
+/* Split the active window into two, side by side. */
+int split_window_right_lua(lua_State *L)
+{
+    (void)L;
+    editorSplitWindow(1);
+    return 0;
+}
+
+
+
+/* ====================== Syntax highlight color scheme  ==================== */
+
+int is_separator(int c)
+{
+    return c == '\0' || isspace(c) || strchr(":{},.()+-/*=~%[];<>|&", c) != NULL;
+}
+
+/* Return true if the specified row last char is part of a multi line comment
+ * that starts at this row or at one before, and does not end at the end
+ * of the row but spawns to the next row. */
+int editorRowHasOpenComment(struct fileState *f, erow *row)
+{
+    /*
+     * Compressed rows remember the answer from when they were
+     * highlighted.
+     */
+    if (row->cold)
+        return row->hl_oc;
+
+    /*
+     * If the line is empty - then we have to check on the line before
+     * that.
+     */
+    if (row->size == 0)
+    {
+        if (row->idx > 0)
+            return (editorRowHasOpenComment(f, &f->row[row->idx - 1]));
+        else
+            return 0;
+    }
+
+    /*
+     * Giant rows have spans for only some of their characters, so we
+     * ask the state the highlighter finishes the row in.
+     */
+    if (row->giant)
+    {
+        int last = editorGiantLex(f, row, INT_MAX);
+        struct editorLex *end = &row->giant->mark[last];
+        return !end->line && end->comment;
+    }
+
+    /*
+     * OK we have some text.  Is the line ending in a MLCOMMENT
+     * character-string?
+     */
+    int spanned = 0;
+
+    for (int i = 0; i < row->nhl; i++)
+        spanned += row->hl[i].skip + row->hl[i].len;
+
+    if (row->nhl == 0 || row->hl[row->nhl - 1].type != HL_MLCOMMENT ||
+            spanned != row->size)
+        return 0;
+
+    /*
+     * OK the line ends in a comment.  Are the closing characters
+     * our closing tokens though?
+     */
+    int len = (int)strlen(f->syntax->multiline_comment_end);
+    char *end = f->syntax->multiline_comment_end;
+
+    if (len && strncmp(row->chars + row->size - len, end, len) == 0)
+        return 0;
+    else
+        return 1;
+
+
+}
+
+/* Find the right syntax highlight type (HL_* defines) for every character
+ * in the line, and record the runs which aren't HL_NORMAL in row->hl.
+ *
+ * We highlight into a scratch buffer, with a byte per character, and
+ * only keep the spans; rows which are entirely HL_NORMAL have none.
+ * Giant rows are highlighted as they're drawn, around the characters
+ * we draw of them. */
+void editorUpdateSyntax(struct fileState *f, erow *row)
+{
+    static unsigned char *scratch = NULL;
+    static int room = 0;
+
+    free(row->hl);
+    row->hl = NULL;
+    row->nhl = 0;
+
+    /* No syntax, everything is HL_NORMAL. */
+    if (f->syntax == NULL)
+    {
+        editorGiantFree(row);
+        return;
+    }
+
+    editorRowWarm(f, row);
+
+    if (row->size >= KILO_GIANT_ROW)
+        editorGiantStart(f, row);
+    else
+    {
+        editorGiantFree(row);
+
+        if (row->size > room)
+        {
+            room = row->size * 2;
+            scratch = realloc(scratch, room);
+        }
+
+        memset(scratch, HL_NORMAL, row->size);
+        editorHighlightRow(f, row, scratch);
+        editorSetSpans(row, scratch, 0, row->size);
+    }
+
+    /* Propagate syntax change to the next row if the open comment
+     * state changed. This may recursively affect all the following rows
+     * in the file. */
+    int oc = editorRowHasOpenComment(f, row);
+
+    if (row->hl_oc != oc && row->idx + 1 < f->numrows)
+        editorUpdateSyntax(f, &f->row[row->idx + 1]);
+
+    row->hl_oc = oc;
+}
+
+/* Record the highlight types `hl` of the characters of the row from the
+ * offset `from` up to `to`, as the spans of the row. */
+void editorSetSpans(erow *row, unsigned char *hl, int from, int to)
+{
+    free(row->hl);
+    row->hl = NULL;
+    row->nhl = 0;
+
+    /* Count the spans we need, then record them. */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int i, j, end = 0, spans = 0;
+
+        for (i = from; i < to; i = j)
+        {
+            unsigned char type = hl[i - from];
+
+            for (j = i + 1; j < to && hl[j - from] == type; j++)
+                ;
+
+            if (type == HL_NORMAL)
+                continue;
+
+            int skip = i - end, len = j - i;
+
+            while (skip > USHRT_MAX || len > 0)
+            {
+                int gap = skip > USHRT_MAX ? USHRT_MAX : skip;
+                int n = skip > USHRT_MAX ? 0 : len > UCHAR_MAX ? UCHAR_MAX : len;
+
+                if (pass == 1)
+                {
+                    row->hl[spans].skip = gap;
+                    row->hl[spans].len = n;
+                    row->hl[spans].type = type;
+                }
+
+                skip -= gap;
+                len -= n;
+                spans++;
+            }
+
+            end = j;
+        }
+
+        if (spans == 0)
+            break;
+
+        if (pass == 0)
+            row->hl = malloc(sizeof(hlspan) * spans);
+
+        row->nhl = spans;
+    }
+}
+
+/* Highlight the row, writing the type of each character to `hl`. */
+void editorHighlightRow(struct fileState *f, erow *row, unsigned char *hl)
+{
+    struct editorLex s;
+
+    editorLexStart(f, row, &s);
+    editorLexRow(f, row, &s, row->size, hl, 0);
+}
+
+/* The state in which we start to highlight the row: at its first
+ * non-space character, within a comment if the row before ends in one. */
+void editorLexStart(struct fileState *f, erow *row, struct editorLex *s)
+{
+    int i = 0;
+
+    while (i < row->size && isspace((unsigned char)row->chars[i]))
+        i++;
+
+    s->at = i;
+    s->comment = row->idx > 0 && editorRowHasOpenComment(f, &f->row[row->idx - 1]);
+    s->string = 0;
+    s->sep = 1;
+    s->number = 0;
+    s->line = 0;
+}
+
+/* Are the two states of the highlighter the same? */
+int editorLexSame(struct editorLex *a, struct editorLex *b)
+{
+    return a->at == b->at && a->comment == b->comment &&
+           a->string == b->string && a->sep == b->sep &&
+           a->number == b->number && a->line == b->line;
+}
+
+/* Highlight the row from the state `s` up to the offset `to`, writing the
+ * type of the character at each offset `i` to `hl[i - base]`, and leave
+ * `s` in the state at which we stopped, which may be a little past `to`.
+ *
+ * Keywords and comment-tokens which start before `to` are written in
+ * full, so `hl` needs room for those which end after it. */
+void editorLexRow(struct fileState *f, erow *row, struct editorLex *s, int to,
+                  unsigned char *hl, int base)
+{
+    struct editorSyntax *syntax = f->syntax;
+    int single = strlen(syntax->singleline_comment_start);
+    int open = strlen(syntax->multiline_comment_start);
+    int close = strlen(syntax->multiline_comment_end);
+    int i = s->at;
+
+    if (to > row->size)
+        to = row->size;
+
+    /* From the start of a // comment, everything is comment. */
+    if (s->line)
+    {
+        if (to > i)
+            memset(hl + i - base, HL_COMMENT, to - i);
+
+        return;
+    }
+
+    while (i < to)
+    {
+        char *p = row->chars + i;
+
+        /* Handle multi line comments. */
+        if (s->comment)
+        {
+            hl[i - base] = HL_MLCOMMENT;
+            s->number = 0;
+
+            if (strncmp(p, syntax->multiline_comment_end, close) == 0)
+            {
+                memset(hl + i - base, HL_MLCOMMENT, close);
+                i += close;
+                s->comment = 0;
+                s->sep = 1;
+            }
+            else
+            {
+                s->sep = 0;
+                i++;
+            }
+
+            continue;
+        }
+        else if (open && strncmp(p, syntax->multiline_comment_start, open) == 0)
+        {
+            memset(hl + i - base, HL_MLCOMMENT, open);
+            i += open;
+            s->comment = 1;
+            s->sep = 0;
+            s->number = 0;
+            continue;
+        }
+
+        /* Handle // comments - colour the rest of the line and stop. */
+        if (s->sep && single &&
+                strncmp(p, syntax->singleline_comment_start, single) == 0)
+        {
+            memset(hl + i - base, HL_COMMENT, to - i);
+            s->at = i;
+            s->line = 1;
+            return;
+        }
+
+        /* Handle "" and '' */
+        if (s->string)
+        {
+            if (syntax->flags & HL_HIGHLIGHT_STRINGS)
+                hl[i - base] = HL_STRING;
+
+            s->number = 0;
+
+            if (*p == '\\')
+            {
+                if (syntax->flags & HL_HIGHLIGHT_STRINGS)
+                    hl[i + 1 - base] = HL_STRING;
+
+                i += 2;
+                s->sep = 0;
+                continue;
+            }
+
+            if (*p == s->string)
+                s->string = 0;
+
+            i++;
+            continue;
+        }
+        else if (*p == '"' || *p == '\'')
+        {
+            s->string = *p;
+
+            if (syntax->flags & HL_HIGHLIGHT_STRINGS)
+                hl[i - base] = HL_STRING;
+
+            i++;
+            s->sep = 0;
+            s->number = 0;
+            continue;
+        }
+
+        /* Handle numbers */
+        if ((isdigit(*p) && (s->sep || s->number)) || (*p == '.' && s->number))
+        {
+            s->number = 0;
+
+            if (syntax->flags & HL_HIGHLIGHT_NUMBERS)
+            {
+                hl[i - base] = HL_NUMBER;
+                s->number = 1;
+            }
+
+            i++;
+            s->sep = 0;
+            continue;
+        }
+
+        if (is_separator(*p))
+            hl[i - base] = HL_KEYWORD1;
+
+        /* Handle keywords and lib calls */
+        if (s->sep)
+        {
+            int kw2, klen = editorKeywordMatch(f, row, i, &kw2);
+
+            if (klen >= 0)
+            {
+                memset(hl + i - base, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                i += klen;
+                s->sep = 0;
+                s->number = 0;
+                continue;
+            }
+        }
+
+        /* Not special chars */
+        s->sep = is_separator(*p);
+        s->number = 0;
+        i++;
+    }
+
+    s->at = i < row->size ? i : row->size;
+}
+
+/* The length of the keyword at the offset `at` of the row, or -1 if
+ * there is none.  `kw2` is set if it is one of the second kind, which
+ * are marked by a trailing "|". */
+int editorKeywordMatch(struct fileState *f, erow *row, int at, int *kw2)
+{
+    struct editorSyntax *syntax = f->syntax;
+    char **keywords = syntax->keywords;
+    char *p = row->chars + at;
+    int j;
+
+#ifdef _REGEXP
+
+    /*
+     * Compile the keywords the first time we need them.  Each is
+     * anchored, so that it fails quickly where it doesn't match, and
+     * those without special characters are simply compared.
+     */
+    if (syntax->regex == NULL)
+    {
+        for (j = 0; keywords[j]; j++)
+            ;
+
+        syntax->regex = malloc(sizeof(regex_t) * (j + 1));
+        syntax->compiled = malloc(j + 1);
+
+        for (j = 0; keywords[j]; j++)
+        {
+            int klen = strlen(keywords[j]);
+            char *tmp = malloc(klen + 4);
+
+            /*
+             * Strip the trailing "|"
+             */
+            if (klen && keywords[j][klen - 1] == '|')
+                klen--;
+
+            snprintf(tmp, klen + 4, "^(%.*s)", klen, keywords[j]);
+
+            if ((int)strcspn(keywords[j], "^$.[]()*+?{}|\\") >= klen)
+                syntax->compiled[j] = 2;
+            else
+                syntax->compiled[j] = regcomp(&syntax->regex[j], tmp, REG_EXTENDED) == 0;
+
+            free(tmp);
+        }
+    }
+
+    /*
+     * Keywords in giant rows are matched against the bytes near
+     * them, rather than all the rest of the row.
+     */
+    int most = row->size - at;
+
+    if (row->giant && most > KILO_KEYWORD_MAX)
+        most = KILO_KEYWORD_MAX;
+
+    for (j = 0; keywords[j]; j++)
+    {
+        regmatch_t result[1];
+
+        /*
+         * Can't compile?  Skip.
+         */
+        if (!syntax->compiled[j])
+            continue;
+
+        if (syntax->compiled[j] == 2)
+        {
+            int klen = strlen(keywords[j]);
+            int two = klen && keywords[j][klen - 1] == '|';
+
+            klen -= two;
+
+            if (klen <= row->size - at && !memcmp(p, keywords[j], klen) &&
+                    is_separator(*(p + klen)))
+            {
+                *kw2 = two;
+                return klen;
+            }
+
+            continue;
+        }
+
+#ifdef REG_STARTEND
+        result[0].rm_so = 0;
+        result[0].rm_eo = most;
+
+        if (regexec(&syntax->regex[j], p, 1, result, REG_STARTEND) != 0)
+            continue;
+
+#else
+        (void)most;
+
+        if (regexec(&syntax->regex[j], p, 1, result, 0) != 0)
+            continue;
+
+#endif
+
+        /* the length of the match */
+        int klen = result[0].rm_eo - result[0].rm_so;
+
+        /*
+         * We need the match made at the current position, followed by
+         * a separator.
+         */
+        if (result[0].rm_so == 0 && is_separator(*(p + klen)))
+        {
+            int len = strlen(keywords[j]);
+            *kw2 = keywords[j][len - 1] == '|';
+            return klen;
+        }
+    }
+
+#else
+
+    for (j = 0; keywords[j]; j++)
+    {
+        int klen = strlen(keywords[j]);
+        int two = klen && keywords[j][klen - 1] == '|';
+
+        if (two)
+            klen--;
+
+        if (klen <= row->size - at && !memcmp(p, keywords[j], klen) &&
+                is_separator(*(p + klen)))
+        {
+            /* Keyword */
+            *kw2 = two;
+            return klen;
+        }
+    }
+
+#endif
+
+    return -1;
+}
+
+/* Forget the keywords of the syntax we compiled, as they're changing. */
+void editorSyntaxFreeRegex(struct editorSyntax *s)
+{
+#ifdef _REGEXP
+
+    if (s->regex == NULL)
+        return;
+
+    for (int j = 0; s->keywords[j]; j++)
+    {
+        if (s->compiled[j] == 1)
+            regfree(&s->regex[j]);
+    }
+
+    free(s->regex);
+    free(s->compiled);
+    s->regex = NULL;
+    s->compiled = NULL;
+#else
+    (void)s;
+#endif
+}
+
+/* A giant row is highlighted as it's drawn, so forget the spans we last
+ * drew it with.  If it no longer starts in the state it did, because the
+ * row before changed, its marks must all be checked again. */
+void editorGiantStart(struct fileState *f, erow *row)
+{
+    struct editorGiant *g = row->giant;
+    struct editorLex s;
+
+    if (g == NULL)
+        g = row->giant = calloc(1, sizeof(struct editorGiant));
+
+    g->from = g->to = 0;
+    editorLexStart(f, row, &s);
+
+    if (g->valid && !editorLexSame(&s, &g->mark[0]))
+        g->valid = 0;
+}
+
+/* Free the highlighting state of a giant row. */
+void editorGiantFree(erow *row)
+{
+    if (row->giant == NULL)
+        return;
+
+    free(row->giant->mark);
+    free(row->giant);
+    row->giant = NULL;
+}
+
+/* `delta` bytes were inserted at `at` of a giant row, or removed from there
+ * if it is negative, so forget the marks the change may have altered,
+ * and move those after it along with the text, to be checked again. */
+void editorGiantEdit(erow *row, int at, int delta)
+{
+    struct editorGiant *g = row->giant;
+    int n = 0, valid = 0;
+
+    if (g == NULL)
+        return;
+
+    for (int i = 0; i < g->marks; i++)
+    {
+        struct editorLex m = g->mark[i];
+
+        /*
+         * A mark is still correct if the change is beyond the bytes
+         * any keyword before it was matched against.
+         */
+        if (i < g->valid && m.at + KILO_KEYWORD_MAX <= at)
+        {
+            g->mark[n++] = m;
+            valid = n;
+            continue;
+        }
+
+        if (m.at < at || (delta < 0 && m.at < at - delta))
+            continue;
+
+        m.at += delta;
+        g->mark[n++] = m;
+    }
+
+    g->marks = n;
+    g->valid = valid;
+}
+
+/* Check the marks of a giant row up to the offset `upto`, highlighting on
+ * from the last correct one, and return the index of the last mark at or
+ * before it.  Passing INT_MAX checks them all, and the last is then the
+ * state in which the row ends. */
+int editorGiantLex(struct fileState *f, erow *row, int upto)
+{
+    static unsigned char *scratch = NULL;
+    struct editorGiant *g = row->giant;
+    struct editorLex s;
+
+    if (scratch == NULL)
+        scratch = malloc(2 * KILO_LEX_STEP + KILO_KEYWORD_MAX + 8);
+
+    for (;;)
+    {
+        if (g->valid == 0)
+            editorLexStart(f, row, &s);
+        else
+        {
+            s = g->mark[g->valid - 1];
+
+            if (s.line || s.at >= row->size)
+            {
+                g->marks = g->valid;
+                break;
+            }
+
+            if (s.at > upto - KILO_LEX_STEP)
+                break;
+
+            /*
+             * Carry on to the next of the marks we had, if it's near,
+             * so that we don't add more marks as the row is edited.
+             */
+            int next = s.at + KILO_LEX_STEP;
+
+            if (g->valid < g->marks && g->mark[g->valid].at < next + KILO_LEX_STEP)
+                next = g->mark[g->valid].at;
+
+            editorLexRow(f, row, &s, next, scratch, s.at);
+        }
+
+        /*
+         * If we reach one of the marks we had in the state it recorded,
+         * the rest of the row highlights as it did before.
+         */
+        int n = g->valid;
+
+        while (n < g->marks && g->mark[n].at < s.at)
+            n++;
+
+        if (n < g->marks && editorLexSame(&s, &g->mark[n]))
+        {
+            memmove(g->mark + g->valid, g->mark + n,
+                    sizeof(struct editorLex) * (g->marks - n));
+            g->marks -= n - g->valid;
+            g->valid = g->marks;
+            continue;
+        }
+
+        if (n < g->marks && g->mark[n].at == s.at)
+            n++;
+
+        /*
+         * Otherwise this mark replaces those we passed.
+         */
+        if (g->marks + g->valid + 1 - n > g->room)
+        {
+            g->room = g->room ? g->room * 2 : 64;
+            g->mark = realloc(g->mark, sizeof(struct editorLex) * g->room);
+        }
+
+        memmove(g->mark + g->valid + 1, g->mark + n,
+                sizeof(struct editorLex) * (g->marks - n));
+        g->marks += g->valid + 1 - n;
+        g->mark[g->valid++] = s;
+    }
+
+    int lo = 0, hi = g->valid - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+
+        if (g->mark[mid].at <= upto)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+/* Highlight the characters of a giant row around those from the offset
+ * `from` up to `to`, unless the spans of the row already cover them. */
+void editorGiantHighlight(struct fileState *f, erow *row, int from, int to)
+{
+    static unsigned char *scratch = NULL;
+    static int room = 0;
+    struct editorGiant *g = row->giant;
+
+    if (from >= g->from && to <= g->to)
+        return;
+
+    from = from > KILO_LEX_MARGIN ? from - KILO_LEX_MARGIN : 0;
+    to = row->size - to > KILO_LEX_MARGIN ? to + KILO_LEX_MARGIN : row->size;
+
+    int mark = editorGiantLex(f, row, from);
+    struct editorLex s = g->mark[mark];
+
+    if (s.line && s.at < from)
+        s.at = from;
+
+    int base = s.at < from ? s.at : from;
+    int need = to - base + KILO_KEYWORD_MAX + 8;
+
+    if (need > room)
+    {
+        room = need * 2;
+        scratch = realloc(scratch, room);
+    }
+
+    memset(scratch, HL_NORMAL, need);
+    editorLexRow(f, row, &s, to, scratch, base);
+    editorSetSpans(row, scratch + from - base, from, to);
+
+    g->from = from;
+    g->to = to;
+}
+
+/* Maps syntax highlight token types to terminal colors. */
+int editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 36;     /* cyan */
+
+    case HL_KEYWORD1:
+        return 33;    /* yellow */
+
+    case HL_KEYWORD2:
+        return 32;    /* green */
+
+    case HL_STRING:
+        return 35;      /* magenta */
+
+    case HL_NUMBER:
+        return 31;      /* red */
+
+    case HL_MATCH:
+        return 34;      /* blue */
+
+    case HL_SELECTION:
+        return 30;
+
+    default:
+        return 37;             /* white */
+    }
+}
+
+
+
+
+
+/* ======================= Input functions           ======================= */
+
+/* Show a prompt.  Read input until either `Esc` or `Return`. */
+char *get_input(char *prompt)
+{
+    char query[KILO_QUERY_LEN + 1] = {0};
+    int qlen = 0;
+
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.file[E.current_file]->cx, saved_cy = E.file[E.current_file]->cy;
+    int saved_coloff = E.file[E.current_file]->coloff, saved_rowoff = E.file[E.current_file]->rowoff;
+
+    while (1)
+    {
+        editorSetStatusMessage(0, "%s%s", prompt, query);
+        editorRefreshScreen();
+
+        int c = editorReadKey(E.infd);
+
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE)
+        {
+            if (qlen != 0) query[--qlen] = '\0';
+        }
+        else if (c == ESC)
+        {
+            E.file[E.current_file]->cx = saved_cx;
+            E.file[E.current_file]->cy = saved_cy;
+            E.file[E.current_file]->coloff = saved_coloff;
+            E.file[E.current_file]->rowoff = saved_rowoff;
+            editorSetStatusMessage(0, "");
+            return NULL;
+        }
+        else if (c == ENTER)
+        {
+            E.file[E.current_file]->cx = saved_cx;
+            E.file[E.current_file]->cy = saved_cy;
+            E.file[E.current_file]->coloff = saved_coloff;
+            E.file[E.current_file]->rowoff = saved_rowoff;
+            editorSetStatusMessage(0, "");
+            return (strdup(query));
+        }
+        else if (isprint(c))
+        {
+            if (qlen < KILO_QUERY_LEN)
+            {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+            }
+        }
+    }
+}
+
+
+/* ======================= Editor rows implementation ======================= */
+
+/* Update the column index and the syntax highlight of a row. */
+void editorUpdateRow(struct fileState *f, erow *row)
+{
+    int stops = 0, col, len, j;
+
+    f->version++;
+    editorRowWarm(f, row);
+
+    /* Any of the row may have changed, so a giant row's marks are gone. */
+    if (row->giant)
+        row->giant->marks = row->giant->valid = 0;
+
+    for (j = 0; j < row->size; j += len)
+    {
+        unsigned char c = row->chars[j];
+        len = 1;
+
+        if (c >= 0x80)
+            editorCharWidth(f, row, j, 0, &len);
+
+        if (c == TAB || c < ' ' || c >= 0x7F)
+            stops++;
+    }
+
+    /* Rows of printable ASCII are drawn as they are, so only rows with
+     * other characters record where they are, and the column at which
+     * each is drawn, to let us map characters to screen columns. */
+    if (stops == 0)
+    {
+        free(row->cols);
+        row->cols = NULL;
+    }
+    else
+    {
+        if (row->cols == NULL || row->cols[0].at != stops)
+            row->cols = realloc(row->cols, sizeof(colstop) * (stops + 1));
+
+        row->cols[0].at = 0;
+
+        for (j = col = 0; j < row->size; j += len)
+        {
+            unsigned char c = row->chars[j];
+            int width = editorCharWidth(f, row, j, col, &len);
+
+            if (c == TAB || c < ' ' || c >= 0x7F)
+            {
+                colstop *stop = &row->cols[++row->cols[0].at];
+                stop->at = j;
+                stop->col = col;
+            }
+
+            col += width < 0 ? 1 : width;
+        }
+    }
+
+    if (f->wrap)
+        editorWrapUpdate(f, row);
+
+    /* Update the syntax highlighting attributes of the row. */
+    stats_start(&E.stats, STAT_SYNTAX);
+    editorUpdateSyntax(f, row);
+    stats_stop(&E.stats, STAT_SYNTAX);
+}
+
+/* Update a row, of which `delta` bytes were inserted at `at`, or removed
+ * from there if it is negative.  Giant rows are indexed and highlighted
+ * again from the change, rather than from their start. */
+void editorUpdateRowEdit(struct fileState *f, erow *row, int at, int delta)
+{
+    if (row->size < KILO_GIANT_ROW)
+    {
+        editorUpdateRow(f, row);
+        return;
+    }
+
+    f->version++;
+    editorColumnsEdit(f, row, at, delta);
+    editorGiantEdit(row, at, delta);
+
+    if (f->wrap)
+        editorWrapUpdate(f, row);
+
+    stats_start(&E.stats, STAT_SYNTAX);
+    editorUpdateSyntax(f, row);
+    stats_stop(&E.stats, STAT_SYNTAX);
+}
+
+/* Patch the column index of a row, of which `delta` bytes were inserted
+ * at `at`, or removed from there if it is negative.
+ *
+ * The characters from the change up to the next ASCII one, which starts
+ * a character both before and after it, are indexed again, and the stops
+ * after them moved along.  The columns of the stops from the change on
+ * then follow from those before them. */
+void editorColumnsEdit(struct fileState *f, erow *row, int at, int delta)
+{
+    static colstop *add = NULL;
+    static int room = 0;
+    colstop *cols = row->cols;
+    int count = cols ? cols[0].at : 0;
+    int lo = 1, hi = count, n = 0, j, len;
+
+    /* Find the first stop the change may touch; those before end first. */
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (cols[mid].at < at - 3)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    int k = lo, end = at + (delta > 0 ? delta : 0);
+
+    j = k <= count && cols[k].at < at ? cols[k].at : at;
+
+    for (; j < row->size && (j < end || (unsigned char)row->chars[j] >= 0x80); j += len)
+    {
+        unsigned char c = row->chars[j];
+        len = 1;
+
+        if (c >= 0x80)
+            editorCharWidth(f, row, j, 0, &len);
+
+        if (c == TAB || c < ' ' || c >= 0x7F)
+        {
+            if (n == room)
+            {
+                room = room ? room * 2 : 64;
+                add = realloc(add, sizeof(colstop) * room);
+            }
+
+            add[n++].at = j;
+        }
+    }
+
+    /* The stops from `j` on are those which followed it before. */
+    int m = k;
+
+    while (m <= count && cols[m].at < j - delta)
+        m++;
+
+    int total = k - 1 + n + count - m + 1;
+
+    if (total == 0)
+    {
+        free(row->cols);
+        row->cols = NULL;
+        return;
+    }
+
+    if (total > count)
+        cols = realloc(cols, sizeof(colstop) * (total + 1));
+
+    memmove(cols + k + n, cols + m, sizeof(colstop) * (count - m + 1));
+
+    if (n)
+        memcpy(cols + k, add, sizeof(colstop) * n);
+
+    if (total < count)
+        cols = realloc(cols, sizeof(colstop) * (total + 1));
+
+    row->cols = cols;
+    cols[0].at = total;
+
+    for (int i = k; i <= total; i++)
+    {
+        colstop *prev = &cols[i - 1];
+
+        if (i >= k + n)
+            cols[i].at += delta;
+
+        if (i == 1)
+        {
+            cols[i].col = cols[i].at;
+            continue;
+        }
+
+        int width = editorCharWidth(f, row, prev->at, prev->col, &len);
+        cols[i].col = prev->col + (width < 0 ? 1 : width) + cols[i].at - (prev->at + len);
+    }
+}
+
+/* The screen column following a TAB drawn at the given column. */
+int editorTabStop(struct fileState *f, int col)
+{
+    col++;
+    return col + (f->tab_size - 1) - (col % f->tab_size);
+}
+
+/* The number of columns taken by the character at `at` of the row, if
+ * it is drawn at the column `col`, or -1 if it can't be printed and is
+ * drawn as a single `?`.  The bytes it occupies are stored in `len`. */
+int editorCharWidth(struct fileState *f, erow *row, int at, int col, int *len)
+{
+    unsigned char c = row->chars[at];
+    int cp;
+
+    *len = 1;
+
+    if (c == TAB)
+        return editorTabStop(f, col) - col;
+
+    if (c < 0x80)
+        return isprint(c) ? 1 : -1;
+
+    *len = utf8_decode(row->chars + at, row->size - at, &cp);
+    return utf8_width(cp);
+}
+
+/* The screen column at which the character `at` of the row is drawn. */
+int editorRowColumn(struct fileState *f, erow *row, int at)
+{
+    colstop *stop = row->cols;
+    int lo = 1, hi, len;
+
+    if (stop == NULL)
+        return at;
+
+    /* Find the last of the stops before `at`. */
+    hi = stop[0].at;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (stop[mid].at < at)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    if (hi == 0)
+        return at;
+
+    int width = editorCharWidth(f, row, stop[hi].at, stop[hi].col, &len);
+
+    /* Within a multi-byte character we're at its start. */
+    if (at < stop[hi].at + len)
+        return stop[hi].col;
+
+    return stop[hi].col + (width < 0 ? 1 : width) + at - (stop[hi].at + len);
+}
+
+/* The start of the character which the offset `at` of the row is within,
+ * which is `at` unless it is in the middle of a multi-byte character. */
+int editorRowCharStart(struct fileState *f, erow *row, int at)
+{
+    int cp;
+
+    editorRowWarm(f, row);
+
+    for (int back = 1; back < 4 && at - back >= 0 && at < row->size; back++)
+    {
+        unsigned char c = row->chars[at - back + 1];
+
+        if ((c & 0xC0) != 0x80)
+            break;
+
+        if (utf8_decode(row->chars + at - back, row->size - at + back, &cp) > back)
+            return at - back;
+    }
+
+    return at;
+}
+
+/* The offset of the character following the one at `at`. */
+int editorRowNext(struct fileState *f, erow *row, int at)
+{
+    int cp;
+
+    editorRowWarm(f, row);
+
+    if (at >= row->size)
+        return at + 1;
+
+    return at + utf8_decode(row->chars + at, row->size - at, &cp);
+}
+
+/* The offset of the character before the one at `at`. */
+int editorRowPrev(struct fileState *f, erow *row, int at)
+{
+    if (at <= 0)
+        return 0;
+
+    if (at > row->size)
+        return at - 1;
+
+    return editorRowCharStart(f, row, at - 1);
+}
+
+/* Insert a row at the specified position, shifting the other rows on the bottom
+ * if required. */
+void editorInsertRow(struct fileState *f, int at, char *s, size_t len)
+{
+    if (at > f->numrows) return;
+
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len + 1);
+    editorInsertRowChars(f, at, chars, len, 0);
+}
+
+/* Insert a row at the specified position, taking ownership of `chars`,
+ * which was allocated from the buffer's arena if `arena` is set. */
+void editorInsertRowChars(struct fileState *f, int at, char *chars, size_t len, int arena)
+{
+    if (at > f->numrows) return;
+
+    stats_start(&E.stats, STAT_MUTATE);
+
+    editorColdInsert(f, at);
+    f->row = realloc(f->row, sizeof(erow) * (f->numrows + 1));
+
+    if (at != f->numrows)
+    {
+        memmove(f->row + at + 1, f->row + at, sizeof(f->row[0]) * (f->numrows - at));
+
+        for (int j = at + 1; j <= f->numrows; j++) f->row[j].idx++;
+    }
+
+    f->row[at].size = len;
+    f->row[at].chars = chars;
+    f->row[at].arena = arena;
+    f->row[at].cold = 0;
+    f->row[at].hl = NULL;
+    f->row[at].nhl = 0;
+    f->row[at].hl_oc = 0;
+    f->row[at].cols = NULL;
+    f->row[at].giant = NULL;
+    f->row[at].idx = at;
+    editorWrapInsert(f, at);
+    editorUpdateRow(f, f->row + at);
+    f->numrows++;
+    f->dirty++;
+
+    stats_stop(&E.stats, STAT_MUTATE);
+}
+
+/* Free row's heap allocated stuff. */
+void editorFreeRow(erow *row)
+{
+    free(row->cols);
+    free(row->hl);
+    editorGiantFree(row);
+
+    /* Text in the arena is freed along with the buffer. */
+    if (!row->arena)
+        free(row->chars);
+
+    row->arena = 0;
+
+    /* Sanity-check - ensure we're not dereferenced / used */
+    row->chars  = NULL;
+    row->cols   = NULL;
+    row->hl     = NULL;
+    row->nhl    = 0;
+    row->size   = 0;
+}
+
+/* Ensure the row's text is our own, and not held in the buffer's arena,
+ * so that it may be reallocated. */
+void editorRowOwnChars(erow *row)
+{
+    if (!row->arena)
+        return;
+
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+    row->arena = 0;
+}
+
+/* Remove the row at the specified position, shifting the remaining on the
+ * top. */
+void editorDelRow(struct fileState *f, int at)
+{
+    erow *row;
+
+    if (at >= f->numrows) return;
+
+    stats_start(&E.stats, STAT_MUTATE);
+
+    editorColdDelete(f, at);
+    editorWrapDelete(f, at);
+    row = f->row + at;
+    editorFreeRow(row);
+    memmove(f->row + at, f->row + at + 1, sizeof(f->row[0]) * (f->numrows - at - 1));
+    f->version++;
+
+    for (int j = at; j < f->numrows - 1; j++)
+        f->row[j].idx--;
+
+    f->numrows--;
+    f->dirty++;
+
+    stats_stop(&E.stats, STAT_MUTATE);
+}
+
+/* Turn the editor rows into a single heap-allocated string.
+ * Returns the pointer to the heap-allocated string and populate the
+ * integer pointed by 'buflen' with the size of the string, excluding
+ * the final nulterm. */
+char *editorRowsToString(struct fileState *f, int *buflen)
+{
+    char *buf = NULL, *p;
+    int totlen = 0;
+    int j;
+
+    /* Compute count of bytes */
+    for (j = 0; j < f->numrows; j++)
+        totlen += f->row[j].size + 1 + f->crlf; /* +1 is for "\n" at end of every row */
+
+    *buflen = totlen;
+    totlen++; /* Also make space for nulterm */
+
+    p = buf = malloc(totlen);
+
+    for (j = 0; j < f->numrows; j++)
+    {
+        editorRowWarm(f, &f->row[j]);
+        memcpy(p, f->row[j].chars, f->row[j].size);
+        p += f->row[j].size;
+
+        if (f->crlf)
+            *p++ = '\r';
+
+        *p = '\n';
+        p++;
+    }
+
+    *p = '\0';
+    return buf;
+}
+
+/* Insert a character at the specified position in a row, moving the remaining
+ * chars on the right if needed. */
+void editorRowInsertChar(struct fileState *f, erow *row, int at, int c)
+{
+    stats_start(&E.stats, STAT_MUTATE);
+    editorRowWarm(f, row);
+    editorRowOwnChars(row);
+
+    int size = row->size;
+
+    if (at > row->size)
+    {
+        /* Pad the string with spaces if the insert location is outside the
+         * current length by more than a single character. */
+        int padlen = at - row->size;
+        /* In the next line +2 means: new char and null term. */
+        row->chars = realloc(row->chars, row->size + padlen + 2);
+        memset(row->chars + row->size, ' ', padlen);
+        row->chars[row->size + padlen + 1] = '\0';
+        row->size += padlen + 1;
+    }
+    else
+    {
+        /* If we are in the middle of the string just make space for 1 new
+         * char plus the (already existing) null term. */
+        row->chars = realloc(row->chars, row->size + 2);
+        memmove(row->chars + at + 1, row->chars + at, row->size - at + 1);
+        row->size++;
+    }
+
+    row->chars[at] = c;
+    editorUpdateRowEdit(f, row, at < size ? at : size, row->size - size);
+    f->dirty++;
+
+    stats_stop(&E.stats, STAT_MUTATE);
+}
+
+/* Append the string 's' at the end of a row */
+void editorRowAppendString(struct fileState *f, erow *row, char *s, size_t len)
+{
+    stats_start(&E.stats, STAT_MUTATE);
+    editorRowWarm(f, row);
+    editorRowOwnChars(row);
+
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(row->chars + row->size, s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRowEdit(f, row, row->size - (int)len, (int)len);
+    f->dirty++;
+
+    stats_stop(&E.stats, STAT_MUTATE);
+}
+
+/* Delete the character at offset 'at' from the specified row. */
+void editorRowDelChar(struct fileState *f, erow *row, int at)
+{
+    if (row->size <= at)
+        return;
+
+    if (at < 0)
+        return;
+
+    stats_start(&E.stats, STAT_MUTATE);
+    editorRowWarm(f, row);
+
+    /*
+     * Record the character we're deleting - and where we were
+     * before we deleted it.
+     */
+#ifdef _UNDO
+    int x = f->coloff + f->cx;
+    int y = f->rowoff + f->cy;
+
+
+    if (row->size >= at)
+        add_undo(f->undo, INSERT, row->chars[at], x, y);
+
+#endif
+
+    editorRowOwnChars(row);
+    memmove(row->chars + at, row->chars + at + 1, row->size - at);
+    row->size--;
+    editorUpdateRowEdit(f, row, at, -1);
+    f->dirty++;
+
+    stats_stop(&E.stats, STAT_MUTATE);
+}
+
+/* Insert the specified char at the current prompt position. */
+void editorInsertChar(int c)
+{
+    if (E.file[E.current_file]->hex)
+    {
+        editorHexType(E.file[E.current_file], c);
+        return;
+    }
+
+    if (c == '\n')
+    {
+        editorInsertNewline();
+        return;
+    }
+
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    /* If the row where the cursor is currently located does not exist in our
+     * logical representation of the file, add enough empty rows as needed. */
+    if (!row)
+    {
+        while (E.file[E.current_file]->numrows <= filerow)
+            editorInsertRow(E.file[E.current_file], E.file[E.current_file]->numrows, "", 0);
+    }
+
+    row = &E.file[E.current_file]->row[filerow];
+    editorRowInsertChar(E.file[E.current_file], row, filecol, c);
+
+    if (E.file[E.current_file]->cx == E.screencols - 1)
+        E.file[E.current_file]->coloff++;
+    else
+        E.file[E.current_file]->cx++;
+
+    E.file[E.current_file]->dirty++;
+}
+
+/* Inserting a newline is slightly complex as we have to handle inserting a
+ * newline in the middle of a line, splitting the line as needed. */
+void editorInsertNewline(void)
+{
+    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
+    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+
+    if (!row)
+    {
+        if (filerow == E.file[E.current_file]->numrows)
+        {
+            editorInsertRow(E.file[E.current_file], filerow, "", 0);
+            goto fixcursor;
+        }
+
+        return;
+    }
+
+    /* If the cursor is over the current line size, we want to conceptually
+     * think it's just over the last character. */
+    if (filecol >= row->size) filecol = row->size;
+
+    if (filecol == 0)
+    {
+        editorInsertRow(E.file[E.current_file], filerow, "", 0);
+    }
+    else
+    {
+        /* We are in the middle of a line. Split it between two rows. */
+        editorRowWarm(E.file[E.current_file], row);
+        editorInsertRow(E.file[E.current_file], filerow + 1, row->chars + filecol, row->size - filecol);
+        row = &E.file[E.current_file]->row[filerow];
+        editorRowOwnChars(row);
+        row->chars[filecol] = '\0';
+        row->size = filecol;
+        editorUpdateRow(E.file[E.current_file], row);
+    }
+
+fixcursor:
+
+    if (E.file[E.current_file]->cy == E.screenrows - 1)
+    {
+        E.file[E.current_file]->rowoff++;
+    }
+    else
+    {
+        E.file[E.current_file]->cy++;
+    }
+
+    E.file[E.current_file]->cx = 0;
+    E.file[E.current_file]->coloff = 0;
+}
+
+
+
+/* ============================= Wrapped lines ============================= */
+
+/*
+ * When E.wrap is set long lines are wrapped onto as many lines of the
+ * screen as they need, rather than scrolled horizontally.  A row breaks
+ * before the first character which won't fit, so wide characters are
+ * never split, and a TAB is cut short at the edge of the screen.
+ *
+ * Rows of printable ASCII are wrapped by arithmetic alone; other rows are
+ * walked, a character at a time.  The buffer keeps an index of the lines
+ * each row takes, to map between rows and lines of the screen.
+ */
+
+/* Are the long lines of the given buffer wrapped? */
+int editorWrapping(struct fileState *f)
+{
+    return E.wrap && f->hex == NULL;
+}
+
+/* The end of the line of the screen which starts at `at` of the row, when
+ * it is wrapped to `width` columns. */
+int editorWrapEnd(struct fileState *f, erow *row, int at, int width)
+{
+    if (row->cols == NULL)
+        return at + width < row->size ? at + width : row->size;
+
+    editorRowWarm(f, row);
+
+    int rx = editorRowColumn(f, row, at);
+    int x = 0, n;
+
+    for (; at < row->size; at += n)
+    {
+        int w = editorCharWidth(f, row, at, rx, &n);
+
+        if (w < 0)
+            w = 1;
+
+        rx += w;
+
+        /* A TAB is drawn up to the edge, if it won't fit. */
+        if (row->chars[at] == TAB && x < width && x + w > width)
+            w = width - x;
+
+        if (x + w > width && x > 0)
+            break;
+
+        x += w;
+    }
+
+    return at;
+}
+
+/* The number of lines of the screen the row takes. */
+int editorWrapLines(struct fileState *f, erow *row, int width)
+{
+    if (row->cols == NULL)
+        return row->size ? (row->size + width - 1) / width : 1;
+
+    int lines = 1;
+
+    for (int at = editorWrapEnd(f, row, 0, width); at < row->size; at = editorWrapEnd(f, row, at, width))
+        lines++;
+
+    return lines;
+}
+
+/* The offset at which the given line of the row starts, or its last line
+ * if it has fewer. */
+int editorWrapStart(struct fileState *f, erow *row, int seg, int width)
+{
+    if (row->cols == NULL)
+    {
+        int last = row->size ? (row->size - 1) / width : 0;
+        return (seg < last ? seg : last) * width;
+    }
+
+    int at = 0;
+
+    while (seg-- > 0)
+    {
+        int end = editorWrapEnd(f, row, at, width);
+
+        if (end >= row->size)
+            break;
+
+        at = end;
+    }
+
+    return at;
+}
+
+/* The line of the row which the offset `at` is on, whose start is stored
+ * in `start`.  The end of the row is on its last line. */
+int editorWrapSegment(struct fileState *f, erow *row, int at, int width, int *start)
+{
+    int seg = 0;
+
+    if (row->cols == NULL)
+    {
+        seg = at < row->size ? at / width : (row->size ? (row->size - 1) / width : 0);
+        *start = seg * width;
+        return seg;
+    }
 
-/* ======================= Editor rows implementation ======================= */
+    *start = 0;
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editorUpdateRow(erow *row)
-{
-    int tabs = 0, j, idx;
+    for (;;)
+    {
+        int end = editorWrapEnd(f, row, *start, width);
 
-    /* Create a version of the row we can directly print on the screen,
-      * respecting tabs, substituting non printable characters with '?'. */
-    free(row->render);
+        if (at < end || end >= row->size)
+            return seg;
 
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == TAB)
-            tabs++;
+        *start = end;
+        seg++;
+    }
+}
 
-    row->render = malloc(row->size + (tabs * (E.file[E.current_file]->tab_size)) + 1);
-    idx = 0;
+/* The offset of the character drawn at column `x` of the line of the row
+ * which starts at `start`, or of its last character if it is shorter. */
+int editorWrapColumn(struct fileState *f, erow *row, int start, int width, int x)
+{
+    int end = editorWrapEnd(f, row, start, width);
+    int at = start;
 
-    for (j = 0; j < row->size; j++)
+    if (row->cols == NULL)
+        at = start + x;
+    else
     {
-        if (row->chars[j] == TAB)
-        {
-            row->render[idx++] = ' ';
+        int rx = editorRowColumn(f, row, start);
+        int col = 0, n;
 
-            while ((idx + 1) % (E.file[E.current_file]->tab_size) != 0)
-                row->render[idx++] = ' ';
-        }
-        else
+        for (; at < end; at += n)
         {
-            row->render[idx++] = row->chars[j];
+            int w = editorCharWidth(f, row, at, rx + col, &n);
+
+            if (col + (w < 0 ? 1 : w) > x)
+                break;
+
+            col += w < 0 ? 1 : w;
         }
     }
 
-    row->rsize = idx;
-    row->render[idx] = '\0';
+    /* Only the last line has room for the cursor after its end. */
+    if (end < row->size && at >= end)
+        at = editorRowPrev(f, row, end);
 
-    /* Update the syntax highlighting attributes of the row. */
-    editorUpdateSyntax(row);
+    return at < end ? at : end;
 }
 
-/* Insert a row at the specified position, shifting the other rows on the bottom
- * if required. */
-void editorInsertRow(int at, char *s, size_t len)
+/* Build the tree of the counts of lines, in O(n). */
+void editorWrapTree(struct editorWrapIndex *x)
 {
-    if (at > E.file[E.current_file]->numrows) return;
+    for (int i = 1; i <= x->count; i++)
+        x->tree[i] = x->lines[i - 1];
 
-    E.file[E.current_file]->row = realloc(E.file[E.current_file]->row, sizeof(erow) * (E.file[E.current_file]->numrows + 1));
-
-    if (at != E.file[E.current_file]->numrows)
+    for (int i = 1; i <= x->count; i++)
     {
-        memmove(E.file[E.current_file]->row + at + 1, E.file[E.current_file]->row + at, sizeof(E.file[E.current_file]->row[0]) * (E.file[E.current_file]->numrows - at));
+        int j = i + (i & -i);
 
-        for (int j = at + 1; j <= E.file[E.current_file]->numrows; j++) E.file[E.current_file]->row[j].idx++;
+        if (j <= x->count)
+            x->tree[j] += x->tree[i];
     }
+}
 
-    E.file[E.current_file]->row[at].size = len;
-    E.file[E.current_file]->row[at].chars = malloc(len + 1);
-    memcpy(E.file[E.current_file]->row[at].chars, s, len + 1);
-    E.file[E.current_file]->row[at].hl = NULL;
-    E.file[E.current_file]->row[at].hl_oc = 0;
-    E.file[E.current_file]->row[at].render = NULL;
-    E.file[E.current_file]->row[at].rsize = 0;
-    E.file[E.current_file]->row[at].idx = at;
-    editorUpdateRow(E.file[E.current_file]->row + at);
-    E.file[E.current_file]->numrows++;
-    E.file[E.current_file]->dirty++;
+/* Count the lines each row of the buffer takes, at the given width. */
+void editorWrapBuild(struct fileState *f, int width)
+{
+    struct editorWrapIndex *x = f->wrap;
+
+    if (x == NULL)
+        x = f->wrap = calloc(1, sizeof(struct editorWrapIndex));
+
+    if (x->room < f->numrows + 1)
+    {
+        x->room = f->numrows + 1;
+        x->lines = realloc(x->lines, sizeof(int) * x->room);
+        x->tree = realloc(x->tree, sizeof(int64_t) * (x->room + 1));
+    }
+
+    x->width = width;
+    x->count = f->numrows;
+
+    for (int i = 0; i < f->numrows; i++)
+        x->lines[i] = editorWrapLines(f, &f->row[i], width);
+
+    editorWrapTree(x);
 }
 
-/* Free row's heap allocated stuff. */
-void editorFreeRow(erow *row)
+/* Make sure the index of the buffer matches its rows, and the width. */
+void editorWrapCheck(struct fileState *f, int width)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    if (width < 1)
+        width = 1;
 
-    /* Sanity-check - ensure we're not dereferenced / used */
-    row->render = NULL;
-    row->chars  = NULL;
-    row->hl     = NULL;
-    row->size   = 0;
-    row->rsize  = 0;
+    if (f->wrap == NULL || f->wrap->width != width || f->wrap->count != f->numrows)
+        editorWrapBuild(f, width);
 }
 
-/* Remove the row at the specified position, shifting the remaining on the
- * top. */
-void editorDelRow(int at)
+/* Forget the index of the buffer, once its rows have been replaced. */
+void editorWrapFree(struct fileState *f)
 {
-    erow *row;
+    if (f->wrap == NULL)
+        return;
 
-    if (at >= E.file[E.current_file]->numrows) return;
+    free(f->wrap->lines);
+    free(f->wrap->tree);
+    free(f->wrap);
+    f->wrap = NULL;
+}
 
-    row = E.file[E.current_file]->row + at;
-    editorFreeRow(row);
-    memmove(E.file[E.current_file]->row + at, E.file[E.current_file]->row + at + 1, sizeof(E.file[E.current_file]->row[0]) * (E.file[E.current_file]->numrows - at - 1));
+/* Count the lines of a row again, once it has changed. */
+void editorWrapUpdate(struct fileState *f, erow *row)
+{
+    struct editorWrapIndex *x = f->wrap;
+
+    if (row->idx >= x->count)
+        return;
 
-    for (int j = at; j < E.file[E.current_file]->numrows - 1; j++)
-        E.file[E.current_file]->row[j].idx--;
+    int lines = editorWrapLines(f, row, x->width);
+    int delta = lines - x->lines[row->idx];
 
-    E.file[E.current_file]->numrows--;
-    E.file[E.current_file]->dirty++;
+    x->lines[row->idx] = lines;
+
+    for (int i = row->idx + 1; delta && i <= x->count; i += i & -i)
+        x->tree[i] += delta;
 }
 
-/* Turn the editor rows into a single heap-allocated string.
- * Returns the pointer to the heap-allocated string and populate the
- * integer pointed by 'buflen' with the size of the string, excluding
- * the final nulterm. */
-char *editorRowsToString(int *buflen)
+/* Make room in the index for a row inserted at `at`, which is counted
+ * when it is updated.  Rows added at the end cost O(log n). */
+void editorWrapInsert(struct fileState *f, int at)
 {
-    char *buf = NULL, *p;
-    int totlen = 0;
-    int j;
-
-    /* Compute count of bytes */
-    for (j = 0; j < E.file[E.current_file]->numrows; j++)
-        totlen += E.file[E.current_file]->row[j].size + 1; /* +1 is for "\n" at end of every row */
+    struct editorWrapIndex *x = f->wrap;
 
-    *buflen = totlen;
-    totlen++; /* Also make space for nulterm */
+    if (x == NULL)
+        return;
 
-    p = buf = malloc(totlen);
+    if (x->count != f->numrows)
+    {
+        editorWrapFree(f);
+        return;
+    }
 
-    for (j = 0; j < E.file[E.current_file]->numrows; j++)
+    if (x->count + 1 >= x->room)
     {
-        memcpy(p, E.file[E.current_file]->row[j].chars, E.file[E.current_file]->row[j].size);
-        p += E.file[E.current_file]->row[j].size;
-        *p = '\n';
-        p++;
+        x->room = x->room * 2 + 16;
+        x->lines = realloc(x->lines, sizeof(int) * x->room);
+        x->tree = realloc(x->tree, sizeof(int64_t) * (x->room + 1));
     }
 
-    *p = '\0';
-    return buf;
-}
+    memmove(x->lines + at + 1, x->lines + at, sizeof(int) * (x->count - at));
+    x->lines[at] = 0;
+    x->count++;
 
-/* Insert a character at the specified position in a row, moving the remaining
- * chars on the right if needed. */
-void editorRowInsertChar(erow *row, int at, int c)
-{
-    if (at > row->size)
+    if (at == x->count - 1)
     {
-        /* Pad the string with spaces if the insert location is outside the
-         * current length by more than a single character. */
-        int padlen = at - row->size;
-        /* In the next line +2 means: new char and null term. */
-        row->chars = realloc(row->chars, row->size + padlen + 2);
-        memset(row->chars + row->size, ' ', padlen);
-        row->chars[row->size + padlen + 1] = '\0';
-        row->size += padlen + 1;
+        /* The node of the new row sums the rows it covers. */
+        int i = x->count;
+        x->tree[i] = editorWrapLine(x, i - 1) - editorWrapLine(x, i - (i & -i));
     }
     else
+        editorWrapTree(x);
+}
+
+/* Remove the row at `at` from the index. */
+void editorWrapDelete(struct fileState *f, int at)
+{
+    struct editorWrapIndex *x = f->wrap;
+
+    if (x == NULL)
+        return;
+
+    if (x->count != f->numrows)
     {
-        /* If we are in the middle of the string just make space for 1 new
-         * char plus the (already existing) null term. */
-        row->chars = realloc(row->chars, row->size + 2);
-        memmove(row->chars + at + 1, row->chars + at, row->size - at + 1);
-        row->size++;
+        editorWrapFree(f);
+        return;
     }
 
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.file[E.current_file]->dirty++;
-}
+    memmove(x->lines + at, x->lines + at + 1, sizeof(int) * (x->count - at - 1));
+    x->count--;
 
-/* Append the string 's' at the end of a row */
-void editorRowAppendString(erow *row, char *s, size_t len)
-{
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(row->chars + row->size, s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.file[E.current_file]->dirty++;
+    /* The nodes before the last row don't include it. */
+    if (at != x->count)
+        editorWrapTree(x);
 }
 
-/* Delete the character at offset 'at' from the specified row. */
-void editorRowDelChar(erow *row, int at)
+/* The line of the screen, counting from the first row, on which the given
+ * row starts. */
+int64_t editorWrapLine(struct editorWrapIndex *x, int row)
 {
-    if (row->size <= at)
-        return;
+    int64_t line = 0;
 
-    if (at < 0)
-        return;
+    for (int i = row; i > 0; i -= i & -i)
+        line += x->tree[i];
 
-    /*
-     * Record the character we're deleting - and where we were
-     * before we deleted it.
-     */
-#ifdef _UNDO
-    int x = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-    int y = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    return line;
+}
 
+/* The row on the given line of the screen, whose first line is stored in
+ * `first`.  Lines beyond the end are on the last row. */
+int editorWrapFind(struct editorWrapIndex *x, int64_t line, int64_t *first)
+{
+    int step = 1, row = 0;
+    int64_t sum = 0;
 
-    if (row->rsize >= at)
-        add_undo(E.file[E.current_file]->undo, INSERT, row->render[at], x, y);
+    while (step * 2 <= x->count)
+        step *= 2;
 
-#endif
+    for (; step > 0; step /= 2)
+    {
+        if (row + step <= x->count && sum + x->tree[row + step] <= line)
+        {
+            row += step;
+            sum += x->tree[row];
+        }
+    }
 
-    memmove(row->chars + at, row->chars + at + 1, row->size - at);
-    editorUpdateRow(row);
-    row->size--;
-    E.file[E.current_file]->dirty++;
+    if (row >= x->count && row > 0)
+    {
+        row--;
+        sum -= x->lines[row];
+    }
+
+    *first = sum;
+    return row;
 }
 
-/* Insert the specified char at the current prompt position. */
-void editorInsertChar(int c)
+/* Scroll the view of the buffer, by lines of the screen, so that the
+ * cursor is on one of the first `rows` of them. */
+void editorWrapScroll(struct fileState *f, int rows, int width)
 {
-    if (c == '\n')
+    editorWrapCheck(f, width);
+
+    if (f->numrows == 0)
     {
-        editorInsertNewline();
+        f->rowoff = f->cy = f->wrapoff = 0;
         return;
     }
 
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+    struct editorWrapIndex *x = f->wrap;
+    int cursor = f->rowoff + f->cy;
+    int filerow = cursor;
+    int start;
 
-    /* If the row where the cursor is currently located does not exist in our
-     * logical representation of the file, add enough empty rows as needed. */
-    if (!row)
+    if (filerow >= f->numrows)
+        filerow = f->numrows - 1;
+
+    if (f->rowoff >= f->numrows)
+        f->rowoff = f->numrows - 1;
+
+    if (f->wrapoff >= x->lines[f->rowoff])
+        f->wrapoff = x->lines[f->rowoff] - 1;
+
+    int64_t top = editorWrapLine(x, f->rowoff) + f->wrapoff;
+    int64_t line = editorWrapLine(x, filerow) +
+                   editorWrapSegment(f, &f->row[filerow], f->coloff + f->cx, x->width, &start);
+    int64_t first;
+
+    if (line < top)
+        top = line;
+    else if (line >= top + rows)
+        top = line - rows + 1;
+
+    f->rowoff = editorWrapFind(x, top, &first);
+    f->wrapoff = top - first;
+    f->cy = cursor - f->rowoff;
+}
+
+/* Move the cursor a character, or a line of the screen. */
+void editorWrapMove(struct fileState *f, int key)
+{
+    int filerow = f->rowoff + f->cy;
+    int at = f->coloff + f->cx;
+    erow *row = (filerow >= f->numrows) ? NULL : &f->row[filerow];
+
+    editorWrapCheck(f, E.screencols);
+
+    switch (key)
     {
-        while (E.file[E.current_file]->numrows <= filerow)
-            editorInsertRow(E.file[E.current_file]->numrows, "", 0);
+    case ARROW_LEFT:
+        if (at > 0)
+            at = row ? editorRowPrev(f, row, at) : at - 1;
+        else if (filerow > 0)
+        {
+            filerow--;
+            at = f->row[filerow].size;
+        }
+
+        break;
+
+    case ARROW_RIGHT:
+        if (row && at < row->size)
+            at = editorRowNext(f, row, at);
+        else if (filerow + 1 < f->numrows)
+        {
+            filerow++;
+            at = 0;
+        }
+
+        break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+        if (row)
+        {
+            /*
+             * Keep the column of the cursor, on the line above or below.
+             */
+            struct editorWrapIndex *x = f->wrap;
+            int start, seg = editorWrapSegment(f, row, at, x->width, &start);
+            int col = editorRowColumn(f, row, at) - editorRowColumn(f, row, start);
+            int64_t line = editorWrapLine(x, filerow) + seg + (key == ARROW_UP ? -1 : 1);
+            int64_t first;
+
+            if (line < 0 || line >= editorWrapLine(x, x->count))
+                break;
+
+            filerow = editorWrapFind(x, line, &first);
+            row = &f->row[filerow];
+            start = editorWrapStart(f, row, line - first, x->width);
+            at = editorWrapColumn(f, row, start, x->width, col);
+        }
+
+        break;
     }
 
-    row = &E.file[E.current_file]->row[filerow];
-    editorRowInsertChar(row, filecol, c);
+    f->cx = at;
+    f->coloff = 0;
+    f->cy = filerow - f->rowoff;
 
-    if (E.file[E.current_file]->cx == E.screencols - 1)
-        E.file[E.current_file]->coloff++;
-    else
-        E.file[E.current_file]->cx++;
+    editorWrapScroll(f, E.screenrows, E.screencols);
+}
 
-    E.file[E.current_file]->dirty++;
+
+
+/* ============================= Append Buffer ============================ */
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    char *new = realloc(ab->b, ab->len + len);
+
+    if (new == NULL) return;
+
+    memcpy(new + ab->len, s, len);
+    ab->b = new;
+    ab->len += len;
 }
 
-/* Inserting a newline is slightly complex as we have to handle inserting a
- * newline in the middle of a line, splitting the line as needed. */
-void editorInsertNewline(void)
+void abFree(struct abuf *ab)
 {
-    int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
-    int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-    erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
+    free(ab->b);
+}
 
-    if (!row)
+
+
+/* ============================= Terminal update ============================ */
+
+/* Append a run of `len` characters of a row, which are all drawn in the
+ * same way, changing colour only if we must. */
+void editorDrawRun(struct abuf *ab, int color, char *text, int len, int *current)
+{
+    char buf[16];
+
+    if (len == 0)
+        return;
+
+    switch (color)
     {
-        if (filerow == E.file[E.current_file]->numrows)
+    case HL_NORMAL:
+        if (*current != -1)
         {
-            editorInsertRow(filerow, "", 0);
-            goto fixcursor;
+            abAppend(ab, "\x1b[39m", 5);
+            *current = -1;
         }
 
-        return;
+        abAppend(ab, text, len);
+        break;
+
+    case HL_NONPRINT:
+        /*
+         * Show non-printable characters as `?` on red.
+         */
+        abAppend(ab, "\x1b[41m", 5);
+        abAppend(ab, text, len);
+        abAppend(ab, "\x1b[49m", 5);
+        break;
+
+    case HL_SELECTION:
+        /*
+         * Show the mark in inverse white.
+         */
+        abAppend(ab, "\x1b[47m", 5);
+        abAppend(ab, text, len);
+        abAppend(ab, "\x1b[49m", 5);
+        break;
+
+    default:
+        color = editorSyntaxToColor(color);
+
+        if (color != *current)
+        {
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            abAppend(ab, buf, clen);
+            *current = color;
+        }
+
+        abAppend(ab, text, len);
+        break;
     }
+}
 
-    /* If the cursor is over the current line size, we want to conceptually
-     * think it's just over the last character. */
-    if (filecol >= row->size) filecol = row->size;
+/* Clear the remainder of a line of window `w`, of which we've drawn `used`
+ * columns, without disturbing any window to our right. */
+void editorClearLine(struct abuf *ab, struct editorWindow *w, int used)
+{
+    int rest = w->width - used;
 
-    if (filecol == 0)
+    if (w->left + w->width == E.termcols)
+    {
+        abAppend(ab, "\x1b[0K", 4);
+    }
+    else if (rest > 6)
     {
-        editorInsertRow(filerow, "", 0);
+        /* Erase the characters, leaving the cursor where it is. */
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%dX", rest);
+        abAppend(ab, buf, len);
     }
     else
     {
-        /* We are in the middle of a line. Split it between two rows. */
-        editorInsertRow(filerow + 1, row->chars + filecol, row->size - filecol);
-        row = &E.file[E.current_file]->row[filerow];
-        row->chars[filecol] = '\0';
-        row->size = filecol;
-        editorUpdateRow(row);
+        while (rest-- > 0)
+            abAppend(ab, " ", 1);
     }
+}
 
-fixcursor:
+/* Draw the characters of the row `filerow` from the offset `from` up to
+ * `to`, or the edge of the window `w`, returning the columns used. */
+int editorDrawRow(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v,
+                  int filerow, int from, int to)
+{
+    erow *r = &f->row[filerow];
+    editorRowWarm(f, r);
 
-    if (E.file[E.current_file]->cy == E.screenrows - 1)
-    {
-        E.file[E.current_file]->rowoff++;
-    }
-    else
+    /*
+     * The characters of the row are drawn in runs of the same
+     * colour, which is the selection, if they're in it, then the
+     * current search-match, then their syntax highlighting.
+     */
+    static char *text = NULL;
+    static int room = 0;
+
+    int sel_from, sel_to;
+    editorRowSelection(f, v, filerow, &sel_from, &sel_to);
+
+    /* Giant rows are highlighted around what we draw of them. */
+    if (r->giant && f->syntax)
+        editorGiantHighlight(f, r, from, to - from > w->width * 4 ? from + w->width * 4 : to);
+
+    hlspan *span = r->hl, *last = r->hl + r->nhl;
+    int start = span ? span->skip : 0;
+    int rx = editorRowColumn(f, r, from);
+    int current_color = -1;
+    int color = HL_NORMAL, run = HL_NORMAL, len = 0;
+    int used = 0;
+
+    for (int j = from, n; j < to && used < w->width; j += n)
     {
-        E.file[E.current_file]->cy++;
-    }
+        unsigned char c = r->chars[j];
+        int width = 1;
 
-    E.file[E.current_file]->cx = 0;
-    E.file[E.current_file]->coloff = 0;
-}
+        n = 1;
 
+        if (c < ' ' || c >= 0x7F)
+            width = editorCharWidth(f, r, j, rx, &n);
 
+        while (span < last && start + span->len <= j)
+        {
+            start += span->len;
 
-/* ============================= Append Buffer ============================ */
+            if (++span < last)
+                start += span->skip;
+        }
 
-void abAppend(struct abuf *ab, const char *s, int len)
-{
-    char *new = realloc(ab->b, ab->len + len);
+        if (j >= sel_from && j < sel_to)
+            color = HL_SELECTION;
+        else if (filerow == f->matchy && f->matchlen &&
+                 j >= f->matchx && j < f->matchx + f->matchlen)
+            color = HL_MATCH;
+        else if (width < 0)
+            color = HL_NONPRINT;
+        else if (span < last && j >= start)
+            color = span->type;
+        else
+            color = HL_NORMAL;
 
-    if (new == NULL) return;
+        if (color != run)
+        {
+            editorDrawRun(ab, run, text, len, &current_color);
+            run = color;
+            len = 0;
+        }
 
-    memcpy(new + ab->len, s, len);
-    ab->b = new;
-    ab->len += len;
-}
+        if (len + n + w->width > room)
+        {
+            room = (len + n + w->width) * 2;
+            text = realloc(text, room);
+        }
 
-void abFree(struct abuf *ab)
-{
-    free(ab->b);
-}
+        /*
+         * TABs are drawn as spaces, up to the next tab-stop, and
+         * characters we can't print as a `?`.  Wide characters which
+         * don't fit on the line are drawn as a space, and combining
+         * characters at its start, which have nothing to combine
+         * with, aren't drawn.
+         */
+        if (c == TAB || (width == 2 && used + 2 > w->width))
+        {
+            if (width > w->width - used)
+                width = w->width - used;
+
+            memset(text + len, ' ', width);
+            len += width;
+        }
+        else if (width < 0)
+        {
+            text[len++] = '?';
+            width = 1;
+        }
+        else if (width > 0 || used > 0)
+        {
+            memcpy(text + len, r->chars + j, n);
+            len += n;
+        }
 
+        used += width;
+        rx += width;
+    }
 
+    editorDrawRun(ab, run, text, len, &current_color);
 
-/* ============================= Terminal update ============================ */
+    abAppend(ab, "\x1b[39m", 5);
+    return used;
+}
 
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(void)
+/* Draw the rows of the buffer `f`, as seen through the view `v`, into the
+ * text-area of the window `w`. */
+void editorDrawRows(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v)
 {
     int y;
     erow *r;
     char buf[32];
-    struct abuf ab = ABUF_INIT;
 
-    abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
-    abAppend(&ab, "\x1b[H", 3); /* Go home. */
+    /*
+     * The row we're drawing, and where its next line starts, if we're
+     * wrapping long lines.
+     */
+    int filerow = v->rowoff;
+    int from = 0;
+
+    if (editorWrapping(f) && filerow < f->numrows)
+        from = editorWrapStart(f, &f->row[filerow], v->wrapoff, w->width);
 
     /*
      * The number of lines we've drawn of the welcome-message, if any.
      */
     int drawn = 0;
 
-    for (y = 0; y < E.screenrows; y++)
+    for (y = 0; y < w->height - 1; y++)
     {
-        int filerow = E.file[E.current_file]->rowoff + y;
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", w->top + y + 1, w->left + 1);
+        abAppend(ab, buf, strlen(buf));
 
-        if (filerow >= E.file[E.current_file]->numrows)
+        if (filerow >= f->numrows)
         {
+            int used = 1;
+            abAppend(ab, "~", 1);
+
             /*
              * If the contents are empty, and we're above the top
-             * third of the screen .. draw the Nth line of the startup
+             * third of the window .. draw the Nth line of the startup
              * banner.
              */
-            if (E.file[E.current_file]->numrows == 0 && (y == (E.screenrows / 3) + drawn) &&
+            if (f->numrows == 0 && (y == ((w->height - 1) / 3) + drawn) &&
                     (drawn < welcome_len))
             {
-                /* open the line, as usual. */
-                abAppend(&ab, "\x1b[2K~ ", 6);
+                int mlen = strlen(welcome_msg[drawn]);
 
-                /* Add the message */
-                abAppend(&ab, welcome_msg[drawn], strlen(welcome_msg[drawn]));
-                drawn += 1;
+                if (mlen > w->width - 2)
+                    mlen = w->width - 2 > 0 ? w->width - 2 : 0;
 
-            }
-            else
-            {
-                abAppend(&ab, "\x1b[2K~\r\n", 7);
+                abAppend(ab, " ", 1);
+                abAppend(ab, welcome_msg[drawn], mlen);
+                used += 1 + mlen;
+                drawn += 1;
             }
 
+            editorClearLine(ab, w, used);
             continue;
         }
 
-        r = &E.file[E.current_file]->row[filerow];
+        r = &f->row[filerow];
+        editorRowWarm(f, r);
 
-        int len = r->rsize - E.file[E.current_file]->coloff;
-        int current_color = -1;
+        int used;
 
-        if (len > 0)
+        if (editorWrapping(f))
         {
-            if (len > E.screencols) len = E.screencols;
+            int to = editorWrapEnd(f, r, from, w->width);
 
-            char *c = r->render + E.file[E.current_file]->coloff;
-            unsigned char *hl = r->hl + E.file[E.current_file]->coloff;
-            int j;
+            used = editorDrawRow(ab, w, f, v, filerow, from, to);
+            from = to;
 
-            for (j = 0; j < len; j++)
+            if (to >= r->size)
             {
+                filerow++;
+                from = 0;
+            }
+        }
+        else
+        {
+            /*
+             * A character which is partly scrolled off the screen is drawn
+             * whole, at its left edge.
+             */
+            used = editorDrawRow(ab, w, f, v, filerow, editorRowCharStart(f, r, v->coloff), r->size);
+            filerow++;
+        }
 
-                int color = hl[j];
+        editorClearLine(ab, w, used);
+    }
+}
 
-                /*
-                 * HACK - draw the selection over
-                 *
-                 * filerow = y;
-                 *  j      = x;
-                 */
-                if ((E.file[E.current_file]->markx != -1) && (E.file[E.current_file]->marky != -1))
-                {
-                    int mx = E.file[E.current_file]->markx;
-                    int my = E.file[E.current_file]->marky;
+/* Find the characters of the row `filerow` which are selected, between
+ * the mark and the cursor of the view `v`, as [from, to). */
+void editorRowSelection(struct fileState *f, struct editorView *v, int filerow, int *from, int *to)
+{
+    int mx = f->markx;
+    int my = f->marky;
 
-                    int cx = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
-                    int cy = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
+    int cx = v->coloff + v->cx;
+    int cy = v->rowoff + v->cy;
 
-                    /* is the cursor above the mark? */
-                    if ((cy > my) || (cx > mx && cy == my))
-                    {
-                        if (cy == my)
-                        {
-                            /*
-                             * Point and mark on same line
-                             */
-                            if ((cy == filerow) && (j >= mx && j < cx))
-                                color = HL_SELECTION;
-                        }
-                        else
-                        {
-                            /*
-                             * Point + mark on different lines.
-                             *
-                             * mark is before point
-                             */
-
-                            /*
-                             * Cover the line containing the mark.
-                             */
-                            if ((filerow == my) && (j >= mx))
-                                color = HL_SELECTION;
-
-                            /*
-                             * Cover the line containing the cursor.
-                             */
-                            if ((filerow == cy) && (j < cx))
-                                color = HL_SELECTION;
-
-                            /*
-                             * Cover the lines in between.
-                             */
-                            if (filerow > my && filerow < cy)
-                                color = HL_SELECTION;
-                        }
-                    }
-                    else
-                    {
-                        /*
-                         * cursor is below the mark.
-                         */
-                        if (cy == my)
-                        {
-                            /*
-                             * Point and mark on same line
-                             */
-                            if ((cy == filerow) && (j <= mx && j >= cx))
-                                color = HL_SELECTION;
-                        }
-                        else
-                        {
-                            /*
-                             * Point + mark on different lines.
-                             *
-                             * mark is after point
-                             */
-
-                            /*
-                             * Cover the line containing the mark.
-                             */
-                            if ((filerow == my) && (j <= mx))
-                                color = HL_SELECTION;
-
-                            /*
-                             * Cover the line containing the cursor.
-                             */
-                            if ((filerow == cy) && (j > cx))
-                                color = HL_SELECTION;
-
-                            /*
-                             * Cover the lines in between.
-                             */
-                            if (filerow > cy && filerow < my)
-                                color = HL_SELECTION;
-                        }
-                    }
-                }
+    *from = *to = 0;
 
-                if (color == HL_NORMAL)
-                {
-                    if (isprint(c[j]))
-                    {
-                        if (current_color != -1)
-                        {
-                            abAppend(&ab, "\x1b[39m", 5);
-                            current_color = -1;
-                        }
+    if (mx == -1 || my == -1)
+        return;
 
-                        abAppend(&ab, c + j, 1);
-                    }
-                    else
-                    {
-                        char buf[16];
-                        sprintf(buf, "\x1b[41m%c\x1b[49m", '?');
-                        abAppend(&ab, buf, strlen(buf));
-                        current_color = -1;
-                    }
-                }
-                else
-                {
-                    if (color == HL_SELECTION)
-                    {
-                        /*
-                         * Show the mark in inverse white.
-                         */
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[47m");
-                        abAppend(&ab, buf, clen);
-
-                        if (isprint(c[j]))
-                            abAppend(&ab, c + j, 1);
-                        else
-                            abAppend(&ab, "?", 1);
-
-                        clen = snprintf(buf, sizeof(buf), "\x1b[49m");
-                        abAppend(&ab, buf, clen);
-                    }
-                    else
-                    {
-                        color = editorSyntaxToColor(color);
+    /* is the cursor above the mark? */
+    if ((cy > my) || (cx > mx && cy == my))
+    {
+        /*
+         * mark is before point.
+         */
+        if (cy == my && filerow == cy)
+        {
+            *from = mx;
+            *to = cx;
+        }
+        else if (cy != my && filerow == my)
+        {
+            *from = mx;
+            *to = INT_MAX;
+        }
+        else if (cy != my && filerow == cy)
+        {
+            *to = cx;
+        }
+        else if (filerow > my && filerow < cy)
+        {
+            *to = INT_MAX;
+        }
+    }
+    else
+    {
+        /*
+         * mark is after point.
+         */
+        if (cy == my && filerow == cy)
+        {
+            *from = cx;
+            *to = mx + 1;
+        }
+        else if (cy != my && filerow == my)
+        {
+            *to = mx + 1;
+        }
+        else if (cy != my && filerow == cy)
+        {
+            *from = cx + 1;
+            *to = INT_MAX;
+        }
+        else if (filerow > cy && filerow < my)
+        {
+            *to = INT_MAX;
+        }
+    }
+}
 
-                        if (color != current_color)
-                        {
-                            char buf[16];
-                            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                            current_color = color;
-                            abAppend(&ab, buf, clen);
-                        }
+/* Draw the status-line of the window `w`, beneath its text. */
+void editorDrawStatus(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", w->top + w->height, w->left + 1);
+    abAppend(ab, buf, strlen(buf));
+    abAppend(ab, "\x1b[7m", 4);
 
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "File %d/%d: %.32s %s",
+                       f->index + 1, E.max_files,
+                       f->filename ? f->filename : "<NONE>",
+                       f->disk.changed ? "(changed on disk)" : editorBufferDirty(f) ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus),
+                        "Col:%d Row:%d/%d", v->coloff + v->cx + 1, v->rowoff + v->cy + 1, f->numrows);
 
-                        if (isprint(c[j]))
-                        {
-                            abAppend(&ab, c + j, 1);
-                        }
-                        else
-                        {
-                            char buf[16];
-                            sprintf(buf, "\x1b[41m%c\x1b[49m", '?');
-                            abAppend(&ab, buf, strlen(buf));
-                            current_color = -1;
-                        }
-                    }
-                }
-            }
+    /*
+     * For a large file show where we are in the file, rather than in the
+     * rows we've loaded.
+     */
+    if (f->pager)
+    {
+        struct editorPager *p = f->pager;
+        long long total = -1;
+
+        if (p->lines >= 0)
+        {
+            total = p->lines;
+
+            for (int i = 0; i < p->nspans; i++)
+                total += p->spans[i].nlines - p->spans[i].count;
         }
 
-        abAppend(&ab, "\x1b[39m", 5);
-        abAppend(&ab, "\x1b[0K", 4);
-        abAppend(&ab, "\r\n", 2);
+        rlen = snprintf(rstatus, sizeof(rstatus), "Col:%d Row:%lld/%s%lld",
+                        v->coloff + v->cx + 1,
+                        (long long)(p->start + p->shift + v->rowoff + v->cy + 1),
+                        total < 0 ? ">" : "",
+                        total < 0 ? (long long)(p->start + p->shift + f->numrows) : total);
     }
 
-    /* Create a two rows status. First row: */
-    abAppend(&ab, "\x1b[0K", 4);
-    abAppend(&ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "File %d/%d: %.32s %s",
-                       E.current_file + 1, E.max_files,
-                       E.file[E.current_file]->filename ? E.file[E.current_file]->filename : "<NONE>", dirty() ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus),
-                        "Col:%d Row:%d/%d", E.file[E.current_file]->coloff + E.file[E.current_file]->cx + 1, E.file[E.current_file]->rowoff + E.file[E.current_file]->cy + 1, E.file[E.current_file]->numrows);
+    /*
+     * For a binary file show the offset of the cursor, and the size.
+     */
+    if (f->hex)
+        rlen = snprintf(rstatus, sizeof(rstatus), "Offset:0x%llx/0x%llx",
+                        (long long)(v->rowoff + v->cy) * KILO_HEX_WIDTH + v->coloff + v->cx,
+                        (long long)f->hex->size);
 
-    if (len > E.screencols) len = E.screencols;
+    if (len > w->width) len = w->width;
 
-    abAppend(&ab, status, len);
+    abAppend(ab, status, len);
 
-    while (len < E.screencols)
+    while (len < w->width)
     {
-        if (E.screencols - len == rlen)
+        if (w->width - len == rlen)
         {
-            abAppend(&ab, rstatus, rlen);
+            abAppend(ab, rstatus, rlen);
             break;
         }
         else
         {
-            abAppend(&ab, " ", 1);
+            abAppend(ab, " ", 1);
             len++;
         }
     }
 
-    abAppend(&ab, "\x1b[0m\r\n", 6);
+    abAppend(ab, "\x1b[0m", 4);
+}
+
+/* Draw the window `w`, and any windows within it.
+ *
+ * The text of a window is only redrawn if something which affects it has
+ * changed since it was last drawn. */
+void editorDrawWindow(struct abuf *ab, struct editorWindow *w)
+{
+    if (w->child[0])
+    {
+        editorDrawWindow(ab, w->child[0]);
+        editorDrawWindow(ab, w->child[1]);
+
+        /*
+         * Draw the divider between windows which are side by side.
+         */
+        if (w->vertical && E.redraw)
+        {
+            char buf[32];
+
+            for (int y = 0; y < w->height; y++)
+            {
+                snprintf(buf, sizeof(buf), "\x1b[%d;%dH|", w->top + y + 1, w->child[1]->left);
+                abAppend(ab, buf, strlen(buf));
+            }
+        }
+
+        return;
+    }
+
+    /*
+     * The active window shows the current buffer, and its view is held
+     * by that buffer.  Other windows keep their own.
+     */
+    struct fileState *f = editorBufferById(w->buffer);
+    struct editorView v = w->view;
+
+    if (w == E.window)
+    {
+        f = E.file[E.current_file];
+        w->buffer = f->id;
+
+        if (editorWrapping(f))
+            editorWrapScroll(f, E.screenrows, E.screencols);
+
+        editorGetView(f, &v);
+    }
+    else if (f == NULL)
+    {
+        /* The buffer we showed has been killed. */
+        f = E.file[E.current_file];
+        w->buffer = f->id;
+        memset(&w->view, 0, sizeof(w->view));
+        v = w->view;
+    }
+
+    struct editorDamage d;
+    memset(&d, 0, sizeof(d));
+    d.buffer  = f->id;
+    d.version = f->version;
+    d.rowoff  = v.rowoff;
+    d.coloff  = v.coloff;
+    d.wrapoff = v.wrapoff;
+
+    /*
+     * The cursor only changes the text we draw if there is a selection.
+     */
+    if (f->markx != -1 && f->marky != -1)
+    {
+        d.markx = f->markx;
+        d.marky = f->marky;
+        d.cx = v.cx;
+        d.cy = v.cy;
+    }
+
+    if (E.redraw || memcmp(&d, &w->damage, sizeof(d)) != 0)
+    {
+        if (f->hex)
+            editorHexDrawRows(ab, w, f, &v);
+        else
+            editorDrawRows(ab, w, f, &v);
+        w->damage = d;
+    }
+
+    editorDrawStatus(ab, w, f, &v);
+}
+
+/* This function writes the screen using VT100 escape characters
+ * starting from the logical state of the editor in the global state 'E'.
+ *
+ * Returns the number of bytes written. */
+int editorRefreshScreen(void)
+{
+    char buf[32];
+    struct abuf ab = ABUF_INIT;
+
+    /* Nothing to draw upon, or no point drawing while replaying a macro. */
+    if (E.headless || E.macro.playing)
+        return 0;
+
+    stats_start(&E.stats, STAT_RENDER);
+
+    abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
+
+    editorDrawWindow(&ab, E.root);
+    E.redraw = 0;
 
-    /* Second row depends on E.statusmsg and the status message update time. */
+    /* The message-line, at the bottom of the screen. */
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.termrows);
+    abAppend(&ab, buf, strlen(buf));
     abAppend(&ab, "\x1b[0K", 4);
     int msglen = strlen(E.statusmsg);
 
@@ -2901,54 +8226,80 @@ void editorRefreshScreen(void)
          * of it.
          * We do this such that the get_input() method shows useful content.
          */
-        if (msglen > E.screencols)
+        if (msglen > E.termcols)
         {
             /*
              * We'll just truncate to the last screen-width of content.
              */
-            char *offset = E.statusmsg + msglen - E.screencols;
+            char *offset = E.statusmsg + msglen - E.termcols;
             abAppend(&ab, offset, strlen(offset));
         }
         else
         {
-            /*
-             * Pad out a short line.
-             */
-            int diff = E.screencols - msglen;
             abAppend(&ab, E.statusmsg, msglen);
-
-            while (diff)
-            {
-                abAppend(&ab, " ", 1);
-                diff --;
-            }
         }
     }
 
     /* Put cursor at its current position. Note that the horizontal position
      * at which the cursor is displayed may be different compared to 'E.file[E.current_file]->cx'
      * because of TABs. */
-    int j;
-    int cx = 1;
+    int cx = 1 + E.file[E.current_file]->cx;
+    int cy = 1 + E.file[E.current_file]->cy;
     int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
     erow *row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
 
-    if (row)
+    if (E.file[E.current_file]->hex)
     {
-        for (j = E.file[E.current_file]->coloff; j < (E.file[E.current_file]->cx + E.file[E.current_file]->coloff); j++)
-        {
-            if (j < row->size && row->chars[j] == TAB)
-                cx += (E.file[E.current_file]->tab_size - 1) - ((cx) % (E.file[E.current_file]->tab_size));
+        /*
+         * The cursor is on a hex digit of its byte.
+         */
+        struct editorHex *h = E.file[E.current_file]->hex;
+        int x = E.file[E.current_file]->cx;
 
-            cx++;
-        }
+        cx = 1 + editorHexDigits(h) + 2 + x * 3 + (x >= KILO_HEX_WIDTH / 2) + h->nibble;
+    }
+    else if (row && editorWrapping(E.file[E.current_file]))
+    {
+        /*
+         * The cursor is on a line of its row, counted from the line at
+         * the top of the window.
+         */
+        struct fileState *f = E.file[E.current_file];
+        struct editorWrapIndex *x = f->wrap;
+        int at = f->coloff + f->cx, start;
+
+        if (at > row->size)
+            at = row->size;
+
+        int seg = editorWrapSegment(f, row, at, x->width, &start);
+
+        cy = 1 + editorWrapLine(x, filerow) + seg - editorWrapLine(x, f->rowoff) - f->wrapoff;
+        cx = 1 + editorRowColumn(f, row, at) - editorRowColumn(f, row, start);
+
+        if (cx > x->width)
+            cx = x->width;
+    }
+    else if (row && row->cols)
+    {
+        int coloff = E.file[E.current_file]->coloff;
+        int at = coloff + E.file[E.current_file]->cx;
+
+        /* Beyond the end of the row each position is a single column. */
+        if (at > row->size)
+            at = row->size;
+
+        cx = 1 + editorRowColumn(E.file[E.current_file], row, at) - editorRowColumn(E.file[E.current_file], row, coloff)
+             + (coloff + E.file[E.current_file]->cx - at);
     }
 
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.file[E.current_file]->cy + 1, cx);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.window->top + cy, E.window->left + cx);
     abAppend(&ab, buf, strlen(buf));
     abAppend(&ab, "\x1b[?25h", 6); /* Show cursor. */
-    write(STDOUT_FILENO, ab.b, ab.len);
+    write(E.outfd, ab.b, ab.len);
     abFree(&ab);
+
+    stats_stop(&E.stats, STAT_RENDER);
+    return ab.len;
 }
 
 /* Set an editor status message for the second line of the status, at the
@@ -2961,37 +8312,66 @@ void editorSetStatusMessage(int log, const char *fmt, ...)
     va_end(ap);
 
     /*
-     * Find the *Messages* buffer if we can.
+     * With no status-bar to show the message in, send it to stderr.
      */
+    if (log && E.headless)
+    {
+        char *name = E.file[E.current_file]->filename;
+        fprintf(stderr, "%s: %s\n", name ? name : "<NONE>", E.statusmsg);
+    }
+
     if (log)
+        editorLogMessage(E.statusmsg);
+}
+
+/* Append a message to our log, discarding the oldest if it is full.
+ * The *Messages* buffer is only updated when it is next displayed. */
+void editorLogMessage(const char *msg)
+{
+    struct editorLog *l = &E.log;
+    int i = (l->start + l->count) % KILO_LOG_LINES;
+
+    if (l->count == KILO_LOG_LINES)
     {
-        for (int i = 0; i < E.max_files; i++)
-        {
+        free(l->lines[i]);
+        l->start = (l->start + 1) % KILO_LOG_LINES;
+    }
+    else
+    {
+        l->count += 1;
+    }
 
-            struct fileState *tmp = E.file[i];
+    l->lines[i] = strdup(msg);
+    l->appended += 1;
+}
 
-            if (tmp->filename && (strcmp(tmp->filename, "*Messages*") == 0))
-            {
-                /* switch to it */
-                int old = E.current_file;
-                E.current_file = i;
+/* If the current buffer is `*Messages*` then refresh it from our log,
+ * if anything has been logged since it was last shown. */
+void editorUpdateMessages(void)
+{
+    struct editorLog *l = &E.log;
+    struct fileState *f = l->buffer;
 
-                /*
-                 * Insert the status-message
-                 */
-                for (unsigned int i = 0; i < strlen(E.statusmsg); i++)
-                {
-                    editorInsertChar(E.statusmsg[i]);
-                }
+    if (f == NULL || f != E.file[E.current_file] || l->shown == l->appended)
+        return;
 
-                editorInsertChar('\n');
+    l->shown = l->appended;
 
-                E.current_file = old;
-                break;
-            }
+    while (f->numrows)
+        editorDelRow(f, f->numrows - 1);
 
-        }
+    for (int i = 0; i < l->count; i++)
+    {
+        char *line = l->lines[(l->start + i) % KILO_LOG_LINES];
+        editorInsertRow(f, f->numrows, line, strlen(line));
     }
+
+    /* Follow the end of the log. */
+    int rows = E.screenrows < f->numrows + 1 ? E.screenrows : f->numrows + 1;
+    f->cx = f->coloff = 0;
+    f->cy = rows - 1;
+    f->rowoff = f->numrows + 1 - rows;
+    f->dirty = 0;
 }
 
 
@@ -3000,6 +8380,19 @@ void editorSetStatusMessage(int log, const char *fmt, ...)
 /* Handle cursor position change because arrow keys were pressed. */
 void editorMoveCursor(int key)
 {
+    if (E.file[E.current_file]->hex)
+    {
+        editorHexMove(E.file[E.current_file], key);
+        return;
+    }
+
+    if (editorWrapping(E.file[E.current_file]))
+    {
+        editorWrapMove(E.file[E.current_file], key);
+        editorPagerCheck(E.file[E.current_file]);
+        return;
+    }
+
     int filerow = E.file[E.current_file]->rowoff + E.file[E.current_file]->cy;
     int filecol = E.file[E.current_file]->coloff + E.file[E.current_file]->cx;
     int rowlen;
@@ -3008,30 +8401,29 @@ void editorMoveCursor(int key)
     switch (key)
     {
     case ARROW_LEFT:
-        if (E.file[E.current_file]->cx == 0)
-        {
-            if (E.file[E.current_file]->coloff)
-            {
-                E.file[E.current_file]->coloff--;
-            }
-            else
-            {
-                if (filerow > 0)
-                {
-                    E.file[E.current_file]->cy--;
-                    E.file[E.current_file]->cx = E.file[E.current_file]->row[filerow - 1].size;
+        if (filecol > 0)
+        {
+            /* Move back over the whole of a multi-byte character. */
+            int n = row ? filecol - editorRowPrev(E.file[E.current_file], row, filecol) : 1;
 
-                    if (E.file[E.current_file]->cx > E.screencols - 1)
-                    {
-                        E.file[E.current_file]->coloff = E.file[E.current_file]->cx - E.screencols + 1;
-                        E.file[E.current_file]->cx = E.screencols - 1;
-                    }
-                }
+            while (n-- > 0)
+            {
+                if (E.file[E.current_file]->cx == 0)
+                    E.file[E.current_file]->coloff--;
+                else
+                    E.file[E.current_file]->cx -= 1;
             }
         }
-        else
+        else if (filerow > 0)
         {
-            E.file[E.current_file]->cx -= 1;
+            E.file[E.current_file]->cy--;
+            E.file[E.current_file]->cx = E.file[E.current_file]->row[filerow - 1].size;
+
+            if (E.file[E.current_file]->cx > E.screencols - 1)
+            {
+                E.file[E.current_file]->coloff = E.file[E.current_file]->cx - E.screencols + 1;
+                E.file[E.current_file]->cx = E.screencols - 1;
+            }
         }
 
         break;
@@ -3039,13 +8431,18 @@ void editorMoveCursor(int key)
     case ARROW_RIGHT:
         if (row && filecol < row->size)
         {
-            if (E.file[E.current_file]->cx == E.screencols - 1)
-            {
-                E.file[E.current_file]->coloff++;
-            }
-            else
+            int n = editorRowNext(E.file[E.current_file], row, filecol) - filecol;
+
+            while (n-- > 0)
             {
-                E.file[E.current_file]->cx += 1;
+                if (E.file[E.current_file]->cx == E.screencols - 1)
+                {
+                    E.file[E.current_file]->coloff++;
+                }
+                else
+                {
+                    E.file[E.current_file]->cx += 1;
+                }
             }
         }
         else if (row && filecol == row->size)
@@ -3105,6 +8502,10 @@ void editorMoveCursor(int key)
     row = (filerow >= E.file[E.current_file]->numrows) ? NULL : &E.file[E.current_file]->row[filerow];
     rowlen = row ? row->size : 0;
 
+    /* Or if it is in the middle of a multi-byte character. */
+    if (row && filecol < rowlen)
+        rowlen = editorRowCharStart(E.file[E.current_file], row, filecol);
+
     if (filecol > rowlen)
     {
         E.file[E.current_file]->cx -= filecol - rowlen;
@@ -3115,6 +8516,8 @@ void editorMoveCursor(int key)
             E.file[E.current_file]->cx = 0;
         }
     }
+
+    editorPagerCheck(E.file[E.current_file]);
 }
 
 /* Process events arriving from the standard input, which is, the user
@@ -3122,8 +8525,21 @@ void editorMoveCursor(int key)
 void editorProcessKeypress(int fd)
 {
     char tmp[2] = {'\0', '\0'};
+
+    stats_frame_start(&E.stats);
+
+    stats_start(&E.stats, STAT_READ);
     tmp[0] = editorReadKey(fd);
-    call_lua("on_key", tmp);
+    stats_stop(&E.stats, STAT_READ);
+
+    /*
+     * If on_key() returns true then this key was the prefix of a longer
+     * sequence, otherwise the sequence is complete.
+     */
+    if (!call_lua("on_key", tmp))
+        E.macro.seq_start = E.macro.len;
+
+    editorPagerCheck(E.file[E.current_file]);
 }
 
 /* Load and evaluate a Lua file - if it exists */
@@ -3151,9 +8567,22 @@ int load_lua(char *filename)
 /* Init the editor. */
 void initEditor(void)
 {
-    /* Get the size of our window, and remove room for status bar. */
+    /* Get the size of our terminal. */
     getWindowSize();
-    E.screenrows -= 2;
+
+    E.large_file = KILO_LARGE_FILE;
+    E.compress_rows = KILO_COMPRESS_ROWS;
+    E.intern = 0;
+    E.wrap = 0;
+    E.inotify = -1;
+    E.stream.fd = -1;
+#ifdef _GZIP
+    E.gzip_level = 6;   /* What zlib, and gzip, use by default. */
+#endif
+
+    /* Keys come from the terminal, and the screen goes back to it. */
+    E.infd  = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
 
     /*
      * Setup lua.
@@ -3195,6 +8624,13 @@ void initEditor(void)
     lua_register(lua, "key", key_lua);
     lua_register(lua, "insert", insert_lua);
 
+    /*
+     * Macros
+     */
+    lua_register(lua, "macro_record", macro_record_lua);
+    lua_register(lua, "macro_replay", macro_replay_lua);
+    lua_register(lua, "macro_stop", macro_stop_lua);
+
     /*
      * Markers
      */
@@ -3204,15 +8640,28 @@ void initEditor(void)
     /*
      * Core
      */
+    lua_register(lua, "compress_rows", compress_rows_lua);
+    lua_register(lua, "crlf", crlf_lua);
     lua_register(lua, "eval", eval_lua);
     lua_register(lua, "exit", exit_lua);
+    lua_register(lua, "file_info", file_info_lua);
     lua_register(lua, "find", find_lua);
+    lua_register(lua, "follow", follow_lua);
+    lua_register(lua, "goto_line", goto_line_lua);
+    lua_register(lua, "gzip_level", gzip_level_lua);
+    lua_register(lua, "hex", hex_lua);
+    lua_register(lua, "intern", intern_lua);
+    lua_register(lua, "large_file", large_file_lua);
+    lua_register(lua, "memory_stats", memory_stats_lua);
     lua_register(lua, "open", open_lua);
+    lua_register(lua, "reload", reload_lua);
     lua_register(lua, "prompt", prompt_lua);
     lua_register(lua, "save", save_lua);
     lua_register(lua, "search", search_lua);
+    lua_register(lua, "stats", stats_lua);
     lua_register(lua, "status", status_lua);
     lua_register(lua, "undo", undo_lua);
+    lua_register(lua, "wrap", wrap_lua);
 
     /*
      * Syntax highlighting.
@@ -3228,6 +8677,7 @@ void initEditor(void)
      * Buffers.
      */
     lua_register(lua, "buffers", count_buffers_lua);
+    lua_register(lua, "buffer_list", buffer_list_lua);
     lua_register(lua, "choose_buffer", choose_buffer_lua);
     lua_register(lua, "create_buffer", create_buffer_lua);
     lua_register(lua, "current_buffer", current_buffer_lua);
@@ -3237,20 +8687,345 @@ void initEditor(void)
     lua_register(lua, "select_buffer", select_buffer_lua);
 
 
+    /*
+     * Windows.
+     */
+    lua_register(lua, "delete_other_windows", delete_other_windows_lua);
+    lua_register(lua, "delete_window", delete_window_lua);
+    lua_register(lua, "other_window", other_window_lua);
+    lua_register(lua, "split_window_below", split_window_below_lua);
+    lua_register(lua, "split_window_right", split_window_right_lua);
+
+
     /*
      * Create a new `Messages` buffer.
      */
-    create_buffer_lua(lua);
-    E.file[0]->filename = strdup("*Messages*");
+    E.log.buffer = editorCreateBuffer("*Messages*");
+
+    /*
+     * A single window, filling the screen.
+     */
+    editorResizeScreen(E.screenrows, E.screencols);
+}
+
+
+/* ============================= Statistics ================================ */
+
+#ifdef _STATS
+
+/* Finish our trace-file, at exit. */
+void editorCloseTrace(void)
+{
+    stats_close(&E.stats);
+}
+
+#endif
+
+/* If the current buffer is `*Stats*` then replace its contents with
+ * a summary of our recent timings. */
+void editorUpdateStats(void)
+{
+#ifdef _STATS
+    static long shown = -1;
+    char line[256];
+
+    struct fileState *f = E.file[E.current_file];
+
+    if (f->filename == NULL || strcmp(f->filename, "*Stats*") != 0)
+        return;
+
+    /* Nothing new to show? */
+    if (shown == E.stats.frames && f->numrows > 0)
+        return;
+
+    shown = E.stats.frames;
+
+    while (f->numrows)
+        editorDelRow(f, f->numrows - 1);
+
+#define STATS_LINE(...) do { \
+    int len = snprintf(line, sizeof(line), __VA_ARGS__); \
+    editorInsertRow(f, f->numrows, line, len); \
+} while (0)
+
+    STATS_LINE("Frames: %ld (figures cover the most recent %d)", E.stats.frames, E.stats.count);
+    STATS_LINE("%s", "");
+    STATS_LINE("%-8s %12s %12s %12s %12s", "", "p50", "p99", "max", "mean");
+
+    for (int i = 0; i < STAT_MAX; i++)
+    {
+        double p50, p99, max, mean;
+        stats_summary(&E.stats, i, &p50, &p99, &max, &mean);
+
+        if (i == STAT_BYTES)
+            STATS_LINE("%-8s %12.0f %12.0f %12.0f %12.0f  bytes", stat_names[i], p50, p99, max, mean);
+        else
+            STATS_LINE("%-8s %12.3f %12.3f %12.3f %12.3f  ms", stat_names[i], p50 / 1000, p99 / 1000, max / 1000, mean / 1000);
+    }
+
+    STATS_LINE("%s", "");
+    STATS_LINE("%s", "Frame times:");
+
+    int *hist = E.stats.series[STAT_FRAME].hist;
+    int most = 1;
+
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        if (hist[b] > most)
+            most = hist[b];
+
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        if (hist[b] == 0)
+            continue;
+
+        char bar[41] = {0};
+        memset(bar, '#', (hist[b] * 40) / most);
+
+        STATS_LINE("  < %8ld us %6d %s", 1L << b, hist[b], bar);
+    }
+
+#undef STATS_LINE
+
+    /* Keep the cursor within the buffer. */
+    if (f->rowoff + f->cy >= f->numrows)
+    {
+        f->cx = f->cy = f->rowoff = f->coloff = 0;
+    }
+
+#endif
+}
+
+
+/* ============================= Batch mode ================================ */
+
+/* Open the given file in a fresh buffer, and run the batch-script which
+ * is sitting on the top of the Lua stack against it.
+ *
+ * Returns 0 on success, 1 on error. */
+int editorBatchFile(char *filename)
+{
+    int ret = 0;
+
+    editorCreateBuffer(NULL);
+    editorOpen(filename);
+
+    lua_pushvalue(lua, -1);
+
+    if (lua_pcall(lua, 0, 0, 0) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", filename, lua_tostring(lua, -1));
+        lua_pop(lua, 1);
+        ret = 1;
+    }
+
+    /*
+     * We're done with this file.  The script is responsible for calling
+     * `save()` if it wanted the changes to be kept.
+     */
+    kill_buffer_lua(lua);
+    return ret;
+}
+
+/* Run the given Lua script against each of the named files, without
+ * a terminal.
+ *
+ * If `jobs` is greater than one the files are shared out between that
+ * many worker processes, each of which has its own copy of the Lua
+ * interpreter and its own set of buffers.
+ *
+ * Returns the exit-code for the process. */
+int editorBatch(char *script, int nfiles, char **files, int jobs)
+{
+    struct timeval start, end;
+    int failed = 0;
+
+    gettimeofday(&start, NULL);
+
+    /*
+     * Compile the script once, we'll run it once per-file.
+     */
+    if (luaL_loadfile(lua, script) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(lua, -1));
+        return 1;
+    }
+
+    if (jobs > nfiles)
+        jobs = nfiles;
+
+    if (jobs <= 1)
+    {
+        for (int i = 0; i < nfiles; i++)
+            failed += editorBatchFile(files[i]);
+    }
+    else
+    {
+        /*
+         * Each worker handles every `jobs`th file, and reports the
+         * number of failures via its exit-code.
+         */
+        pid_t *workers = malloc(sizeof(pid_t) * jobs);
+
+        for (int w = 0; w < jobs; w++)
+        {
+            workers[w] = fork();
+
+            if (workers[w] == -1)
+            {
+                perror("fork()");
+                exit(1);
+            }
+
+            if (workers[w] == 0)
+            {
+                int count = 0;
+
+                for (int i = w; i < nfiles; i += jobs)
+                    count += editorBatchFile(files[i]);
+
+                _exit(count > 255 ? 255 : count);
+            }
+        }
+
+        for (int w = 0; w < jobs; w++)
+        {
+            int status = 0;
+
+            if (waitpid(workers[w], &status, 0) == -1)
+                continue;
+
+            if (WIFEXITED(status))
+                failed += WEXITSTATUS(status);
+            else
+                failed += 1;
+        }
+
+        free(workers);
+    }
+
+    gettimeofday(&end, NULL);
+
+    double elapsed = (end.tv_sec - start.tv_sec) +
+                     (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    fprintf(stderr, "%d file(s) processed by %d worker(s) in %.3fs: %d ok, %d failed\n",
+            nfiles, jobs < 1 ? 1 : jobs, elapsed, nfiles - failed, failed);
+
+    return (failed ? 1 : 0);
+}
+
+
+/* ============================= Key replay ================================ */
+
+/* qsort() comparison for doubles. */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Feed the recorded keystrokes in the named file through the editor,
+ * exactly as if they'd been typed, redrawing the screen after each one.
+ *
+ * In bench-mode the screen is written to /dev/null, and once the keys
+ * are exhausted the key-to-frame latencies are reported.
+ *
+ * Returns 0 on success, 1 on error. */
+int editorReplay(char *keys, int bench, double open_ms)
+{
+    struct stat st;
+    int fd = open(keys, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", keys, strerror(errno));
+        return 1;
+    }
+
+    if (bench && (E.outfd = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    E.infd = fd;
+
+    int max = 1024, count = 0;
+    double *latency = malloc(sizeof(double) * max);
+    long *bytes = malloc(sizeof(long) * max);
+    long total = 0;
+
+    double start = monotonic_us();
+
+    while (lseek(fd, 0, SEEK_CUR) < st.st_size)
+    {
+        double t = monotonic_us();
+
+        editorProcessKeypress(fd);
+        editorUpdateMessages();
+        editorUpdateStats();
+        int written = editorRefreshScreen();
+        stats_frame_end(&E.stats, written);
+
+        if (count == max)
+        {
+            max *= 2;
+            latency = realloc(latency, sizeof(double) * max);
+            bytes = realloc(bytes, sizeof(long) * max);
+        }
+
+        latency[count] = monotonic_us() - t;
+        bytes[count] = written;
+        total += written;
+        count += 1;
+    }
+
+    double elapsed = monotonic_us() - start;
+
+    close(fd);
+    E.infd = STDIN_FILENO;
+
+    if (bench)
+    {
+        close(E.outfd);
+        E.outfd = STDOUT_FILENO;
+
+        long max_bytes = 0;
+
+        for (int i = 0; i < count; i++)
+            if (bytes[i] > max_bytes)
+                max_bytes = bytes[i];
+
+        qsort(latency, count, sizeof(double), cmp_double);
+
+        printf("%s: %d keys in %.3f ms (open %.3f ms)\n", keys, count, elapsed / 1000.0, open_ms);
+
+        if (count > 0)
+        {
+            printf("  latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                   latency[count / 2] / 1000.0,
+                   latency[(int)(count * 0.99)] / 1000.0,
+                   latency[count - 1] / 1000.0);
+            printf("  frames: %ld bytes/frame mean, %ld max, %ld total\n",
+                   total / count, max_bytes, total);
+        }
+    }
+
+    free(latency);
+    free(bytes);
+    return 0;
 }
 
 
+#ifndef _NO_MAIN
+
 /* Entry point to our code */
 int main(int argc, char **argv)
 {
     fd_set rfds;
     struct timeval tv;
-    int retval;
+    int retval, maxfd;
 
     /*
      * Initialize our editor.  We do this first so that
@@ -3279,6 +9054,19 @@ int main(int argc, char **argv)
      */
     char *eval = NULL;
 
+    /*
+     * The script to run in batch-mode, and the number of workers to use.
+     */
+    char *batch = NULL;
+    int jobs = 1;
+
+    /*
+     * A file of keystrokes to replay, and whether to time them.
+     */
+    char *replay = NULL;
+    int bench = 0;
+    double open_ms = 0;
+
     /*
      * Parse command-line options.
      */
@@ -3286,8 +9074,13 @@ int main(int argc, char **argv)
     {
         static struct option long_options[] =
         {
+            {"batch", required_argument, 0, 'b'},
+            {"bench", no_argument, 0, 'B'},
             {"config", required_argument, 0, 'c'},
             {"eval", required_argument, 0, 'e'},
+            {"jobs", required_argument, 0, 'j'},
+            {"replay", required_argument, 0, 'r'},
+            {"trace", required_argument, 0, 't'},
             {"version", no_argument, 0, 'v'},
             {0, 0, 0, 0}
         };
@@ -3295,7 +9088,7 @@ int main(int argc, char **argv)
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        char c = getopt_long(argc, argv, "e:c:v", long_options, &option_index);
+        char c = getopt_long(argc, argv, "b:Be:c:j:r:t:v", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1)
@@ -3315,9 +9108,54 @@ int main(int argc, char **argv)
         case 'e':
             eval = strdup(optarg);
             break;
+
+        case 'b':
+            batch = optarg;
+            E.headless = 1;
+            break;
+
+        case 'j':
+            jobs = atoi(optarg);
+
+            if (jobs < 1)
+                jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+            break;
+
+        case 'r':
+            replay = optarg;
+            break;
+
+        case 'B':
+            bench = 1;
+            break;
+
+        case 't':
+#ifdef _STATS
+            E.stats.trace = fopen(optarg, "w");
+
+            if (E.stats.trace == NULL)
+            {
+                fprintf(stderr, "Failed to open %s: %s\n", optarg, strerror(errno));
+                exit(1);
+            }
+
+            atexit(editorCloseTrace);
+#else
+            fprintf(stderr, "statistics-support is not compiled in\n");
+            exit(1);
+#endif
+            break;
         }
     }
 
+    /*
+     * In batch-mode we never touch the terminal, and we don't need any
+     * key-bindings to be present.
+     */
+    if (batch != NULL)
+        return (editorBatch(batch, argc - optind, argv + optind, jobs));
+
     /*
      * If we've not loaded at least one configuration file then
      * we will have no `on_key` defined, which means the editor
@@ -3333,6 +9171,8 @@ int main(int argc, char **argv)
 
     if (argc - optind)
     {
+        double start = monotonic_us();
+
         /*
          * For each file on the command line.
          */
@@ -3341,59 +9181,129 @@ int main(int argc, char **argv)
             /*
              * Create a new buffer, and read the file.
              */
-            create_buffer_lua(lua);
-            editorOpen(argv[optind + i]);
+            if (strcmp(argv[optind + i], "-") == 0)
+                editorStreamOpen(editorCreateBuffer("*stdin*"));
+            else
+            {
+                editorCreateBuffer(NULL);
+                editorOpen(argv[optind + i]);
+            }
         }
+
+        open_ms = (monotonic_us() - start) / 1000.0;
     }
     else
     {
         /*
          * No named files.  Just create a new buffer
          */
-        create_buffer_lua(lua);
+        editorCreateBuffer(NULL);
     }
 
 
-    enableRawMode(STDIN_FILENO);
     editorSetStatusMessage(1,
                            "HELP: ^o = open | ^s = save | ^q = quit | ^f = find | ^l = eval");
 
+    /*
+     * If we have a function to evaluate, post-load, do that.
+     */
+    if (eval != NULL)
+    {
+        call_lua(eval, "");
+        free(eval);
+        eval = NULL;
+    }
+
+    /*
+     * Replay any recorded keystrokes.  When benchmarking we're done
+     * once they've been processed, otherwise the user takes over.
+     */
+    if (replay != NULL)
+    {
+        if (editorReplay(replay, bench, open_ms) != 0)
+            exit(1);
+
+        if (bench)
+            exit(0);
+    }
+
+    enableRawMode(STDIN_FILENO);
+
+    /*
+     * Follow the size of the terminal.  Reads are restarted, but our
+     * select() is interrupted so that we may redraw at once.
+     */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorWindowChanged;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
     /*
      * Run our event loop.
      */
     while (1)
     {
+        editorCheckResize();
+        editorUpdateMessages();
+        editorUpdateStats();
+        stats_frame_end(&E.stats, editorRefreshScreen());
+
         /*
-         * If we have a function to evaluate, post-load, do that.
+         * Wait to see when we have input, a file we follow changes, or
+         * there's more to read on stdin.
          */
-        if (eval != NULL)
-        {
-            call_lua(eval, "");
-            free(eval);
-            eval = NULL;
-        }
+        FD_ZERO(&rfds);
+        FD_SET(E.infd, &rfds);
+        maxfd = E.infd;
 
-        editorRefreshScreen();
+        if (E.inotify != -1)
+            FD_SET(E.inotify, &rfds);
 
-        /* Wait to see when we have input. */
-        FD_ZERO(&rfds);
-        FD_SET(STDIN_FILENO, &rfds);
+        if (E.stream.fd != -1)
+            FD_SET(E.stream.fd, &rfds);
+
+        if (E.inotify > maxfd)
+            maxfd = E.inotify;
+
+        if (E.stream.fd > maxfd)
+            maxfd = E.stream.fd;
 
         /* Wait a second at the most */
         tv.tv_sec = 1;
         tv.tv_usec = 0;
 
-        retval = select(1, &rfds, NULL, NULL, &tv);
+        retval = select(maxfd + 1, &rfds, NULL, NULL, &tv);
 
         if (retval == -1)
-            perror("select()");
+        {
+            if (errno != EINTR)
+                perror("select()");
+        }
         else if (retval)
-            editorProcessKeypress(STDIN_FILENO);
+        {
+            if (E.inotify != -1 && FD_ISSET(E.inotify, &rfds))
+                editorDiskEvents();
+
+            if (E.stream.fd != -1 && FD_ISSET(E.stream.fd, &rfds))
+                editorStreamRead();
+
+            if (FD_ISSET(E.infd, &rfds))
+                editorProcessKeypress(E.infd);
+        }
         else
         {
+            editorDiskPoll();
+
+            for (int i = 0; i < E.max_files; i++)
+                editorColdCheck(E.file[i]);
+
             call_lua("on_idle", "");
         }
     }
 
     return 0;
 }
+
+#endif /* _NO_MAIN */
@@ -35,6 +35,9 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <signal.h>
+
 #ifdef _REGEXP
 #include <regex.h>
 #endif
@@ -43,6 +46,15 @@
 #include "undo_stack.h"
 #endif
 
+#ifdef _GZIP
+#include <zlib.h>
+#endif
+
+#include "stats.h"
+#include "arena.h"
+#include "lz.h"
+#include "utf8.h"
+
 /* Lua interface */
 #include <lua.h>
 #include <lauxlib.h>
@@ -64,6 +76,22 @@
 #define HL_HIGHLIGHT_NUMBERS (1<<2)
 
 #define KILO_QUERY_LEN 256
+#define KILO_LOG_LINES 1000 /* Messages kept in the *Messages* buffer. */
+
+#define KILO_LARGE_FILE (1024LL * 1024 * 1024) /* Files this large are paged. */
+#define KILO_PAGE_LINES 8192  /* Lines of a large file we hold at once. */
+#define KILO_PAGE_MARGIN 1024 /* Reload when the cursor is this close to the edge. */
+#define KILO_INDEX_STEP 1024  /* We record the offset of every Nth line. */
+#define KILO_DIFF_LIMIT 2048  /* Reloads differing by more lines replace them all. */
+#define KILO_COMPRESS_ROWS (256LL * 1024 * 1024) /* Buffers this large compress cold rows. */
+#define KILO_COLD_ROWS 4096   /* Rows compressed together, and kept around the cursor. */
+#define KILO_COLD_HOT 16      /* Blocks of compressed rows we keep decompressed. */
+#define KILO_HEX_WIDTH 16     /* Bytes shown on each line of a binary file. */
+#define KILO_HEX_SNIFF (64 * 1024) /* Bytes read to decide if a file is binary. */
+#define KILO_GIANT_ROW (256 * 1024) /* Rows this long are highlighted around the view. */
+#define KILO_LEX_STEP (16 * 1024)  /* We record the highlighter's state this often in them. */
+#define KILO_LEX_MARGIN 2048       /* Bytes highlighted either side of those shown. */
+#define KILO_KEYWORD_MAX 1024      /* Keywords in them match at most this many bytes. */
 
 /* Global lua handle */
 lua_State * lua;
@@ -73,17 +101,22 @@ lua_State * lua;
  */
 const char * welcome_msg[] =
 {
-    "kilua, version " _VERSION "\x1b[0K\r\n",
-    "\r\n",
+    "kilua, version " _VERSION,
+    "",
 #ifdef _REGEXP
-    "Regular expression support enabled.\r\n",
+    "Regular expression support enabled.",
 #else
-    "\r\n",
+    "",
 #endif
 #ifdef _UNDO
-    "Undo-support enabled.\r\n",
+    "Undo-support enabled.",
+#else
+    "",
+#endif
+#ifdef _STATS
+    "Statistics enabled.",
 #else
-    "\r\n",
+    "",
 #endif
 };
 
@@ -119,27 +152,293 @@ struct editorSyntax
      * Flags in-play for highlighting numbers/strings/etc.
      */
     int flags;
+
+#ifdef _REGEXP
+    /**
+     * The keywords compiled, anchored to the text they're matched
+     * against, once we've needed them; `compiled[i]` is zero for those
+     * which didn't compile.
+     */
+    regex_t *regex;
+    char *compiled;
+#endif
+};
+
+
+
+/**
+ * A run of characters of a row which share the same syntax highlight
+ * type.  Characters between spans are HL_NORMAL.
+ *
+ * Longer runs are split into several spans, and longer gaps are bridged
+ * by empty spans.
+ */
+typedef struct hlspan
+{
+    unsigned short skip;    /* Characters since the previous span ended. */
+    unsigned char len;      /* Number of characters. */
+    unsigned char type;     /* HL_* type. */
+} hlspan;
+
+
+/**
+ * A character of a row which isn't drawn as a single column: a TAB, a
+ * multi-byte UTF-8 sequence, or a byte we can't print.
+ */
+typedef struct colstop
+{
+    int at;                 /* Offset of the character in `chars`. */
+    int col;                /* Screen column at which it is drawn. */
+} colstop;
+
+
+/**
+ * The state of the highlighter at an offset of a row, from which it
+ * can carry on.
+ */
+struct editorLex
+{
+    int at;                 /* Offset in the row. */
+    unsigned char comment;  /* Within a multi-line comment? */
+    unsigned char string;   /* The quote of the string we're within, or 0. */
+    unsigned char sep;      /* Does a separator precede it? */
+    unsigned char number;   /* Is the character before part of a number? */
+    unsigned char line;     /* Is the rest of the row a single-line comment? */
 };
 
 
+/**
+ * A row too long to highlight every time it changes.
+ *
+ * We record the state of the highlighter every KILO_LEX_STEP bytes, so
+ * that we need only highlight the bytes around those shown, and the
+ * spans of the row cover just the bytes from `from` up to `to`.
+ *
+ * The first `valid` marks are correct.  Those after them were correct
+ * before the row changed, and once the highlighter reaches one of them
+ * in the same state, the rest are correct again.
+ */
+struct editorGiant
+{
+    struct editorLex *mark;
+    int marks, room;
+    int valid;
+    int from, to;
+};
+
 
 /**
  * This structure represents a single line of the file we are editing.
  */
 typedef struct erow
 {
+    char *chars;        /* Row content. */
+    struct colstop *cols;  /* Characters which aren't one column wide, in
+                              order, preceded by their count in `cols[0].at`,
+                              or NULL if the row has none. */
+    struct hlspan *hl;  /* Spans of highlighted characters, in order, or
+                           NULL if they're all HL_NORMAL. */
     int idx;            /* Row index in the file, zero-based. */
     int size;           /* Size of the row, excluding the null term. */
-    int rsize;          /* Size of the rendered row. */
-    char *chars;        /* Row content. */
-    char *render;       /* Row content "rendered" for screen (for TABs). */
-    unsigned char *hl;  /* Syntax highlight type for each character in render.*/
-    int hl_oc;          /* Row had open comment at end in last syntax highlight
-                           check. */
+    unsigned char hl_oc;  /* Row had open comment at end in last syntax
+                             highlight check. */
+    unsigned char arena;  /* Are `chars` held in the buffer's arena? */
+    unsigned char cold;   /* Is the text compressed, and `chars` NULL? */
+    int nhl;              /* Number of spans in `hl`. */
+    struct editorGiant *giant;  /* Highlighting state of a giant row, or NULL. */
 } erow;
 
 
 
+/**
+ * An edit to a large file: `count` lines of the file, starting at `line`,
+ * are replaced by the `nlines` lines in `lines`.
+ */
+struct editorSpan
+{
+    int64_t line;
+    int64_t count;
+    char **lines;
+    int nlines;
+};
+
+
+/**
+ * A file too large to load, of which the rows of its buffer hold only
+ * the lines around the cursor.  Edits are kept as spans, and merged with
+ * the file when it is saved.
+ *
+ * Line-numbers here are those of the file on disk.
+ */
+struct editorPager
+{
+    FILE *fp;
+    int64_t size;       /* Size of the file. */
+
+    /*
+     * The offset of every KILO_INDEX_STEP'th line, as far as we've read.
+     */
+    int64_t *index;
+    int64_t indexed;    /* Number of entries in the index. */
+    int64_t room;       /* Number of entries we have room for. */
+    int64_t scan_line;  /* The next line we'll find the start of... */
+    int64_t scan_off;   /* ... which is at this offset. */
+    int64_t lines;      /* Number of lines in the file, or -1 if unknown. */
+
+    /*
+     * The lines of the file we loaded into our rows, and the number of
+     * lines added by edits before them.
+     */
+    int64_t start, end;
+    int64_t shift;
+
+    /*
+     * For each row we loaded: the line of the file it came from, or -1
+     * if it came from a span, and a hash of its contents.
+     */
+    int64_t *origin;
+    uint64_t *hash;
+    int loaded;
+    int dirty;          /* Dirty-count of the buffer when we loaded it. */
+
+    struct editorSpan *spans;   /* Edits, in order. */
+    int nspans;
+};
+
+
+/**
+ * A byte of a binary file which we've changed.
+ */
+struct editorPatch
+{
+    int64_t offset;
+    unsigned char byte;
+};
+
+
+/**
+ * A binary file, shown as hex.
+ *
+ * The file is mapped, rather than loaded, and the bytes we draw are read
+ * from the map.  Bytes may only be overwritten, and those we change are
+ * kept aside, ordered by offset, until they're written over the file.
+ *
+ * The rows of the buffer are unused: each line of the view shows
+ * KILO_HEX_WIDTH bytes, and the cursor's column is a byte of the line.
+ */
+struct editorHex
+{
+    int fd;
+    unsigned char *map; /* The file, or NULL if it is empty. */
+    int64_t mapped;     /* Length of the map. */
+    int64_t size;       /* Size of the file, as much of the map as we use. */
+    char *path;         /* The file we mapped. */
+    struct editorPatch *patch;
+    int npatch;
+    int room;
+    int nibble;         /* Is the cursor on the low half of its byte? */
+};
+
+
+/**
+ * A file which a buffer follows as it grows, like `tail -f`.
+ */
+struct editorFollow
+{
+    int fd;             /* The file, kept open in case it is rotated. */
+    int64_t offset;     /* How much of the file we've read. */
+    int partial;        /* Does the last row lack its newline? */
+};
+
+
+/**
+ * What we know of the file a buffer matches, so that we can tell when
+ * something else changes it.
+ */
+struct editorDisk
+{
+    int64_t size;       /* Size of the file, or -1 if there isn't one. */
+    int64_t mtime;      /* Modification time, in nanoseconds. */
+    uint64_t ino, dev;
+    int wd;             /* Our inotify watch, or -1. */
+    int pending;        /* Has inotify told us the file changed? */
+    int changed;        /* Have we told the user that it changed? */
+};
+
+
+/**
+ * What we learn of a file's contents as it is loaded: whether it is
+ * valid UTF-8, whether it is binary, and how its lines end.
+ *
+ * Text may be scanned in pieces, so we remember where we are within a
+ * multi-byte character, and whether the last byte was a CR.
+ */
+struct editorScan
+{
+    int64_t lf;         /* Lines ending in LF, including those below. */
+    int64_t crlf;       /* Lines ending in CRLF. */
+    int64_t nul;        /* NUL bytes. */
+    int64_t invalid;    /* Bytes which aren't valid UTF-8. */
+    int dos;            /* Did the first line end in CRLF?  -1 until seen. */
+    int cr;             /* Was the last byte a CR? */
+    int need;           /* Continuation bytes still to come. */
+    unsigned char lo, hi;   /* The range the next of them must be in. */
+};
+
+
+/**
+ * A block of neighbouring rows, far from the cursor of any window, whose
+ * text is held compressed.
+ *
+ * When one of the rows is needed the block is decompressed, in one piece,
+ * and the rows point into that `text`.  Unless they're changed the
+ * compressed copy is kept, so the block may be compressed again for
+ * nothing once it is no longer needed.
+ */
+struct editorColdBlock
+{
+    int first;          /* The first row. */
+    int count;          /* The number of rows. */
+    char *data;         /* The text of the rows, compressed, or NULL. */
+    size_t size;        /* The size of `data`. */
+    size_t length;      /* The size of the text, decompressed. */
+    char *text;         /* The text, if the block is decompressed. */
+    long used;          /* When the block was last decompressed. */
+    int clean;          /* Does `data` still hold these rows? */
+};
+
+
+/**
+ * The blocks of compressed rows of a buffer, in order.
+ */
+struct editorCold
+{
+    struct editorColdBlock *block;
+    int count;
+    int thawed;         /* How many blocks are decompressed? */
+    long clock;         /* Incremented for each decompression. */
+    size_t bytes;       /* The size of the compressed data. */
+};
+
+
+/**
+ * When long lines are wrapped: the number of lines of the screen each row
+ * takes, and a Fenwick tree of them, so that we can find the screen line
+ * a row starts on, or the row on a given screen line, in O(log n).
+ *
+ * The counts are updated as rows change, and are only counted afresh
+ * when the width we wrap to changes.
+ */
+struct editorWrapIndex
+{
+    int width;          /* The width rows were wrapped to. */
+    int count;          /* The number of rows. */
+    int room;           /* The number of rows we have room for. */
+    int *lines;         /* The lines each row takes. */
+    int64_t *tree;      /* Sums of `lines`, indexed from one. */
+};
+
+
 /**
  * This structure represents the state of a file.
  *
@@ -150,17 +449,126 @@ struct fileState
 {
     int cx, cy; /* Cursor x and y position in characters */
     int markx, marky; /*  x and y position of mark in characters */
+    int matchx, matchy, matchlen; /* Search match shown, if matchlen > 0. */
     int rowoff;     /* Offset of row displayed. */
     int coloff;     /* Offset of column displayed. */
+    int wrapoff;    /* Lines of the row at rowoff above the screen, when wrapping. */
     int numrows;    /* Number of rows */
     erow *row;      /* Rows */
+    long version;   /* Bumped whenever the rendered rows change. */
+    Arena arena;    /* Text of the rows we loaded. */
     int dirty;      /* File modified but not saved. */
     int tab_size;   /* Width of tabs */
     char *filename; /* Currently open filename */
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
+    struct editorPager *pager;      /* Set if this is a large file. */
+    struct editorHex *hex;          /* Set if this is a binary file. */
+    struct editorFollow *follow;    /* Set if we follow the file as it grows. */
+    struct editorDisk disk;         /* The file, as we last saw it. */
+    struct editorCold *cold;        /* Set once we compress rows. */
+    struct editorWrapIndex *wrap;   /* Set once we wrap long lines. */
+    struct editorScan scan;         /* What we found when loading the file. */
+    int crlf;                       /* Are lines saved with CRLF? */
+    int gzip;                       /* Is the file compressed? */
 #ifdef _UNDO
     UndoStack *undo;
 #endif
+    int id;         /* Unique ID, which never changes. */
+    int index;      /* Offset of this buffer in E.file[] */
+    struct fileState *id_next;   /* Next buffer in the same ID hash-chain. */
+    struct fileState *name_next; /* Next buffer in the same name hash-chain. */
+};
+
+
+/**
+ * The cursor position and scroll-offsets of a view onto a buffer.
+ */
+struct editorView
+{
+    int cx, cy;
+    int rowoff, coloff;
+    int wrapoff;
+};
+
+
+/**
+ * What we last drew in a window - if none of it has changed we don't
+ * need to draw the window's text again.
+ */
+struct editorDamage
+{
+    int buffer;
+    long version;
+    int rowoff, coloff, wrapoff;
+    int markx, marky;
+    int cx, cy;
+};
+
+
+/**
+ * Windows show a buffer upon part of the screen.
+ *
+ * They form a tree: a window is either split in two, or it shows a buffer
+ * followed by a status-line.  The active window's view is held by the
+ * current buffer, where the rest of the editor expects it, others keep
+ * their own.
+ */
+struct editorWindow
+{
+    int top, left;      /* Position on the screen, zero-based. */
+    int height, width;  /* Size, including the status-line. */
+    struct editorWindow *parent;
+
+    /*
+     * A split window has two children, side by side if `vertical` is set,
+     * otherwise one above the other.
+     */
+    struct editorWindow *child[2];
+    int vertical;
+
+    int buffer;                 /* ID of the buffer we show. */
+    struct editorView view;     /* Our view, unless we're active. */
+    struct editorDamage damage; /* What we last drew. */
+};
+
+
+/**
+ * A keyboard macro, recorded as the keys which were pressed.
+ */
+struct editorMacro
+{
+    int *keys;      /* The keys we've recorded. */
+    int len;        /* Number of keys recorded. */
+    int size;       /* Number of keys we have room for. */
+    int recording;  /* Are we recording keys? */
+    int seq_start;  /* Length of the macro when the current key-sequence began. */
+    int playing;    /* Are we replaying the macro? */
+    int pos;        /* Offset of the next key to replay. */
+};
+
+
+/**
+ * The most recent status-messages, which are shown in *Messages*.
+ */
+struct editorLog
+{
+    char *lines[KILO_LOG_LINES]; /* Ring of messages. */
+    int start;      /* Offset of the oldest message. */
+    int count;      /* Number of messages held. */
+    long appended;  /* Number of messages ever logged. */
+    long shown;     /* Value of `appended` when the buffer was last filled. */
+    struct fileState *buffer; /* The *Messages* buffer, or NULL if killed. */
+};
+
+
+/**
+ * Our standard input, which we read into a buffer as it arrives.
+ */
+struct editorStream
+{
+    int fd;         /* The input, or -1 if there's nothing to read. */
+    int buffer;     /* ID of the buffer it is read into. */
+    int partial;    /* Does the last row lack its newline? */
 };
 
 
@@ -169,9 +577,20 @@ struct fileState
  */
 struct editorState
 {
-    int screenrows; /* Number of rows that we can show */
-    int screencols; /* Number of cols that we can show */
+    int screenrows; /* Number of rows that we can show, in the active window */
+    int screencols; /* Number of cols that we can show, in the active window */
+    int termrows;   /* Size of the terminal. */
+    int termcols;
     int rawmode;    /* Is terminal raw mode enabled? */
+    volatile sig_atomic_t resized;  /* Set by SIGWINCH. */
+    int headless;   /* Running without a terminal, via --batch? */
+    int infd;       /* Where we read keys from. */
+    int outfd;      /* Where we write the screen to. */
+#ifdef _STATS
+    Stats stats;    /* Timings of recent frames. */
+#endif
+    struct editorMacro macro; /* The keyboard macro. */
+    struct editorLog log;     /* Recent status-messages. */
     char statusmsg[KILO_QUERY_LEN + 1]; /* The status-message */
 
     /*
@@ -180,6 +599,33 @@ struct editorState
     struct fileState **file;
     int current_file ;
     int max_files;
+    int file_size;  /* Number of buffers E.file has room for. */
+    int next_id;    /* ID of the next buffer we create. */
+
+    /*
+     * Hash-tables of buffers by ID and by name, with `hash_size` chains.
+     */
+    struct fileState **by_id;
+    struct fileState **by_name;
+    int hash_size;
+
+    /*
+     * Our windows, the active window, and whether everything must be
+     * drawn on the next refresh.
+     */
+    struct editorWindow *root;
+    struct editorWindow *window;
+    int redraw;
+
+    int64_t large_file; /* Files of this size, or more, are paged. */
+    int intern;         /* Do identical lines of new buffers share text? */
+    int wrap;           /* Are long lines wrapped, rather than scrolled? */
+    int64_t compress_rows; /* Buffers this large compress their cold rows. */
+    int inotify;        /* Watches the files we follow, or -1. */
+    struct editorStream stream; /* Standard input, given `-` as a file. */
+#ifdef _GZIP
+    int gzip_level;     /* Compression level for gzipped files. */
+#endif
 };
 
 /**
@@ -236,37 +682,188 @@ struct abuf
 /* prototypes */
 void disableRawMode(int fd);
 int dirty();
+int editorBufferDirty(struct fileState *f);
 void editorAtExit(void);
 int enableRawMode(int fd);
 int editorReadKey(int fd);
+int editorReadRawKey(int fd);
 void getWindowSize();
-void call_lua(char *function, char *arg);
+void editorWindowChanged(int sig);
+int editorCheckResize(void);
+int call_lua(char *function, char *arg);
 void strrev(char *p);
+double monotonic_us(void);
 char at(void);
 char *get_selection(void);
 int editorOpen(char *filename);
+int editorOpenAs(char *filename, int hex);
+unsigned int editorHashName(const char *name);
+void editorLinkBuffer(struct fileState *f);
+void editorUnlinkName(struct fileState *f);
+void editorUnlinkBuffer(struct fileState *f);
+struct fileState *editorBufferById(int id);
+struct fileState *editorBufferByName(const char *name);
+void editorSetBufferName(struct fileState *f, const char *name);
+struct fileState *editorCreateBuffer(const char *name);
+uint64_t editorHashRow(erow *row);
+int editorPagerScan(struct editorPager *p, int64_t line);
+int64_t editorPagerOffset(struct editorPager *p, int64_t line);
+void editorPagerFlush(struct fileState *f);
+void editorPagerShow(struct fileState *f, int64_t line);
+void editorPagerCheck(struct fileState *f);
+int editorPagerOpen(struct fileState *f, char *filename);
+void editorPagerFree(struct editorPager *p);
+int editorPagerCopy(struct editorPager *p, FILE *out, int64_t from, int64_t to);
+int editorPagerSave(struct fileState *f);
+int editorHexOpen(struct fileState *f, char *filename);
+void editorHexFree(struct editorHex *h);
+int editorHexCheck(struct fileState *f);
+int editorHexDigits(struct editorHex *h);
+int64_t editorHexOffset(struct fileState *f);
+int editorHexFind(struct editorHex *h, int64_t offset);
+int editorHexByte(struct editorHex *h, int64_t offset);
+void editorHexPut(struct fileState *f, int64_t offset, int byte);
+void editorHexMove(struct fileState *f, int key);
+void editorHexType(struct fileState *f, int c);
+void editorHexDrawRows(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v);
+int editorHexWrite(int fd, const unsigned char *data, int64_t len);
+int editorHexSave(struct fileState *f);
+#ifdef _GZIP
+int editorGzipped(FILE *fp);
+int editorGzipLoad(struct fileState *f, char *filename);
+char *editorGzipRead(char *filename, size_t *len);
+int editorGzipSave(struct fileState *f);
+#endif
+int64_t editorStatTime(struct stat *st);
+void editorDiskWatch(struct fileState *f);
+void editorDiskUnwatch(struct fileState *f);
+void editorDiskRecord(struct fileState *f);
+void editorDiskCheck(struct fileState *f);
+void editorDiskEvents(void);
+void editorDiskPoll(void);
+void editorDiffLines(erow *a, int n, char **b, int *bsize, int m, int *match, int limit);
+void editorReloadView(struct fileState *f, struct editorView *v, int *where, int n);
+int editorReload(struct fileState *f);
+void editorAppendText(struct fileState *f, char *text, size_t len, int *partial);
+void editorFollowView(struct fileState *f, struct editorView *v, int rows, int old);
+void editorFollowWindows(struct fileState *f, int old);
+void editorFollowReset(struct fileState *f);
+void editorFollowRead(struct fileState *f);
+void editorFollowUpdate(struct fileState *f);
+int editorFollowStart(struct fileState *f);
+void editorFollowStop(struct fileState *f);
+int editorColdFind(struct editorCold *c, int at);
+int editorColdNear(struct fileState *f, int lo, int hi);
+void editorColdFreeze(struct fileState *f, struct editorColdBlock *k);
+void editorColdThaw(struct fileState *f, int b);
+void editorRowWarm(struct fileState *f, erow *row);
+void editorColdInsert(struct fileState *f, int at);
+void editorColdDelete(struct fileState *f, int at);
+void editorColdCompact(struct fileState *f);
+void editorColdSweep(struct fileState *f);
+void editorColdCheck(struct fileState *f);
+void editorColdThawAll(struct fileState *f);
+void editorColdFree(struct fileState *f);
+void editorStreamOpen(struct fileState *f);
+void editorStreamRead(void);
+void editorGetView(struct fileState *f, struct editorView *v);
+void editorSetView(struct fileState *f, struct editorView *v);
+void editorClampView(struct editorView *v, int rows, int cols);
+void editorSaveView(void);
+void editorLoadView(void);
+void editorLayoutWindow(struct editorWindow *w, int top, int left, int height, int width);
+void editorLayout(void);
+void editorResizeScreen(int rows, int cols);
+struct editorWindow *editorFirstWindow(struct editorWindow *w);
+struct editorWindow *editorNextWindow(struct editorWindow *w);
+void editorFreeWindow(struct editorWindow *w);
+void editorSplitWindow(int vertical);
+void editorFreeKeywords(char **keywords);
+void editorFreeBuffer(struct fileState *f);
 int is_separator(int c);
-int editorRowHasOpenComment(erow *row);
-void editorUpdateSyntax(erow *row);
+int editorRowHasOpenComment(struct fileState *f, erow *row);
+void editorUpdateSyntax(struct fileState *f, erow *row);
+void editorHighlightRow(struct fileState *f, erow *row, unsigned char *hl);
+void editorSetSpans(erow *row, unsigned char *hl, int from, int to);
+void editorLexStart(struct fileState *f, erow *row, struct editorLex *s);
+int editorLexSame(struct editorLex *a, struct editorLex *b);
+void editorLexRow(struct fileState *f, erow *row, struct editorLex *s, int to,
+                  unsigned char *hl, int base);
+int editorKeywordMatch(struct fileState *f, erow *row, int at, int *kw2);
+void editorSyntaxFreeRegex(struct editorSyntax *s);
+void editorGiantStart(struct fileState *f, erow *row);
+void editorGiantFree(erow *row);
+void editorGiantEdit(erow *row, int at, int delta);
+int editorGiantLex(struct fileState *f, erow *row, int upto);
+void editorGiantHighlight(struct fileState *f, erow *row, int from, int to);
 int editorSyntaxToColor(int hl);
 char *get_input(char *prompt);
-void editorUpdateRow(erow *row);
-void editorInsertRow(int at, char *s, size_t len);
+void editorUpdateRow(struct fileState *f, erow *row);
+void editorUpdateRowEdit(struct fileState *f, erow *row, int at, int delta);
+void editorColumnsEdit(struct fileState *f, erow *row, int at, int delta);
+int editorTabStop(struct fileState *f, int col);
+int editorRowColumn(struct fileState *f, erow *row, int at);
+int editorCharWidth(struct fileState *f, erow *row, int at, int col, int *len);
+int editorRowCharStart(struct fileState *f, erow *row, int at);
+int editorRowNext(struct fileState *f, erow *row, int at);
+int editorRowPrev(struct fileState *f, erow *row, int at);
+void editorScanReset(struct editorScan *s);
+void editorScanByte(struct editorScan *s, unsigned char c);
+void editorScanText(struct editorScan *s, const char *text, size_t len);
+void editorScanEnd(struct editorScan *s);
+int editorScanBinary(struct editorScan *s);
+int editorWrapping(struct fileState *f);
+int editorWrapEnd(struct fileState *f, erow *row, int at, int width);
+int editorWrapLines(struct fileState *f, erow *row, int width);
+int editorWrapStart(struct fileState *f, erow *row, int seg, int width);
+int editorWrapSegment(struct fileState *f, erow *row, int at, int width, int *start);
+int editorWrapColumn(struct fileState *f, erow *row, int start, int width, int x);
+void editorWrapTree(struct editorWrapIndex *x);
+void editorWrapBuild(struct fileState *f, int width);
+void editorWrapCheck(struct fileState *f, int width);
+void editorWrapFree(struct fileState *f);
+void editorWrapUpdate(struct fileState *f, erow *row);
+void editorWrapInsert(struct fileState *f, int at);
+void editorWrapDelete(struct fileState *f, int at);
+int64_t editorWrapLine(struct editorWrapIndex *x, int row);
+int editorWrapFind(struct editorWrapIndex *x, int64_t line, int64_t *first);
+void editorWrapScroll(struct fileState *f, int rows, int width);
+void editorWrapMove(struct fileState *f, int key);
+void editorInsertRow(struct fileState *f, int at, char *s, size_t len);
+void editorInsertRowChars(struct fileState *f, int at, char *chars, size_t len, int arena);
 void editorFreeRow(erow *row);
-void editorDelRow(int at);
-char *editorRowsToString(int *buflen);
-void editorRowInsertChar(erow *row, int at, int c);
-void editorRowAppendString(erow *row, char *s, size_t len);
-void editorRowDelChar(erow *row, int at);
+void editorRowOwnChars(erow *row);
+void editorDelRow(struct fileState *f, int at);
+char *editorRowsToString(struct fileState *f, int *buflen);
+void editorRowInsertChar(struct fileState *f, erow *row, int at, int c);
+void editorRowAppendString(struct fileState *f, erow *row, char *s, size_t len);
+void editorRowDelChar(struct fileState *f, erow *row, int at);
 void editorInsertChar(int c);
 void editorInsertNewline(void);
 void warp(int x, int y);
 void abAppend(struct abuf *ab, const char *s, int len);
 void abFree(struct abuf *ab);
-void editorRefreshScreen(void);
+void editorDrawRun(struct abuf *ab, int color, char *text, int len, int *current);
+void editorClearLine(struct abuf *ab, struct editorWindow *w, int used);
+void editorRowSelection(struct fileState *f, struct editorView *v, int filerow, int *from, int *to);
+int editorDrawRow(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v,
+                  int filerow, int from, int to);
+void editorDrawRows(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v);
+void editorDrawStatus(struct abuf *ab, struct editorWindow *w, struct fileState *f, struct editorView *v);
+void editorDrawWindow(struct abuf *ab, struct editorWindow *w);
+int editorRefreshScreen(void);
 void editorSetStatusMessage(int log, const char *fmt, ...);
 void editorMoveCursor(int key);
 int load_lua(char *filename);
+int editorBatchFile(char *filename);
+int editorBatch(char *script, int nfiles, char **files, int jobs);
+int editorReplay(char *keys, int bench, double open_ms);
+void editorLogMessage(const char *msg);
+void editorUpdateMessages(void);
+void editorUpdateStats(void);
+#ifdef _STATS
+void editorCloseTrace(void);
+#endif
 void editorProcessKeypress(int fd);
 void initEditor(void);
 int main(int argc, char **argv);
@@ -299,6 +896,11 @@ extern  int kill_line_lua(lua_State *L);
 extern  int key_lua(lua_State *L);
 extern  int insert_lua(lua_State *L);
 
+/* Macros */
+extern  int macro_record_lua(lua_State *L);
+extern  int macro_replay_lua(lua_State *L);
+extern  int macro_stop_lua(lua_State *L);
+
 /* Markers */
 extern  int mark_lua(lua_State *L);
 extern  int point_lua(lua_State *L);
@@ -306,13 +908,26 @@ extern  int point_lua(lua_State *L);
 /* Core */
 extern  int eval_lua(lua_State *L);
 extern  int exit_lua(lua_State *L);
+extern  int file_info_lua(lua_State *L);
 extern  int find_lua(lua_State *L);
+extern  int follow_lua(lua_State *L);
+extern  int memory_stats_lua(lua_State *L);
+extern  int goto_line_lua(lua_State *L);
+extern  int gzip_level_lua(lua_State *L);
+extern  int hex_lua(lua_State *L);
+extern  int compress_rows_lua(lua_State *L);
+extern  int crlf_lua(lua_State *L);
+extern  int intern_lua(lua_State *L);
+extern  int large_file_lua(lua_State *L);
 extern  int open_lua(lua_State *L);
+extern  int reload_lua(lua_State *L);
 extern  int prompt_lua(lua_State *L);
 extern  int save_lua(lua_State *L);
 extern  int search_lua(lua_State *L);
+extern  int stats_lua(lua_State *L);
 extern  int status_lua(lua_State *L);
 extern  int undo_lua(lua_State *L);
+extern  int wrap_lua(lua_State *L);
 
 /* Syntax highlighting */
 extern  int set_syntax_comments_lua(lua_State *L);
@@ -322,6 +937,7 @@ extern  int syntax_highlight_strings_lua(lua_State *L);
 extern  int tabsize_lua(lua_State *L);
 
 /* Buffers */
+extern int buffer_list_lua(lua_State *L);
 extern int choose_buffer_lua(lua_State *L);
 extern int count_buffers_lua(lua_State *L);
 extern int create_buffer_lua(lua_State *L);
@@ -330,3 +946,10 @@ extern int kill_buffer_lua(lua_State *L);
 extern int next_buffer_lua(lua_State *L);
 extern int prev_buffer_lua(lua_State *L);
 extern int select_buffer_lua(lua_State *L);
+
+/* windows */
+extern int delete_other_windows_lua(lua_State *L);
+extern int delete_window_lua(lua_State *L);
+extern int other_window_lua(lua_State *L);
+extern int split_window_below_lua(lua_State *L);
+extern int split_window_right_lua(lua_State *L);
@@ -16,7 +16,8 @@
      Called when things are idle, to allow actions to be carried out.
 
   * on_key(key)
-     Called when input is received.
+     Called when input is received.  Returns true if the key was the
+     prefix of a longer key-sequence.
 
   * on_loaded(filename)
      Called after a file is loaded.
@@ -100,7 +101,7 @@ keymap['DOWN']      = down
 -- Esc-Home/Esc-End goes to start/end of file
 --
 keymap['HOME']      = sol
-keymap['M-HOME']    = function() point(0,0) end
+keymap['M-HOME']    = function() goto_line(1) end
 keymap['END']       = eol
 keymap['M-END']     = function() end_of_file() end
 
@@ -141,6 +142,20 @@ keymap['^X']['^S'] = save
 keymap['^X']['^X'] = function() swap_point_mark() end
 
 
+--
+-- Keyboard macros, just like emacs.
+--
+--  ^X (  => Start recording
+--  ^X )  => Stop recording
+--  ^X e  => Replay
+--
+-- To replay many times use `M-x macro_replay(100)`.
+--
+keymap['^X']['(']  = macro_record
+keymap['^X'][')']  = macro_stop
+keymap['^X']['e']  = macro_replay
+
+
 --
 -- Working with buffers.
 --
@@ -153,6 +168,17 @@ keymap['M-RIGHT']  = next_buffer
 keymap['^X']['n']  = next_buffer
 keymap['M-LEFT']   = prev_buffer
 keymap['^X']['p']  = prev_buffer
+keymap['^X']['f']  = function() follow(not follow()) end
+
+
+--
+-- Working with windows.
+--
+keymap['^X']['0']  = delete_window
+keymap['^X']['1']  = delete_other_windows
+keymap['^X']['2']  = split_window_below
+keymap['^X']['3']  = split_window_right
+keymap['^X']['o']  = other_window
 
 
 --
@@ -376,7 +402,7 @@ do
       --
       if ( k == "ESC" ) then
          pending_esc = true
-         return
+         return true
       end
 
 
@@ -428,7 +454,7 @@ do
             -- This is a pending multi-part key - record this part away.
             --
             pending_char = k
-            return
+            return true
          end
       end
 
@@ -551,15 +577,8 @@ end
 -- Move to end of file
 --
 function end_of_file()
-   -- Move to top of file.
-   point(0,0)
-
    -- Move to last line
-   repeat
-      local x,y = point()
-      down()
-      local a,b  = point()
-   until ( a==x ) and ( b == y )
+   goto_line(math.huge)
 
    -- Move to end of line.
    eol()
@@ -697,11 +716,11 @@ function quit()
    --
    -- For each buffer
    --
-   for i=0,(buffers()-1) do
+   for _,id in ipairs(buffer_list()) do
       --
       -- Select the buffer
       --
-      select_buffer( i )
+      select_buffer( id )
 
       --
       -- Is it dirty?
@@ -811,6 +830,18 @@ function on_idle()
 end
 
 
+--
+-- Show the timings of recent frames in the `*Stats*` buffer, which
+-- is kept up to date for as long as it is the current buffer.
+--
+function show_stats()
+   local result = select_buffer( "*Stats*" )
+   if ( result == 0 ) then
+      create_buffer( "*Stats*" )
+   end
+end
+
+
 --
 -- Call `make` - showing the output in our `*MAKE*` buffer.
 --
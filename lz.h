@@ -0,0 +1,239 @@
+/* lz.h -- A small LZ77 compressor, after the fashion of LZ4.
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 Steve Kemp https://steve.kemp.fi/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * The compressed data is a series of sequences, each of which is a
+ * token byte, the number of literal bytes which follow, the literals,
+ * then the offset and length of a match against the text already
+ * decompressed.  The token holds the literal count in its top four
+ * bits, and the match length (less LZ_MIN_MATCH) in the bottom four;
+ * if either is fifteen further bytes are added to it, until a byte
+ * other than 255 is seen.  The final sequence has no match.
+ */
+#define LZ_MIN_MATCH 4
+
+/*
+ * Matches are found via a hash-table of this many bits.
+ */
+#define LZ_HASH_BITS 12
+
+
+/*
+ * The most bytes which compressing `len` bytes might produce.
+ */
+size_t lz_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+
+/*
+ * Read four bytes, which might not be aligned.
+ */
+uint32_t lz_read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+/*
+ * Write a count which didn't fit in its half of the token.
+ */
+char *lz_length(char *out, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *out++ = (char)255;
+
+    *out++ = (char)n;
+    return out;
+}
+
+
+/*
+ * Write a sequence of `lit` literals, from `src`, followed by a match of
+ * `len` bytes at `offset` bytes back.  The last sequence has no match,
+ * which is shown by `len` being zero.
+ */
+char *lz_sequence(char *out, const char *src, size_t lit, size_t offset, size_t len)
+{
+    size_t m = len ? len - LZ_MIN_MATCH : 0;
+
+    *out++ = (char)(((lit < 15 ? lit : 15) << 4) | (m < 15 ? m : 15));
+
+    if (lit >= 15)
+        out = lz_length(out, lit - 15);
+
+    memcpy(out, src, lit);
+    out += lit;
+
+    if (len == 0)
+        return out;
+
+    *out++ = (char)(offset & 0xff);
+    *out++ = (char)(offset >> 8);
+
+    if (m >= 15)
+        out = lz_length(out, m - 15);
+
+    return out;
+}
+
+
+/*
+ * Compress the `len` bytes at `src` into `dst`, which must have room for
+ * lz_bound(len) bytes, and return the size of the result.
+ */
+size_t lz_compress(const char *src, size_t len, char *dst)
+{
+    size_t table[1 << LZ_HASH_BITS] = { 0 };
+    size_t i = 0, anchor = 0;
+    char *out = dst;
+
+    while (i + LZ_MIN_MATCH <= len)
+    {
+        uint32_t v = lz_read32(src + i);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+
+        /*
+         * Table entries are one more than the position, so that zero
+         * means there are none.
+         */
+        size_t cand = table[h];
+        table[h] = i + 1;
+
+        if (cand == 0 || i + 1 - cand > 0xffff || lz_read32(src + cand - 1) != v)
+        {
+            i++;
+            continue;
+        }
+
+        size_t from = cand - 1, n = LZ_MIN_MATCH;
+
+        while (i + n < len && src[from + n] == src[i + n])
+            n++;
+
+        out = lz_sequence(out, src + anchor, i - anchor, i - from, n);
+        i += n;
+        anchor = i;
+    }
+
+    out = lz_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out - dst;
+}
+
+
+/*
+ * Read a count which didn't fit in its half of the token, returning
+ * NULL if we'd run off the end of the input.
+ */
+const unsigned char *lz_count(const unsigned char *in, const unsigned char *end, size_t *n)
+{
+    unsigned char b;
+
+    do
+    {
+        if (in >= end)
+            return NULL;
+
+        b = *in++;
+        *n += b;
+    }
+    while (b == 255);
+
+    return in;
+}
+
+
+/*
+ * Decompress the `len` bytes at `src` into `dst`, which has room for `cap`
+ * bytes.  Returns the size of the result, or -1 if the data is corrupt.
+ */
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *in = (const unsigned char *)src, *end = in + len;
+    size_t o = 0;
+
+    while (in < end)
+    {
+        unsigned char token = *in++;
+        size_t lit = token >> 4, m = token & 15;
+
+        if (lit == 15 && (in = lz_count(in, end, &lit)) == NULL)
+            return -1;
+
+        if (lit > (size_t)(end - in) || lit > cap - o)
+            return -1;
+
+        memcpy(dst + o, in, lit);
+        in += lit;
+        o += lit;
+
+        /*
+         * The last sequence has no match.
+         */
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return -1;
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        if (m == 15 && (in = lz_count(in, end, &m)) == NULL)
+            return -1;
+
+        m += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > o || m > cap - o)
+            return -1;
+
+        /*
+         * The match may overlap the bytes it produces, so copy them
+         * one at a time.
+         */
+        for (size_t k = 0; k < m; k++, o++)
+            dst[o] = dst[o - offset];
+    }
+
+    return (long)o;
+}
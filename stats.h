@@ -0,0 +1,296 @@
+/* stats.h -- Rolling timing statistics for the main-loop.
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 Steve Kemp https://steve.kemp.fi/
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _STATS
+
+/*
+ * The things we time, for each frame.
+ *
+ * Note that these nest: Lua dispatch includes any mutation it
+ * triggers, which in turn includes the cost of re-highlighting.
+ */
+typedef enum
+{
+    STAT_READ,      /* Reading & decoding a key. */
+    STAT_LUA,       /* Running Lua callbacks. */
+    STAT_MUTATE,    /* Inserting/deleting rows & characters. */
+    STAT_SYNTAX,    /* Syntax-highlighting. */
+    STAT_RENDER,    /* Drawing the screen. */
+    STAT_FRAME,     /* From reading a key to drawing the result. */
+    STAT_BYTES,     /* Bytes written to the terminal. */
+    STAT_MAX
+} stat_type;
+
+/*
+ * Human-readable names of each of the above.
+ */
+static const char *stat_names[STAT_MAX] =
+{
+    "read", "lua", "mutate", "syntax", "render", "frame", "bytes"
+};
+
+
+/*
+ * We keep this many frames of history.
+ */
+#define STATS_WINDOW 1024
+
+/*
+ * Histogram buckets are powers of two: bucket N holds values
+ * in the range [2^(N-1), 2^N).
+ */
+#define STATS_BUCKETS 24
+
+
+/*
+ * The history of a single measurement.
+ */
+typedef struct StatSeries
+{
+    /*
+     * The most recent samples, as a ring.
+     */
+    double samples[STATS_WINDOW];
+
+    /*
+     * Histogram of the samples currently in the ring.
+     */
+    int hist[STATS_BUCKETS];
+
+} StatSeries;
+
+
+/*
+ * All our statistics.
+ */
+typedef struct Stats
+{
+    /*
+     * History of each measurement, all sharing the same ring-position.
+     */
+    StatSeries series[STAT_MAX];
+    int head;
+    int count;
+
+    /*
+     * Total number of frames we've seen.
+     */
+    long frames;
+
+    /*
+     * The frame in progress: when it began, the time spent in each
+     * phase so far, and when the current invocation of each began.
+     */
+    double frame_start;
+    double current[STAT_MAX];
+    double started[STAT_MAX];
+    int depth[STAT_MAX];
+
+    /*
+     * If non-NULL we write Chrome trace-events here.
+     */
+    FILE *trace;
+    int traced;
+
+} Stats;
+
+
+/* Implemented in kilua.c */
+double monotonic_us(void);
+
+
+/*
+ * Find the histogram bucket for the given value.
+ */
+int stats_bucket(double value)
+{
+    int b = 0;
+
+    while (value >= 1 && b < STATS_BUCKETS - 1)
+    {
+        value /= 2;
+        b += 1;
+    }
+
+    return b;
+}
+
+/*
+ * Write a single event to our trace-file, if we have one.
+ */
+void stats_trace(Stats *S, const char *name, double start, double duration)
+{
+    if (S->trace == NULL)
+        return;
+
+    fprintf(S->trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+            S->traced++ ? ",\n" : "[\n", name, start, duration);
+}
+
+/*
+ * Start timing the given phase.  Nested calls are ignored.
+ */
+void stats_start(Stats *S, stat_type type)
+{
+    if (S->depth[type]++ == 0)
+        S->started[type] = monotonic_us();
+}
+
+/*
+ * Stop timing the given phase.
+ */
+void stats_stop(Stats *S, stat_type type)
+{
+    if (S->depth[type] == 0 || --S->depth[type] != 0)
+        return;
+
+    double now = monotonic_us();
+    S->current[type] += now - S->started[type];
+    stats_trace(S, stat_names[type], S->started[type], now - S->started[type]);
+}
+
+/*
+ * A new frame starts, because a key has arrived.
+ */
+void stats_frame_start(Stats *S)
+{
+    if (S->frame_start == 0)
+        S->frame_start = monotonic_us();
+}
+
+/*
+ * The screen has been drawn - record the frame that ended.
+ *
+ * Updates which weren't triggered by a key aren't recorded.
+ */
+void stats_frame_end(Stats *S, int bytes)
+{
+    if (S->frame_start != 0)
+    {
+        double now = monotonic_us();
+        S->current[STAT_FRAME] = now - S->frame_start;
+        S->current[STAT_BYTES] = bytes;
+
+        stats_trace(S, "frame", S->frame_start, now - S->frame_start);
+
+        if (S->trace)
+            fprintf(S->trace, ",\n{\"name\":\"bytes\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"bytes\":%d}}",
+                    now, bytes);
+
+        for (int i = 0; i < STAT_MAX; i++)
+        {
+            StatSeries *s = &S->series[i];
+
+            /* Forget the oldest sample, once the ring is full. */
+            if (S->count == STATS_WINDOW)
+                s->hist[stats_bucket(s->samples[S->head])] -= 1;
+
+            s->samples[S->head] = S->current[i];
+            s->hist[stats_bucket(S->current[i])] += 1;
+        }
+
+        S->head = (S->head + 1) % STATS_WINDOW;
+
+        if (S->count < STATS_WINDOW)
+            S->count += 1;
+
+        S->frames += 1;
+    }
+
+    S->frame_start = 0;
+    memset(S->current, 0, sizeof(S->current));
+}
+
+/*
+ * qsort() comparison for doubles.
+ */
+int stats_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Summarize the recorded history of the given measurement.
+ */
+void stats_summary(Stats *S, stat_type type, double *p50, double *p99, double *max, double *mean)
+{
+    double sorted[STATS_WINDOW];
+    double total = 0;
+
+    *p50 = *p99 = *max = *mean = 0;
+
+    if (S->count == 0)
+        return;
+
+    memcpy(sorted, S->series[type].samples, sizeof(double) * S->count);
+    qsort(sorted, S->count, sizeof(double), stats_cmp);
+
+    for (int i = 0; i < S->count; i++)
+        total += sorted[i];
+
+    *p50  = sorted[S->count / 2];
+    *p99  = sorted[(int)(S->count * 0.99)];
+    *max  = sorted[S->count - 1];
+    *mean = total / S->count;
+}
+
+/*
+ * Finish writing our trace-file, if any.
+ */
+void stats_close(Stats *S)
+{
+    if (S->trace == NULL)
+        return;
+
+    fprintf(S->trace, "%s]\n", S->traced ? "\n" : "[\n");
+    fclose(S->trace);
+    S->trace = NULL;
+}
+
+#else
+
+/*
+ * Statistics are disabled, so our hooks compile to nothing.
+ */
+#define stats_start(S, type)      do { } while (0)
+#define stats_stop(S, type)       do { } while (0)
+#define stats_frame_start(S)      do { } while (0)
+#define stats_frame_end(S, bytes) ((void)(bytes))
+
+#endif
@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Run each of our regression tests, reporting those which fail.
+#
+# Usage: test/run.sh [path/to/kilua]
+#
+# Each test runs a script against a file in batch-mode, and compares
+# the file it saved with the output we expect.  Settings which must be
+# made before the file is loaded, such as `large_file()`, are made in a
+# configuration file of their own.
+#
+
+
+KILUA=$(cd "$(dirname "${1:-./kilua}")" && pwd)/$(basename "${1:-./kilua}")
+CONFIG=$(pwd)/kilua.lua
+
+#
+# Scratch directory for our inputs.
+#
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+
+#
+# Load the configuration in $2, run the lua in $3 against a copy of the
+# file $4, and compare the result with the file $5.
+#
+check() {
+    name=$1
+
+    printf '%s\n' "$2" > "$TMP/$name.cfg"
+    printf '%s\n' "$3" > "$TMP/$name.lua"
+    cp "$4" "$TMP/$name.txt"
+
+    if ! "$KILUA" --config "$CONFIG" --config "$TMP/$name.cfg" --batch "$TMP/$name.lua" "$TMP/$name.txt" 2>"$TMP/$name.err"; then
+        echo "FAIL: $name"
+        cat "$TMP/$name.err"
+        failed=1
+    elif ! cmp -s "$TMP/$name.txt" "$5"; then
+        echo "FAIL: $name"
+        diff "$5" "$TMP/$name.txt" | head -n 10
+        failed=1
+    else
+        echo "ok: $name"
+    fi
+}
+
+
+#
+# large files: edits made to a span, after moving away and back, must
+# replace it rather than being added alongside it.
+#
+awk 'BEGIN { for (i = 1; i <= 20000; i++) print "line " i }' > "$TMP/large.txt"
+
+awk '{ if (NR == 10) print "ZNEW"; print }' "$TMP/large.txt" > "$TMP/expect"
+check pager-insert 'large_file(1)' \
+    'goto_line(10) insert("NEW\n") goto_line(10000) goto_line(10) insert("Z") save()' \
+    "$TMP/large.txt" "$TMP/expect"
+
+awk '{ if (NR == 9) { print "line 9Y"; print "NEW" } else print }' "$TMP/large.txt" > "$TMP/expect"
+check pager-before 'large_file(1)' \
+    'goto_line(10) insert("NEW\n") goto_line(10000) goto_line(9) eol() insert("Y") save()' \
+    "$TMP/large.txt" "$TMP/expect"
+
+awk '{ if (NR == 10) { print "NEW"; print "Z" $0 } else print }' "$TMP/large.txt" > "$TMP/expect"
+check pager-resave 'large_file(1)' \
+    'goto_line(10) insert("NEW\n") save() insert("Z") save()' \
+    "$TMP/large.txt" "$TMP/expect"
+
+
+#
+# follow: reading on from where the file ended, although our rows
+# have lost their CRs, or have been edited since.
+#
+printf 'a\r\nb\r\nc\r\n' > "$TMP/crlf.txt"
+printf 'a\r\nb\r\nc\r\nd\r\n' > "$TMP/expect"
+check follow-crlf '' \
+    "local fh = io.open(\"$TMP/follow-crlf.txt\", \"a\") fh:write(\"d\\n\") fh:close()
+     follow(true) follow(false) save()" \
+    "$TMP/crlf.txt" "$TMP/expect"
+
+printf 'a\nb\nc\n' > "$TMP/lines.txt"
+printf 'X\na\nb\nc\nd\n' > "$TMP/expect"
+check follow-edited '' \
+    "insert(\"X\\n\") local fh = io.open(\"$TMP/follow-edited.txt\", \"a\") fh:write(\"d\\n\") fh:close()
+     follow(true) follow(false) save()" \
+    "$TMP/lines.txt" "$TMP/expect"
+
+
+#
+# gzip: a truncated file is loaded as far as it goes, but isn't taken
+# for the file itself.
+#
+awk 'BEGIN { for (i = 1; i <= 200000; i++) print i }' | gzip | head -c 200000 > "$TMP/truncated.txt"
+check gzip-truncated '' \
+    'if not dirty() then save() end' \
+    "$TMP/truncated.txt" "$TMP/truncated.txt"
+
+
+#
+# hex: a binary file cut short by something else mustn't be read beyond
+# its new end, as its map would raise SIGBUS.
+#
+head -c 100000 /dev/zero > "$TMP/binary.txt"
+: > "$TMP/expect"
+check hex-truncated '' \
+    "io.open(\"$TMP/hex-truncated.txt\", \"w\"):close() insert(\"a\") save()" \
+    "$TMP/binary.txt" "$TMP/expect"
+
+
+exit $failed
@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _UNDO
 
@@ -68,6 +69,11 @@ typedef struct UndoAction
      */
     int x, y;
 
+    /*
+     * Actions which share a non-zero group are undone together.
+     */
+    int group;
+
 } UndoAction;
 
 
@@ -87,6 +93,13 @@ typedef struct UndoStack
      */
     struct UndoAction **elements;
 
+    /*
+     * The group new actions are added to, if non-zero, and the
+     * most recent group we've handed out.
+     */
+    int group;
+    int last_group;
+
 } UndoStack;
 
 
@@ -99,6 +112,8 @@ UndoStack * us_create()
     UndoStack *S = (UndoStack *)malloc(sizeof(UndoStack));
     S->elements = NULL;
     S->size = 0;
+    S->group = 0;
+    S->last_group = 0;
     return S;
 }
 
@@ -125,7 +140,7 @@ void us_push(UndoStack *S, UndoAction *action)
 {
     int size = S->size;
 
-    S->elements = realloc(S->elements, sizeof(UndoAction) * size + 1);
+    S->elements = realloc(S->elements, sizeof(UndoAction *) * (size + 1));
     S->elements[size] = action;
     S->size = size + 1;
 }
@@ -154,16 +169,61 @@ void us_clear(UndoStack *S)
     S->size = 0;
 }
 
+/*
+ * Return the action which would be popped next, without removing it.
+ */
+UndoAction *us_peek(UndoStack *S)
+{
+    if (S->size == 0)
+        return NULL;
+
+    return S->elements[S->size - 1];
+}
+
+/*
+ * Start a group - all the actions added until us_end_group() is
+ * called will be undone as one.
+ */
+void us_begin_group(UndoStack *S)
+{
+    S->last_group += 1;
+    S->group = S->last_group;
+}
+
+/*
+ * End the current group.
+ */
+void us_end_group(UndoStack *S)
+{
+    S->group = 0;
+}
+
+/*
+ * Forget the oldest `count` actions.
+ */
+void us_drop(UndoStack *S, int count)
+{
+    if (count > S->size)
+        count = S->size;
+
+    for (int i = 0; i < count; i++)
+        free(S->elements[i]);
+
+    memmove(S->elements, S->elements + count, sizeof(UndoAction *) * (S->size - count));
+    S->size -= count;
+}
+
 /*
  * Add an undo-operation, taking care of the allocation.
  */
 void add_undo(UndoStack *S, undo_type type, char data, int x, int y)
 {
     UndoAction *u = (UndoAction *)malloc(sizeof(UndoAction));
-    u->type = type;
-    u->data = data;
-    u->x    = x;
-    u->y    = y;
+    u->type  = type;
+    u->data  = data;
+    u->x     = x;
+    u->y     = y;
+    u->group = S->group;
 
     us_push(S, u);
 }